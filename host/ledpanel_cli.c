@@ -0,0 +1,271 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * Command line front end of the host library, streams frames from
+ * stdin (packed like ledpanel_buffer, all planes, MSB plane first, or
+ * 8 bit gray with -d).
+ */
+
+#include "ledpanel_host.h"
+#include "ledpanel_dither.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-m modules] [-g bits|-f] [-d dither] [-r file] command [arg]\n"
+		"  -r file          record to file instead of sending to the\n"
+		"                   panel, for test/sim/ledpanel_sim\n"
+		"  -f               temporal dithering on the panel, 2 bits\n"
+		"  -d none|ordered|diffusion  input is 8 bit gray\n"
+		"  on, off          start/stop the refresh\n"
+		"  bright n         brightness 0..255\n"
+		"  stats            print counters\n"
+		"  raw              stream raw frames from stdin\n"
+		"  packbits         stream PackBits/XOR delta frames\n"
+		"  queue n          stream to the frame queue, one frame\n"
+		"                   every n refresh frames\n"
+		"  text x y font s  draw s with a font of the panel, font is\n"
+		"                   the number | USB_PROTO_TEXT_* flags\n"
+		"  upload n idle    store monochrome frames from stdin in the\n"
+		"                   panel's flash, each shown for n refresh\n"
+		"                   frames, played again after idle seconds\n"
+		"                   without data from the host (0: never)\n"
+		"  play, stop       play the stored frames, or stop\n",
+		argv0);
+	exit(1);
+}
+
+static int print_stats(struct ledpanel *p)
+{
+	struct usb_if_stats st;
+
+	if (ledpanel_stats(p, &st) < 0)
+		return -1;
+	printf("rows=%u frames=%u shown=%u bulk_packets=%u bulk_bytes=%u "
+	       "raw_frames=%u dma_busy=%u queue_dropped=%u loops_per_sec=%u\n",
+	       st.rows, st.frames, st.shown, st.bulk_packets, st.bulk_bytes,
+	       st.raw_frames, st.dma_busy, st.queue_dropped, st.loops_per_sec);
+	return 0;
+}
+
+static const char *dither_modes[] = { "none", "ordered", "diffusion" };
+
+/* 8 bit gray input, converted by 'dither' */
+static struct ledpanel_dither dither;
+static uint8_t *gray;
+
+/* the flash has room for 16k, see ledpanel_store_flash.c */
+#define IMAGE_MAX 16384
+
+static int dither_setup(struct ledpanel *p, int dither_mode)
+{
+	if (dither_mode < 0)
+		return 0;
+	if (ledpanel_dither_init(&dither, p->width, p->height, p->planes,
+				 dither_mode) < 0)
+		return -1;
+	gray = malloc(p->width * p->height);
+	return gray ? 0 : -1;
+}
+
+static int read_frame(struct ledpanel *p, uint8_t *dst)
+{
+	if (!gray)
+		return fread(dst, p->frame_bytes, 1, stdin) == 1;
+	if (fread(gray, p->width * p->height, 1, stdin) != 1)
+		return 0;
+	ledpanel_dither_frame(&dither, dst, gray, p->width);
+	return 1;
+}
+
+/* mode: 'r'aw, 'p'ackbits or 'q'ueue, dither_mode < 0: packed input */
+static int stream(struct ledpanel *p, int mode, unsigned int interval,
+		  int dither_mode)
+{
+	uint8_t *frame = malloc(p->frame_bytes), *prev = NULL, *dst;
+	unsigned long n = 0;
+	int ret = -1;
+
+	if (!frame || ledpanel_bulk_mode(p, mode != 'r') < 0 ||
+	    ledpanel_reset_writeptr(p) < 0 || dither_setup(p, dither_mode) < 0)
+		goto out;
+
+	while (1) {
+		/* raw and queued frames are read right into the transfer */
+		if (mode == 'r')
+			dst = ledpanel_raw_frame(p);
+		else if (mode == 'q')
+			dst = ledpanel_queue_frame(p, interval);
+		else
+			dst = frame;
+		if (!dst)
+			goto out;
+		if (!read_frame(p, dst)) {
+			/* give back what has been reserved for it */
+			if (mode != 'p')
+				ledpanel_unreserve(p, p->frame_bytes + (mode == 'q' ?
+						   sizeof(struct usb_proto_hdr) : 0));
+			break;
+		}
+		if (mode == 'p') {
+			if (ledpanel_packbits(p, frame, prev) < 0)
+				goto out;
+			if (!prev)
+				prev = malloc(p->frame_bytes);
+			if (!prev)
+				goto out;
+			memcpy(prev, frame, p->frame_bytes);
+		}
+		/* don't let frames sit in a half full transfer */
+		if (ledpanel_flush(p) < 0)
+			goto out;
+		n++;
+	}
+	ret = ledpanel_sync(p);
+	fprintf(stderr, "%lu frames\n", n);
+out:
+	free(frame);
+	free(prev);
+	free(gray);
+	ledpanel_dither_free(&dither);
+	return ret;
+}
+
+static int upload(struct ledpanel *p, unsigned int frames, unsigned int idle,
+		  int dither_mode)
+{
+	struct ledpanel_store_entry e = {
+		.type = LEDPANEL_STORE_FRAME,
+		.frames = frames,
+		.len = p->frame_bytes,
+	};
+	uint8_t *img = malloc(IMAGE_MAX), *frame = malloc(p->frame_bytes);
+	unsigned int len = 0, n = 0;
+	int ret = -1;
+
+	if (!img || !frame || p->planes != 1 || dither_setup(p, dither_mode) < 0)
+		goto out;
+	while (read_frame(p, frame)) {
+		if (ledpanel_image_add(img, IMAGE_MAX, &len, &e, frame) < 0) {
+			fprintf(stderr, "only room for %u frames\n", n);
+			goto out;
+		}
+		n++;
+	}
+	if (!n)
+		goto out;
+	ledpanel_image_finish(img, len, idle);
+	ret = ledpanel_upload(p, img, len);
+	fprintf(stderr, "%u frames, %u bytes\n", n, len);
+out:
+	free(img);
+	free(frame);
+	free(gray);
+	ledpanel_dither_free(&dither);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int modules = 3, bits = 0;
+	int i, ret, frc = 0, dither_mode = -1;
+	struct ledpanel p;
+	const char *cmd, *record = NULL;
+
+	while ((i = getopt(argc, argv, "m:g:fd:r:")) != -1) {
+		switch (i) {
+		case 'm':
+			modules = atoi(optarg);
+			break;
+		case 'g':
+			bits = atoi(optarg);
+			break;
+		case 'f':
+			frc = 1;
+			break;
+		case 'd':
+			for (dither_mode = 2; dither_mode >= 0; dither_mode--)
+				if (!strcmp(optarg, dither_modes[dither_mode]))
+					break;
+			if (dither_mode < 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			record = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+	cmd = argv[optind];
+
+	if (record) {
+		if (ledpanel_open_record(&p, modules, record) < 0) {
+			fprintf(stderr, "Could not create %s!\n", record);
+			return 1;
+		}
+	} else if (ledpanel_open_usb(&p, modules) < 0) {
+		fprintf(stderr, "Could not open usb device!\n");
+		return 1;
+	}
+
+	if (!strcmp(cmd, "on") || !strcmp(cmd, "off")) {
+		ret = ledpanel_onoff(&p, !strcmp(cmd, "on"));
+	} else if (!strcmp(cmd, "bright") && optind + 1 < argc) {
+		ret = ledpanel_brightness(&p, atoi(argv[optind + 1]));
+	} else if (!strcmp(cmd, "stats")) {
+		ret = print_stats(&p);
+	} else if (!strcmp(cmd, "text") && optind + 4 < argc) {
+		ret = ledpanel_bulk_mode(&p, 1);
+		if (!ret)
+			ret = ledpanel_text(&p, atoi(argv[optind + 1]),
+					    atoi(argv[optind + 2]),
+					    strtoul(argv[optind + 3], NULL, 0),
+					    argv[optind + 4], 1);
+	} else if (!strcmp(cmd, "upload") && optind + 2 < argc) {
+		ret = upload(&p, atoi(argv[optind + 1]), atoi(argv[optind + 2]),
+			     dither_mode);
+	} else if (!strcmp(cmd, "play") || !strcmp(cmd, "stop")) {
+		ret = ledpanel_play(&p, !strcmp(cmd, "play"));
+	} else if (!strcmp(cmd, "raw") || !strcmp(cmd, "packbits") ||
+		   (!strcmp(cmd, "queue") && optind + 1 < argc)) {
+		ret = frc ? ledpanel_frc_mode(&p) : ledpanel_gray_mode(&p, bits);
+		if (!ret)
+			ret = stream(&p, cmd[0], cmd[0] == 'q' ?
+				     atoi(argv[optind + 1]) : 0, dither_mode);
+	} else {
+		ledpanel_close(&p);
+		usage(argv[0]);
+	}
+
+	if (ret < 0)
+		fprintf(stderr, "%s failed!\n", cmd);
+	ledpanel_close(&p);
+	return ret < 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "ledpanel_dither.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+int ledpanel_dither_simd = 1;
+
+/* 8x8 Bayer matrix */
+static const uint8_t bayer[8][8] = {
+	{ 0, 32, 8, 40, 2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44, 4, 36, 14, 46, 6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{ 3, 35, 11, 43, 1, 33, 9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47, 7, 39, 13, 45, 5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+/* movemask gives the leftmost pixel in bit 0, the panel wants it in bit 7 */
+static uint8_t bitrev[256];
+
+int ledpanel_dither_init(struct ledpanel_dither *d, unsigned int width,
+			 unsigned int height, unsigned int bits,
+			 enum ledpanel_dither_mode mode)
+{
+	unsigned int i, j;
+
+	if (!bitrev[1])
+		for (i = 1; i < 256; i++)
+			for (j = 0; j < 8; j++)
+				if (i & (1 << j))
+					bitrev[i] |= 0x80 >> j;
+
+	memset(d, 0, sizeof(*d));
+	if (!width || !bits || bits > 8)
+		return -1;
+	d->width = width;
+	d->height = height;
+	d->bits = bits;
+	d->mode = mode;
+
+	/* whole bytes, the pixels right of width stay 0 */
+	d->levels = calloc((width + 7) & ~7, 1);
+	d->err = calloc(2 * (width + 2), sizeof(*d->err));
+	if (!d->levels || !d->err) {
+		ledpanel_dither_free(d);
+		return -1;
+	}
+	return 0;
+}
+
+void ledpanel_dither_free(struct ledpanel_dither *d)
+{
+	free(d->levels);
+	free(d->err);
+	memset(d, 0, sizeof(*d));
+}
+
+/* levels = (v * (2^bits - 1) + threshold) / 255, threshold per column
+   from thr[x % 8], n / 255 is (n + 1) * 257 / 65536 for n < 65535 */
+static void quant_row(struct ledpanel_dither *d, const uint8_t *src,
+		      const uint8_t thr[8])
+{
+	unsigned int x = 0, mul = (1 << d->bits) - 1;
+
+#ifdef __SSE2__
+	if (ledpanel_dither_simd) {
+		const __m128i z = _mm_setzero_si128();
+		const __m128i m = _mm_set1_epi16(mul);
+		const __m128i d257 = _mm_set1_epi16(257);
+		const __m128i t = _mm_add_epi16(_mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *)thr), z),
+			_mm_set1_epi16(1));
+		__m128i v, lo, hi;
+
+		for (; x + 16 <= d->width; x += 16) {
+			v = _mm_loadu_si128((const __m128i *)&src[x]);
+			lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, z), m);
+			hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, z), m);
+			lo = _mm_mulhi_epu16(_mm_add_epi16(lo, t), d257);
+			hi = _mm_mulhi_epu16(_mm_add_epi16(hi, t), d257);
+			_mm_storeu_si128((__m128i *)&d->levels[x],
+					 _mm_packus_epi16(lo, hi));
+		}
+	}
+#endif
+	for (; x < d->width; x++)
+		d->levels[x] = ((src[x] * mul + thr[x % 8] + 1) * 257) >> 16;
+}
+
+/* Floyd-Steinberg, every other row right to left */
+static void diffuse_row(struct ledpanel_dither *d, const uint8_t *src,
+			unsigned int y)
+{
+	int16_t *cur = &d->err[(y & 1) * (d->width + 2) + 1];
+	int16_t *next = &d->err[(~y & 1) * (d->width + 2) + 1];
+	int mul = (1 << d->bits) - 1, dir = (y & 1) ? -1 : 1;
+	int x, val, q, e, e7, e3, e5;
+	unsigned int i;
+
+	memset(next - 1, 0, (d->width + 2) * sizeof(*next));
+	for (i = 0; i < d->width; i++) {
+		x = (dir > 0) ? i : d->width - 1 - i;
+		/* levels are 255 apart */
+		val = src[x] * mul + cur[x];
+		q = (val <= 0) ? 0 : (2 * val + 255) / 510;
+		if (q > mul)
+			q = mul;
+		d->levels[x] = q;
+
+		e = val - q * 255;
+		e7 = e * 7 / 16;
+		e3 = e * 3 / 16;
+		e5 = e * 5 / 16;
+		cur[x + dir] += e7;
+		next[x - dir] += e3;
+		next[x] += e5;
+		next[x + dir] += e - e7 - e3 - e5;
+	}
+}
+
+/* one row of levels to the same row of every plane */
+static void pack_row(struct ledpanel_dither *d, uint8_t *dst, unsigned int y)
+{
+	unsigned int pitch = (d->width + 7) / 8;
+	unsigned int plane_bytes = pitch * d->height;
+	unsigned int plane, bit, x, i;
+	uint8_t *out, b;
+
+	for (plane = 0; plane < d->bits; plane++) {
+		bit = d->bits - 1 - plane; /* MSB plane first */
+		out = dst + plane * plane_bytes + y * pitch;
+		x = 0;
+#ifdef __SSE2__
+		if (ledpanel_dither_simd) {
+			__m128i v;
+			unsigned int m;
+
+			for (; x + 16 <= d->width; x += 16) {
+				/* our bit to the MSB of each byte */
+				v = _mm_loadu_si128((const __m128i *)&d->levels[x]);
+				m = _mm_movemask_epi8(_mm_slli_epi16(v, 7 - bit));
+				out[x / 8] = bitrev[m & 0xff];
+				out[x / 8 + 1] = bitrev[m >> 8];
+			}
+		}
+#endif
+		for (; x < d->width; x += 8) {
+			b = 0;
+			for (i = 0; i < 8; i++)
+				b |= ((d->levels[x + i] >> bit) & 1) << (7 - i);
+			out[x / 8] = b;
+		}
+	}
+}
+
+void ledpanel_dither_frame(struct ledpanel_dither *d, uint8_t *dst,
+			   const uint8_t *src, unsigned int stride)
+{
+	static const uint8_t half[8] = { 128, 128, 128, 128,
+					 128, 128, 128, 128 };
+	uint8_t thr[8];
+	unsigned int x, y;
+
+	if (d->mode == LEDPANEL_DITHER_DIFFUSION)
+		memset(d->err, 0, 2 * (d->width + 2) * sizeof(*d->err));
+
+	for (y = 0; y < d->height; y++, src += stride) {
+		switch (d->mode) {
+		case LEDPANEL_DITHER_NONE:
+			quant_row(d, src, half);
+			break;
+		case LEDPANEL_DITHER_ORDERED:
+			for (x = 0; x < 8; x++)
+				thr[x] = bayer[y % 8][x] * 4 + 2;
+			quant_row(d, src, thr);
+			break;
+		case LEDPANEL_DITHER_DIFFUSION:
+			diffuse_row(d, src, y);
+			break;
+		}
+		pack_row(d, dst, y);
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef LEDPANEL_DITHER_H
+#define LEDPANEL_DITHER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Conversion of 8 bit gray images to the framebuffer layout of the
+ * panel: 8 pixels per byte, leftmost pixel in the MSB (LEDPANEL_BIT()),
+ * 'bits' planes of (width + 7) / 8 * height bytes, most significant
+ * plane first. With bits = 1, it's a monochrome frame.
+ *
+ * Pixels are quantized to 2^bits levels, either by rounding, by ordered
+ * dithering (8x8 Bayer matrix) or by Floyd-Steinberg error diffusion.
+ * Rounding, ordered dithering and the packing into planes use SSE2 if
+ * the compiler targets it, error diffusion goes pixel by pixel.
+ */
+
+enum ledpanel_dither_mode {
+	LEDPANEL_DITHER_NONE,
+	LEDPANEL_DITHER_ORDERED,
+	LEDPANEL_DITHER_DIFFUSION,
+};
+
+struct ledpanel_dither {
+	unsigned int width, height, bits;
+	enum ledpanel_dither_mode mode;
+	uint8_t *levels; /* one row, quantized */
+	int16_t *err; /* error diffusion: two rows, plus one pixel each side */
+};
+
+/* 0: plain C even if SSE2 is available, for checks and benchmarks */
+extern int ledpanel_dither_simd;
+
+extern int ledpanel_dither_init(struct ledpanel_dither *d, unsigned int width,
+				unsigned int height, unsigned int bits,
+				enum ledpanel_dither_mode mode);
+extern void ledpanel_dither_free(struct ledpanel_dither *d);
+
+/* convert width x height pixels at src (rows 'stride' bytes apart) */
+extern void ledpanel_dither_frame(struct ledpanel_dither *d, uint8_t *dst,
+				  const uint8_t *src, unsigned int stride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
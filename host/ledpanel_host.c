@@ -0,0 +1,534 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ledpanel_host.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define REQTYPE_OUT 0x40 /* vendor, device */
+#define REQTYPE_IN 0xc0
+
+/* largest frame: 8 planes */
+#define MAX_PLANES 8
+
+static unsigned int packbits_max(unsigned int n)
+{
+	return n + (n + 127) / 128;
+}
+
+int ledpanel_init(struct ledpanel *p, const struct ledpanel_transport *tr,
+		  void *ctx, unsigned int modules)
+{
+	unsigned int i;
+
+	memset(p, 0, sizeof(*p));
+	p->tr = tr;
+	p->ctx = ctx;
+	p->width = modules * LEDPANEL_HOST_MODULE_WIDTH;
+	p->height = LEDPANEL_HOST_HEIGHT;
+	p->pitch = (p->width + 7) / 8;
+	p->planes = 1;
+	p->frame_bytes = p->pitch * p->height;
+
+	if (!modules ||
+	    sizeof(struct usb_proto_hdr) + packbits_max(MAX_PLANES *
+			p->frame_bytes) > LEDPANEL_HOST_XFER_BYTES)
+		return -1;
+
+	/* XOR delta, and its compressed form */
+	p->scratch = malloc(MAX_PLANES * p->frame_bytes +
+			    packbits_max(MAX_PLANES * p->frame_bytes));
+	if (!p->scratch)
+		return -1;
+	for (i = 0; i < LEDPANEL_HOST_XFERS; i++) {
+		p->xfer[i].panel = p;
+		p->xfer[i].buf = malloc(LEDPANEL_HOST_XFER_BYTES);
+		if (!p->xfer[i].buf)
+			return -1;
+	}
+	return 0;
+}
+
+void ledpanel_close(struct ledpanel *p)
+{
+	unsigned int i;
+
+	ledpanel_sync(p);
+	if (p->tr && p->tr->close)
+		p->tr->close(p);
+	for (i = 0; i < LEDPANEL_HOST_XFERS; i++)
+		free(p->xfer[i].buf);
+	free(p->scratch);
+	memset(p, 0, sizeof(*p));
+}
+
+void ledpanel_xfer_done(struct ledpanel_xfer *x, int status)
+{
+	x->busy = 0;
+	x->len = 0;
+	if (status < 0)
+		x->panel->error = 1;
+}
+
+/* wait until x is available */
+static int ledpanel_wait(struct ledpanel *p, struct ledpanel_xfer *x)
+{
+	while (x->busy)
+		if (p->tr->wait(p) < 0)
+			p->error = 1;
+	return p->error ? -1 : 0;
+}
+
+int ledpanel_flush(struct ledpanel *p)
+{
+	struct ledpanel_xfer *x = &p->xfer[p->cur];
+
+	if (p->error)
+		return -1;
+	if (!x->len)
+		return 0;
+
+	x->busy = 1;
+	if (p->tr->submit(p, x) < 0) {
+		x->busy = 0;
+		p->error = 1;
+		return -1;
+	}
+	p->cur = (p->cur + 1) % LEDPANEL_HOST_XFERS;
+	return ledpanel_wait(p, &p->xfer[p->cur]);
+}
+
+int ledpanel_sync(struct ledpanel *p)
+{
+	unsigned int i;
+
+	if (ledpanel_flush(p) < 0)
+		return -1;
+	for (i = 0; i < LEDPANEL_HOST_XFERS; i++)
+		if (ledpanel_wait(p, &p->xfer[i]) < 0)
+			return -1;
+	return 0;
+}
+
+uint8_t *ledpanel_reserve(struct ledpanel *p, unsigned int len)
+{
+	struct ledpanel_xfer *x = &p->xfer[p->cur];
+	uint8_t *ret;
+
+	if (len > LEDPANEL_HOST_XFER_BYTES)
+		return NULL;
+	if (x->len + len > LEDPANEL_HOST_XFER_BYTES) {
+		if (ledpanel_flush(p) < 0)
+			return NULL;
+		x = &p->xfer[p->cur];
+	}
+	if (p->error)
+		return NULL;
+
+	ret = x->buf + x->len;
+	x->len += len;
+	return ret;
+}
+
+void ledpanel_unreserve(struct ledpanel *p, unsigned int n)
+{
+	p->xfer[p->cur].len -= n;
+}
+
+uint8_t *ledpanel_raw_frame(struct ledpanel *p)
+{
+	return ledpanel_reserve(p, p->frame_bytes);
+}
+
+/* struct usb_proto_hdr, little endian */
+static uint8_t *ledpanel_hdr(uint8_t *dst, uint8_t cmd, uint8_t flags,
+			     const uint8_t arg[4], uint16_t len)
+{
+	dst[0] = cmd;
+	dst[1] = flags;
+	dst[2] = len;
+	dst[3] = len >> 8;
+	memcpy(&dst[4], arg, 4);
+	return dst + sizeof(struct usb_proto_hdr);
+}
+
+uint8_t *ledpanel_cmd(struct ledpanel *p, uint8_t cmd, uint8_t flags,
+		      const uint8_t arg[4], uint16_t len)
+{
+	uint8_t *dst = ledpanel_reserve(p, sizeof(struct usb_proto_hdr) + len);
+
+	if (!dst)
+		return NULL;
+	return ledpanel_hdr(dst, cmd, flags, arg, len);
+}
+
+uint8_t *ledpanel_patch(struct ledpanel *p, unsigned int x, unsigned int y,
+			unsigned int w, unsigned int h, int commit)
+{
+	const uint8_t arg[4] = { x, y, w, h };
+
+	if (x + w > p->pitch || y + h > p->height)
+		return NULL;
+	return ledpanel_cmd(p, USB_PROTO_CMD_PATCH,
+			    commit ? USB_PROTO_FLAG_COMMIT : 0, arg,
+			    p->planes * w * h);
+}
+
+int ledpanel_commit(struct ledpanel *p)
+{
+	const uint8_t arg[4] = { 0 };
+
+	return ledpanel_cmd(p, USB_PROTO_CMD_COMMIT, 0, arg, 0) ? 0 : -1;
+}
+
+int ledpanel_text(struct ledpanel *p, int x, int y, unsigned int font,
+		  const char *s, int commit)
+{
+	const uint8_t arg[4] = { x, x >> 8, y, font };
+	size_t len = strlen(s);
+	uint8_t *dst;
+
+	if (len > USB_PROTO_TEXT_MAX)
+		return -1;
+	dst = ledpanel_cmd(p, USB_PROTO_CMD_TEXT,
+			   commit ? USB_PROTO_FLAG_COMMIT : 0, arg, len);
+	if (!dst)
+		return -1;
+	memcpy(dst, s, len);
+	return 0;
+}
+
+/* struct usb_proto_rect, payload of FILL and SCROLL, little endian */
+static int ledpanel_rect(struct ledpanel *p, uint8_t cmd, const uint8_t arg[4],
+			 int x, int y, unsigned int w, unsigned int h,
+			 int commit)
+{
+	uint8_t *dst = ledpanel_cmd(p, cmd, commit ? USB_PROTO_FLAG_COMMIT : 0,
+				    arg, sizeof(struct usb_proto_rect));
+
+	if (!dst)
+		return -1;
+	dst[0] = x;
+	dst[1] = x >> 8;
+	dst[2] = y;
+	dst[3] = y >> 8;
+	dst[4] = w;
+	dst[5] = w >> 8;
+	dst[6] = h;
+	dst[7] = h >> 8;
+	return 0;
+}
+
+int ledpanel_fill(struct ledpanel *p, int x, int y, unsigned int w,
+		  unsigned int h, unsigned int op, int commit)
+{
+	const uint8_t arg[4] = { op, 0, 0, 0 };
+
+	return ledpanel_rect(p, USB_PROTO_CMD_FILL, arg, x, y, w, h, commit);
+}
+
+int ledpanel_scroll(struct ledpanel *p, int x, int y, unsigned int w,
+		    unsigned int h, int dx, int dy, int commit)
+{
+	const uint8_t arg[4] = { dx, dy, 0, 0 };
+
+	if (dx < -128 || dx > 127 || dy < -128 || dy > 127)
+		return -1;
+	return ledpanel_rect(p, USB_PROTO_CMD_SCROLL, arg, x, y, w, h, commit);
+}
+
+uint8_t *ledpanel_queue_frame(struct ledpanel *p, unsigned int interval)
+{
+	const uint8_t arg[4] = { interval, interval >> 8, 0, 0 };
+
+	return ledpanel_cmd(p, USB_PROTO_CMD_QUEUE, 0, arg, p->frame_bytes);
+}
+
+uint8_t *ledpanel_canvas_cols(struct ledpanel *p, unsigned int x,
+			      unsigned int w)
+{
+	const uint8_t arg[4] = { x, x >> 8, 0, 0 };
+
+	return ledpanel_cmd(p, USB_PROTO_CMD_CANVAS, 0, arg, w * p->height);
+}
+
+/* PackBits, as decoded by USB_PROTO_CMD_PACKBITS, returns length */
+static unsigned int packbits(uint8_t *dst, const uint8_t *src, unsigned int n)
+{
+	unsigned int i = 0, j, run, len = 0;
+
+	while (i < n) {
+		for (run = 1; i + run < n && run < 128 && src[i + run] == src[i];)
+			run++;
+		if (run >= 2) {
+			dst[len++] = 257 - run;
+			dst[len++] = src[i];
+			i += run;
+			continue;
+		}
+		/* literal up to the next run of at least 3 bytes */
+		for (j = i; j < n && j - i < 128; j++)
+			if (j + 2 < n && src[j] == src[j + 1] &&
+			    src[j] == src[j + 2])
+				break;
+		dst[len++] = j - i - 1;
+		memcpy(&dst[len], &src[i], j - i);
+		len += j - i;
+		i = j;
+	}
+	return len;
+}
+
+int ledpanel_packbits(struct ledpanel *p, const uint8_t *frame,
+		      const uint8_t *prev)
+{
+	unsigned int i, n = p->frame_bytes, max = packbits_max(n);
+	uint8_t arg[4] = { 0 }, *hdr, *dst;
+	unsigned int len, dlen;
+
+	hdr = ledpanel_reserve(p, sizeof(struct usb_proto_hdr) + max);
+	if (!hdr)
+		return -1;
+	dst = hdr + sizeof(struct usb_proto_hdr);
+
+	len = packbits(dst, frame, n);
+	if (prev) {
+		for (i = 0; i < n; i++)
+			p->scratch[i] = frame[i] ^ prev[i];
+		dlen = packbits(p->scratch + n, p->scratch, n);
+		if (dlen < len) {
+			memcpy(dst, p->scratch + n, dlen);
+			len = dlen;
+			arg[0] = USB_PROTO_PACKBITS_XOR;
+		}
+	}
+
+	ledpanel_hdr(hdr, USB_PROTO_CMD_PACKBITS, USB_PROTO_FLAG_COMMIT, arg, len);
+	ledpanel_unreserve(p, max - len);
+	return sizeof(struct usb_proto_hdr) + len;
+}
+
+int ledpanel_request(struct ledpanel *p, uint8_t request, uint16_t value,
+		     uint16_t index, const void *data, uint16_t len)
+{
+	switch (request) {
+	case USB_IF_REQUEST_RESET_WRITEPTR:
+	case USB_IF_REQUEST_GRAY_MODE:
+	case USB_IF_REQUEST_BULK_MODE:
+	case USB_IF_REQUEST_PLAY:
+		if (ledpanel_sync(p) < 0)
+			return -1;
+	}
+	return p->tr->control(p, REQTYPE_OUT, request, value, index,
+			      (void *)data, len) < 0 ? -1 : 0;
+}
+
+int ledpanel_get(struct ledpanel *p, uint8_t request, uint16_t value,
+		 uint16_t index, void *data, uint16_t len)
+{
+	return p->tr->control(p, REQTYPE_IN, request, value, index, data,
+			      len) == len ? 0 : -1;
+}
+
+int ledpanel_reset_writeptr(struct ledpanel *p)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_RESET_WRITEPTR, 0, 0, NULL, 0);
+}
+
+int ledpanel_onoff(struct ledpanel *p, int on)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_PANEL_ONOFF, !!on, 0, NULL, 0);
+}
+
+int ledpanel_brightness(struct ledpanel *p, unsigned int bright)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_PANEL_BRIGHTNESS, bright, 0,
+				NULL, 0);
+}
+
+int ledpanel_mbi5029_mode(struct ledpanel *p, int mode)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_MBI5029_MODE, mode, 0, NULL, 0);
+}
+
+int ledpanel_gray_mode(struct ledpanel *p, unsigned int bits)
+{
+	if (bits > MAX_PLANES)
+		return -1;
+	if (ledpanel_request(p, USB_IF_REQUEST_GRAY_MODE, !!bits, 0, NULL, 0) < 0)
+		return -1;
+	p->planes = bits ? bits : 1;
+	p->frame_bytes = p->planes * p->pitch * p->height;
+	return 0;
+}
+
+int ledpanel_frc_mode(struct ledpanel *p)
+{
+	if (ledpanel_request(p, USB_IF_REQUEST_GRAY_MODE, 2, 0, NULL, 0) < 0)
+		return -1;
+	p->planes = LEDPANEL_HOST_FRC_BITS;
+	p->frame_bytes = p->planes * p->pitch * p->height;
+	return 0;
+}
+
+int ledpanel_bulk_mode(struct ledpanel *p, int framed)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_BULK_MODE, !!framed, 0, NULL, 0);
+}
+
+int ledpanel_canvas_mode(struct ledpanel *p, unsigned int width)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_CANVAS, width, 0, NULL, 0);
+}
+
+int ledpanel_viewport(struct ledpanel *p, unsigned int x, int velocity)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_VIEWPORT, x,
+				(uint16_t)velocity, NULL, 0);
+}
+
+int ledpanel_stats(struct ledpanel *p, struct usb_if_stats *st)
+{
+	return ledpanel_get(p, USB_IF_REQUEST_STATS, 0, 0, st, sizeof(*st));
+}
+
+int ledpanel_profile(struct ledpanel *p, enum profile_region r,
+		     struct profile_stats *st)
+{
+	return ledpanel_get(p, USB_IF_REQUEST_PROFILE, 0, r, st, sizeof(*st));
+}
+
+int ledpanel_profile_reset(struct ledpanel *p)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_PROFILE, 0, 0, NULL, 0);
+}
+
+int ledpanel_timing(struct ledpanel *p, unsigned int refresh, int spi_br)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_TIMING, refresh,
+				spi_br < 0 ? 0xffff : spi_br, NULL, 0);
+}
+
+int ledpanel_gain(struct ledpanel *p, unsigned int first,
+		  const uint16_t *gain, unsigned int n)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_GAIN, 0, first, gain, 2 * n);
+}
+
+int ledpanel_gamma(struct ledpanel *p, const uint16_t *curve)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_GAMMA, 0, 0, curve,
+				2 * USB_IF_GAMMA_POINTS);
+}
+
+int ledpanel_save(struct ledpanel *p)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_SAVE, 0, 0, NULL, 0);
+}
+
+static void put16(uint8_t *dst, unsigned int v)
+{
+	dst[0] = v;
+	dst[1] = v >> 8;
+}
+
+static void put32(uint8_t *dst, uint32_t v)
+{
+	put16(dst, v);
+	put16(dst + 2, v >> 16);
+}
+
+int ledpanel_image_add(uint8_t *img, unsigned int size, unsigned int *len,
+		       const struct ledpanel_store_entry *e,
+		       const void *payload)
+{
+	unsigned int pos = *len ? *len : sizeof(struct ledpanel_store_hdr);
+	uint8_t *dst = img + pos;
+
+	if (size < pos ||
+	    size - pos < sizeof(*e) + LEDPANEL_STORE_PAD(e->len))
+		return -1;
+	dst[0] = e->type;
+	dst[1] = e->flags;
+	put16(dst + 2, e->frames);
+	put16(dst + 4, e->len);
+	put16(dst + 6, e->x);
+	put16(dst + 8, e->y);
+	put16(dst + 10, e->v);
+	dst += sizeof(*e);
+	memcpy(dst, payload, e->len);
+	memset(dst + e->len, 0, LEDPANEL_STORE_PAD(e->len) - e->len);
+	*len = pos + sizeof(*e) + LEDPANEL_STORE_PAD(e->len);
+	return 0;
+}
+
+void ledpanel_image_finish(uint8_t *img, unsigned int len, unsigned int idle)
+{
+	unsigned int n = len - sizeof(struct ledpanel_store_hdr);
+
+	put32(img, LEDPANEL_STORE_MAGIC);
+	put32(img + 4, n);
+	put32(img + 8, ledpanel_store_sum(img + sizeof(struct ledpanel_store_hdr),
+					  n));
+	put16(img + 12, idle);
+	put16(img + 14, 0);
+}
+
+/* less than the firmware's control buffer */
+#define UPLOAD_CHUNK 64
+/* status requests until a chunk is written, the erase with the first one
+   takes the longest, 16 pages of up to 40 ms */
+#define UPLOAD_POLLS 1000
+
+/* the panel has written the last chunk to flash */
+static int upload_wait(struct ledpanel *p)
+{
+	unsigned int i;
+	uint8_t st;
+
+	for (i = 0; i < UPLOAD_POLLS; i++) {
+		if (ledpanel_get(p, USB_IF_REQUEST_STORE, 0, 0, &st, 1) < 0 ||
+		    st == LEDPANEL_STORE_FAILED)
+			return -1;
+		if (st == LEDPANEL_STORE_DONE)
+			return 0;
+	}
+	return -1;
+}
+
+int ledpanel_upload(struct ledpanel *p, const uint8_t *img, unsigned int len)
+{
+	unsigned int off, n;
+
+	for (off = 0; off < len; off += n) {
+		n = len - off < UPLOAD_CHUNK ? len - off : UPLOAD_CHUNK;
+		if (ledpanel_request(p, USB_IF_REQUEST_STORE, off / 4, 0,
+				     img + off, n) < 0 ||
+		    upload_wait(p) < 0)
+			return -1;
+	}
+	return ledpanel_play(p, 1);
+}
+
+int ledpanel_play(struct ledpanel *p, int on)
+{
+	return ledpanel_request(p, USB_IF_REQUEST_PLAY, !!on, 0, NULL, 0);
+}
@@ -0,0 +1,246 @@
+#ifndef LEDPANEL_HOST_H
+#define LEDPANEL_HOST_H
+
+#include "usb_if.h"
+#include "usb_proto.h"
+#include "ledpanel_store.h"
+#include "profile.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Host side of the panel: streams data to the bulk OUT endpoint with
+ * several transfers in flight, and wraps the vendor requests of usb_if.h.
+ *
+ * Data is written straight into the buffer of the next transfer: the
+ * functions returning a pointer reserve space for a frame or a command's
+ * payload, to be filled in by the caller before the next call. A
+ * transfer goes out when it is full or at ledpanel_flush(). Only if all
+ * LEDPANEL_HOST_XFERS are still busy, the call blocks.
+ *
+ * Functions returning int return -1 on error, also for any earlier
+ * transfer that failed.
+ */
+
+/* geometry of one module, from ledpanel_buffer.h */
+#define LEDPANEL_HOST_MODULE_WIDTH 40
+#define LEDPANEL_HOST_HEIGHT 20
+#define LEDPANEL_HOST_FRC_BITS 2 /* LEDPANEL_FRC_BITS */
+
+#define LEDPANEL_HOST_XFERS 4 /* bulk transfers in flight */
+#define LEDPANEL_HOST_XFER_BYTES 16384
+
+struct ledpanel;
+
+struct ledpanel_xfer {
+	struct ledpanel *panel;
+	uint8_t *buf;
+	unsigned int len; /* bytes used */
+	int busy; /* submitted, not completed yet */
+	void *priv; /* transport */
+};
+
+/* how the bytes get to the panel, see ledpanel_open_usb() and
+   ledpanel_open_mock() */
+struct ledpanel_transport {
+	/* start sending x->len bytes, ledpanel_xfer_done() when finished */
+	int (*submit)(struct ledpanel *p, struct ledpanel_xfer *x);
+	/* block until at least one transfer has completed */
+	int (*wait)(struct ledpanel *p);
+	/* control transfer, returns bytes transferred */
+	int (*control)(struct ledpanel *p, uint8_t type, uint8_t request,
+		       uint16_t value, uint16_t index, void *data,
+		       uint16_t len);
+	void (*close)(struct ledpanel *p);
+};
+
+struct ledpanel {
+	const struct ledpanel_transport *tr;
+	void *ctx; /* transport private */
+
+	unsigned int width, height; /* pixels */
+	unsigned int pitch; /* bytes per row of a plane */
+	unsigned int planes; /* 1, or bits after ledpanel_gray_mode() */
+	unsigned int frame_bytes; /* all planes */
+
+	struct ledpanel_xfer xfer[LEDPANEL_HOST_XFERS];
+	unsigned int cur; /* being filled */
+	uint8_t *scratch; /* for PackBits */
+	int error;
+};
+
+/* set up p for transport tr and a chain of 'modules' modules */
+extern int ledpanel_init(struct ledpanel *p, const struct ledpanel_transport *tr,
+			 void *ctx, unsigned int modules);
+
+/* first panel found on USB (libusb) */
+extern int ledpanel_open_usb(struct ledpanel *p, unsigned int modules);
+
+/* send everything still pending, and free p */
+extern void ledpanel_close(struct ledpanel *p);
+
+/* called by the transport when a transfer has completed */
+extern void ledpanel_xfer_done(struct ledpanel_xfer *x, int status);
+
+/* space for len bytes of bulk data, at most LEDPANEL_HOST_XFER_BYTES */
+extern uint8_t *ledpanel_reserve(struct ledpanel *p, unsigned int len);
+
+/* give back the last n bytes of the last ledpanel_reserve() */
+extern void ledpanel_unreserve(struct ledpanel *p, unsigned int n);
+
+/* submit the transfer being filled */
+extern int ledpanel_flush(struct ledpanel *p);
+
+/* flush, and wait until all transfers have completed */
+extern int ledpanel_sync(struct ledpanel *p);
+
+/* raw bulk mode: the next frame, all planes */
+extern uint8_t *ledpanel_raw_frame(struct ledpanel *p);
+
+/* framed bulk mode (usb_proto.h): header of any command, returns its
+   payload of len bytes */
+extern uint8_t *ledpanel_cmd(struct ledpanel *p, uint8_t cmd, uint8_t flags,
+			     const uint8_t arg[4], uint16_t len);
+
+/* rectangle x, y, w, h (x and w in bytes), w * h bytes per plane */
+extern uint8_t *ledpanel_patch(struct ledpanel *p, unsigned int x,
+			       unsigned int y, unsigned int w, unsigned int h,
+			       int commit);
+
+extern int ledpanel_commit(struct ledpanel *p);
+
+/* a frame for the frame queue, shown 'interval' refresh frames after
+   the previous one */
+extern uint8_t *ledpanel_queue_frame(struct ledpanel *p, unsigned int interval);
+
+/* text drawn by the panel, font: font number | USB_PROTO_TEXT_* flags,
+   x and y in pixels */
+extern int ledpanel_text(struct ledpanel *p, int x, int y, unsigned int font,
+			 const char *s, int commit);
+
+/* clear, set or invert (USB_PROTO_FILL_*) a rectangle, in pixels */
+extern int ledpanel_fill(struct ledpanel *p, int x, int y, unsigned int w,
+			 unsigned int h, unsigned int op, int commit);
+
+/* move the contents of a rectangle by dx, dy pixels (-128..127) */
+extern int ledpanel_scroll(struct ledpanel *p, int x, int y, unsigned int w,
+			   unsigned int h, int dx, int dy, int commit);
+
+/* w bytes for each row of the canvas, starting at byte x */
+extern uint8_t *ledpanel_canvas_cols(struct ledpanel *p, unsigned int x,
+				     unsigned int w);
+
+/* frame PackBits compressed and committed, as a XOR delta to prev if
+   given and shorter, returns the number of bytes sent */
+extern int ledpanel_packbits(struct ledpanel *p, const uint8_t *frame,
+			     const uint8_t *prev);
+
+/* vendor requests (usb_if.h), those changing how the bulk stream is
+   interpreted wait for all transfers to complete first */
+extern int ledpanel_request(struct ledpanel *p, uint8_t request,
+			    uint16_t value, uint16_t index, const void *data,
+			    uint16_t len);
+extern int ledpanel_get(struct ledpanel *p, uint8_t request, uint16_t value,
+			uint16_t index, void *data, uint16_t len);
+
+extern int ledpanel_reset_writeptr(struct ledpanel *p);
+extern int ledpanel_onoff(struct ledpanel *p, int on);
+extern int ledpanel_brightness(struct ledpanel *p, unsigned int bright);
+extern int ledpanel_mbi5029_mode(struct ledpanel *p, int mode);
+/* bits: number of planes the firmware was built with, 0: monochrome */
+extern int ledpanel_gray_mode(struct ledpanel *p, unsigned int bits);
+/* temporal dithering on the panel: frames of LEDPANEL_HOST_FRC_BITS planes
+   (levels 0..3), shown as monochrome sub-frames, ledpanel_gray_mode() to
+   switch it off */
+extern int ledpanel_frc_mode(struct ledpanel *p);
+extern int ledpanel_bulk_mode(struct ledpanel *p, int framed);
+extern int ledpanel_canvas_mode(struct ledpanel *p, unsigned int width);
+extern int ledpanel_viewport(struct ledpanel *p, unsigned int x, int velocity);
+extern int ledpanel_stats(struct ledpanel *p, struct usb_if_stats *st);
+extern int ledpanel_profile(struct ledpanel *p, enum profile_region r,
+			    struct profile_stats *st);
+extern int ledpanel_profile_reset(struct ledpanel *p);
+/* spi_br: SPI clock divider 2 << spi_br, -1: keep */
+extern int ledpanel_timing(struct ledpanel *p, unsigned int refresh, int spi_br);
+extern int ledpanel_gain(struct ledpanel *p, unsigned int first,
+			 const uint16_t *gain, unsigned int n);
+extern int ledpanel_gamma(struct ledpanel *p, const uint16_t *curve);
+extern int ledpanel_save(struct ledpanel *p);
+
+/*
+ * Content store image (ledpanel_store.h) put together in img, size bytes:
+ * start with *len = 0, add entries (e->len bytes of payload each), then
+ * ledpanel_image_finish(). idle: seconds the host has to be quiet for
+ * the panel to play it again, 0: only at power on.
+ */
+extern int ledpanel_image_add(uint8_t *img, unsigned int size,
+			      unsigned int *len,
+			      const struct ledpanel_store_entry *e,
+			      const void *payload);
+extern void ledpanel_image_finish(uint8_t *img, unsigned int len,
+				  unsigned int idle);
+
+/* write an image to the panel's flash and play it */
+extern int ledpanel_upload(struct ledpanel *p, const uint8_t *img,
+			   unsigned int len);
+/* play the content store from the start, or stop */
+extern int ledpanel_play(struct ledpanel *p, int on);
+
+/*
+ * Stand-in for the panel, for tests: transfers complete one at a time,
+ * oldest first, each time the library has to wait for one. The data is
+ * handed to 'sink' (if set) in order, control requests are recorded.
+ */
+struct ledpanel_mock {
+	void (*sink)(void *arg, const uint8_t *buf, unsigned int len);
+	void *sink_arg;
+
+	struct ledpanel_xfer *pending[LEDPANEL_HOST_XFERS];
+	unsigned int npending, max_pending;
+	unsigned long bytes;
+
+	uint8_t request; /* last OUT request */
+	uint16_t value, index;
+	unsigned int requests;
+	/* if set, OUT requests are handed to it as well */
+	void (*control)(void *arg, uint8_t request, uint16_t value,
+			uint16_t index, const uint8_t *data, uint16_t len);
+};
+
+extern int ledpanel_open_mock(struct ledpanel *p, unsigned int modules,
+			      struct ledpanel_mock *m);
+
+/*
+ * Recording instead of a panel, to be replayed by test/sim/: a struct
+ * ledpanel_record_hdr, then for each bulk transfer or control request a
+ * struct ledpanel_record, followed by its len bytes of data unless it's
+ * a device to host request (which returns zeros). Little endian.
+ */
+#define LEDPANEL_RECORD_MAGIC 0x4352504c /* "LPRC" */
+
+struct ledpanel_record_hdr {
+	uint32_t magic;
+	uint16_t modules;
+	uint16_t reserved;
+} __attribute__((packed));
+
+struct ledpanel_record {
+	uint32_t usec; /* since ledpanel_open_record() */
+	uint8_t type; /* 0: bulk transfer, else bmRequestType */
+	uint8_t request;
+	uint16_t value, index;
+	uint16_t len;
+} __attribute__((packed));
+
+extern int ledpanel_open_record(struct ledpanel *p, unsigned int modules,
+				const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * libusb transport: asynchronous bulk transfers, events are handled
+ * while waiting for one of them to complete.
+ */
+
+#include "ledpanel_host.h"
+
+#include <stdlib.h>
+#include <libusb.h>
+
+#define BULK_TIMEOUT 5000 /* ms, panel waits for a commit at most 1 frame */
+#define CONTROL_TIMEOUT 1000
+
+struct ledpanel_usb {
+	libusb_context *ctx;
+	libusb_device_handle *dev;
+	struct libusb_transfer *t[LEDPANEL_HOST_XFERS];
+};
+
+static void LIBUSB_CALL usb_done(struct libusb_transfer *t)
+{
+	struct ledpanel_xfer *x = t->user_data;
+
+	ledpanel_xfer_done(x, t->status == LIBUSB_TRANSFER_COMPLETED &&
+			      t->actual_length == t->length ? 0 : -1);
+}
+
+static int usb_submit(struct ledpanel *p, struct ledpanel_xfer *x)
+{
+	struct ledpanel_usb *u = p->ctx;
+	struct libusb_transfer *t = x->priv;
+
+	libusb_fill_bulk_transfer(t, u->dev, USB_IF_BULK_EP, x->buf, x->len,
+				  usb_done, x, BULK_TIMEOUT);
+	return libusb_submit_transfer(t) ? -1 : 0;
+}
+
+static int usb_wait(struct ledpanel *p)
+{
+	struct ledpanel_usb *u = p->ctx;
+
+	return libusb_handle_events(u->ctx) ? -1 : 0;
+}
+
+static int usb_control(struct ledpanel *p, uint8_t type, uint8_t request,
+		       uint16_t value, uint16_t index, void *data,
+		       uint16_t len)
+{
+	struct ledpanel_usb *u = p->ctx;
+
+	return libusb_control_transfer(u->dev, type, request, value, index,
+				       data, len, CONTROL_TIMEOUT);
+}
+
+static void usb_close(struct ledpanel *p)
+{
+	struct ledpanel_usb *u = p->ctx;
+	unsigned int i;
+
+	if (!u)
+		return;
+	for (i = 0; i < LEDPANEL_HOST_XFERS; i++)
+		libusb_free_transfer(u->t[i]);
+	if (u->dev) {
+		libusb_release_interface(u->dev, 0);
+		libusb_close(u->dev);
+	}
+	if (u->ctx)
+		libusb_exit(u->ctx);
+	free(u);
+	p->ctx = NULL;
+}
+
+static const struct ledpanel_transport usb_transport = {
+	.submit = usb_submit,
+	.wait = usb_wait,
+	.control = usb_control,
+	.close = usb_close,
+};
+
+int ledpanel_open_usb(struct ledpanel *p, unsigned int modules)
+{
+	struct ledpanel_usb *u = calloc(1, sizeof(*u));
+	unsigned int i;
+
+	if (ledpanel_init(p, &usb_transport, u, modules) < 0 || !u)
+		goto err;
+	if (libusb_init(&u->ctx))
+		goto err;
+	u->dev = libusb_open_device_with_vid_pid(u->ctx, USB_IF_VENDOR_ID,
+						 USB_IF_PRODUCT_ID);
+	if (!u->dev || libusb_claim_interface(u->dev, 0))
+		goto err;
+	for (i = 0; i < LEDPANEL_HOST_XFERS; i++) {
+		u->t[i] = libusb_alloc_transfer(0);
+		if (!u->t[i])
+			goto err;
+		p->xfer[i].priv = u->t[i];
+	}
+	return 0;
+err:
+	ledpanel_close(p);
+	return -1;
+}
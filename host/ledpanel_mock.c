@@ -0,0 +1,94 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * Mock transport, see struct ledpanel_mock in ledpanel_host.h.
+ */
+
+#include "ledpanel_host.h"
+
+#include <string.h>
+
+static int mock_submit(struct ledpanel *p, struct ledpanel_xfer *x)
+{
+	struct ledpanel_mock *m = p->ctx;
+
+	if (m->npending == LEDPANEL_HOST_XFERS)
+		return -1;
+	m->pending[m->npending++] = x;
+	if (m->npending > m->max_pending)
+		m->max_pending = m->npending;
+	return 0;
+}
+
+/* the oldest transfer arrives at the panel */
+static int mock_wait(struct ledpanel *p)
+{
+	struct ledpanel_mock *m = p->ctx;
+	struct ledpanel_xfer *x = m->pending[0];
+
+	if (!m->npending)
+		return -1;
+	if (m->sink)
+		m->sink(m->sink_arg, x->buf, x->len);
+	m->bytes += x->len;
+
+	m->npending--;
+	memmove(&m->pending[0], &m->pending[1],
+		m->npending * sizeof(m->pending[0]));
+	ledpanel_xfer_done(x, 0);
+	return 0;
+}
+
+static int mock_control(struct ledpanel *p, uint8_t type, uint8_t request,
+			uint16_t value, uint16_t index, void *data,
+			uint16_t len)
+{
+	struct ledpanel_mock *m = p->ctx;
+
+	if (type & 0x80) { /* device to host */
+		memset(data, 0, len);
+		return len;
+	}
+	m->request = request;
+	m->value = value;
+	m->index = index;
+	m->requests++;
+	if (m->control)
+		m->control(m->sink_arg, request, value, index, data, len);
+	return len;
+}
+
+static const struct ledpanel_transport mock_transport = {
+	.submit = mock_submit,
+	.wait = mock_wait,
+	.control = mock_control,
+};
+
+int ledpanel_open_mock(struct ledpanel *p, unsigned int modules,
+		       struct ledpanel_mock *m)
+{
+	m->npending = 0;
+	m->max_pending = 0;
+	m->bytes = 0;
+	m->requests = 0;
+	return ledpanel_init(p, &mock_transport, m, modules);
+}
@@ -0,0 +1,133 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Recording transport, see ledpanel_open_record() in ledpanel_host.h:
+ * transfers complete right away, the file is replayed by the simulator
+ * in test/sim/.
+ */
+
+#include "ledpanel_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct ledpanel_rec {
+	FILE *f;
+	struct timespec t0;
+};
+
+static uint32_t rec_usec(struct ledpanel_rec *r)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - r->t0.tv_sec) * 1000000 +
+	       (t.tv_nsec - r->t0.tv_nsec) / 1000;
+}
+
+static int rec_write(struct ledpanel_rec *r, uint8_t type, uint8_t request,
+		     uint16_t value, uint16_t index, const void *data,
+		     uint16_t len)
+{
+	struct ledpanel_record rec = {
+		.usec = rec_usec(r),
+		.type = type,
+		.request = request,
+		.value = value,
+		.index = index,
+		.len = len,
+	};
+
+	if (fwrite(&rec, sizeof(rec), 1, r->f) != 1)
+		return -1;
+	/* nothing comes back from the panel, only OUT data is kept */
+	if (!(type & 0x80) && len && fwrite(data, len, 1, r->f) != 1)
+		return -1;
+	return 0;
+}
+
+static int rec_submit(struct ledpanel *p, struct ledpanel_xfer *x)
+{
+	if (rec_write(p->ctx, 0, 0, 0, 0, x->buf, x->len) < 0)
+		return -1;
+	ledpanel_xfer_done(x, 0);
+	return 0;
+}
+
+/* never called, submit completes every transfer */
+static int rec_wait(struct ledpanel *p)
+{
+	(void)p;
+	return -1;
+}
+
+static int rec_control(struct ledpanel *p, uint8_t type, uint8_t request,
+		       uint16_t value, uint16_t index, void *data,
+		       uint16_t len)
+{
+	if (rec_write(p->ctx, type, request, value, index, data, len) < 0)
+		return -1;
+	if (type & 0x80)
+		memset(data, 0, len);
+	return len;
+}
+
+static void rec_close(struct ledpanel *p)
+{
+	struct ledpanel_rec *r = p->ctx;
+
+	if (!r)
+		return;
+	if (r->f)
+		fclose(r->f);
+	free(r);
+	p->ctx = NULL;
+}
+
+static const struct ledpanel_transport rec_transport = {
+	.submit = rec_submit,
+	.wait = rec_wait,
+	.control = rec_control,
+	.close = rec_close,
+};
+
+int ledpanel_open_record(struct ledpanel *p, unsigned int modules,
+			 const char *path)
+{
+	struct ledpanel_rec *r = calloc(1, sizeof(*r));
+	struct ledpanel_record_hdr hdr = {
+		.magic = LEDPANEL_RECORD_MAGIC,
+		.modules = modules,
+	};
+
+	if (ledpanel_init(p, &rec_transport, r, modules) < 0 || !r)
+		goto err;
+	r->f = fopen(path, "wb");
+	if (!r->f || fwrite(&hdr, sizeof(hdr), 1, r->f) != 1)
+		goto err;
+	clock_gettime(CLOCK_MONOTONIC, &r->t0);
+	return 0;
+err:
+	ledpanel_close(p);
+	return -1;
+}
@@ -1,11 +1,45 @@
 #ifndef HW_MATRIX_H
 #define HW_MATRIX_H
 
-extern void hw_matrix_init(void);  /* initialize GPIOs, setup SPI, DMA, ... */
+#include "ledpanel_buffer.h"
+
+#include <stdint.h>
+
+/* 16 bit MBI5029 column drivers in all chains */
+#define HW_MATRIX_DRIVERS (LEDPANEL_SPI_BYTES / 2)
+/* points of the brightness curve, for brightness 0, 8, 16, ... 256 */
+#define HW_MATRIX_GAMMA_POINTS 33
+
+extern void hw_matrix_init(void);  /* initialize GPIOs, setup SPI, DMA, ..., stopped */
 extern void hw_matrix_stop(void);  /* stop regular scanning (turn off LED matrix) */
 extern void hw_matrix_start(void); /* start regular scanning (turn on LED matrix) */
+extern int hw_matrix_running(void); /* is the refresh ISR scanning the matrix? */
 extern void hw_matrix_mbi5029_mode(int special); /* change mbi5029 into/out of "special" mode */
-extern void hw_matrix_brightness(unsigned int brightness);
+/* write configuration word (current gain) to all MBI5029, while scanning
+   this is done in between two rows, returns -1 if still busy */
+extern int hw_matrix_brightness(unsigned int brightness);
+/* same, one word per driver, gain[0] for the driver receiving the first
+   two bytes of a row as shifted out (ledpanel_buffer_prepare_shiftreg) */
+extern int hw_matrix_gain(const uint16_t *gain);
+/* brightness curve for hw_matrix_pwm(), HW_MATRIX_GAMMA_POINTS on-times
+   in 1/65536 for brightness 0, 8, 16, ... 256, NULL: linear */
+extern void hw_matrix_gamma(const uint16_t *curve);
 extern void hw_matrix_pwm(unsigned char brightness);
+/* switch between monochrome, LEDPANEL_GRAY_BITS grayscale scanning and
+   temporal dithering (LEDPANEL_FRC_BITS frames scanned as sub-frames of
+   equal weight, see ledpanel_buffer.h), returns -1 if the planes do not
+   fit in a row period */
+#define HW_MATRIX_MONO 0
+#define HW_MATRIX_GRAY 1
+#define HW_MATRIX_FRC 2
+extern int hw_matrix_grayscale(int mode);
+/* change refresh rate (Hz) and SPI clock divider of the current mode
+   (SPI_CR1_BR_*, -1: keep) at the start of the next frame, returns -1 if
+   a row can't be shifted out in time */
+extern int hw_matrix_timing(unsigned int refresh, int br);
+
+/* performance counters, see USB_IF_REQUEST_STATS */
+extern volatile uint32_t hw_matrix_rows; /* rows latched */
+extern volatile uint32_t hw_matrix_dma_busy; /* row not sent at latch time */
 
 #endif
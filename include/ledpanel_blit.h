@@ -0,0 +1,36 @@
+#ifndef LEDPANEL_BLIT_H
+#define LEDPANEL_BLIT_H
+
+#include "ledpanel_buffer.h"
+
+/*
+ * Drawing on one plane of a frame in the ledpanel_buffer layout
+ * (LEDPANEL_U8_PITCH bytes per row), 32 pixels at a time: a row is
+ * handled as 32 bit words with the leftmost pixel in the MSB, so moving
+ * pixels by any distance is a word shift. With -DLEDPANEL_WORD_ALIGNED,
+ * rows are whole words in memory and are read and written a word at a
+ * time, the plane then has to be 4 byte aligned (all planes of
+ * ledpanel_buffer are).
+ *
+ * Coordinates are in pixels, anything outside the panel is clipped.
+ */
+
+#define LEDPANEL_BLIT_CLEAR 0
+#define LEDPANEL_BLIT_SET 1
+#define LEDPANEL_BLIT_INVERT 2
+
+/* replace the pixels in mask by those in bits, 32 pixels starting at
+   x, y, MSB first */
+extern void ledpanel_blit_merge(uint8_t *fb, int x, int y, uint32_t bits,
+				uint32_t mask);
+
+/* clear, set or invert a rectangle */
+extern void ledpanel_blit_fill(uint8_t *fb, int x, int y, int w, int h,
+			       unsigned int op);
+
+/* move the contents of a rectangle by dx, dy (positive: right, down),
+   pixels moved in from outside of it are cleared */
+extern void ledpanel_blit_scroll(uint8_t *fb, int x, int y, int w, int h,
+				 int dx, int dy);
+
+#endif
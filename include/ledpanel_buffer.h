@@ -6,36 +6,105 @@
 
 /*
   select configuration, either one matrix module, or
-  the complete sign (using three matrix modules chained).
+  the complete sign (using three matrix modules chained),
+  or any other number of chained modules with LEDPANEL_MODULES.
 */
 
-#ifdef LEDPANEL_TYPE_SINGLE /* see platformio.ini */
+#if defined(LEDPANEL_MODULES) &&                                               \
+	(defined(LEDPANEL_TYPE_SINGLE) || defined(LEDPANEL_TYPE_TRIPLE))
+#error LEDPANEL_MODULES replaces LEDPANEL_TYPE_SINGLE/TRIPLE, define only one!
+#endif
 
-#define LEDPANEL_PIX_WIDTH 40
-#define LEDPANEL_PIX_HEIGHT 20
-#define LEDPANEL_SPI_BYTES 18 // 9 shifregisters in total
+#if defined(LEDPANEL_TYPE_SINGLE) /* see platformio.ini */
+#define LEDPANEL_MODULES 1
+#elif defined(LEDPANEL_TYPE_TRIPLE)
+#define LEDPANEL_MODULES 3
+#elif !defined(LEDPANEL_MODULES)
+#error You need to define LEDPANEL_TYPE_SINGLE, LEDPANEL_TYPE_TRIPLE or LEDPANEL_MODULES!
+#endif
 
-#else
-#ifdef LEDPANEL_TYPE_TRIPLE
+/*
+ * Geometry of one module: The row drivers select one of LEDPANEL_ROWS
+ * rows (A0..A2) in each of the LEDPANEL_STRIPES stripes at the same
+ * time, pixel rows row, row+8 and row+16. Each stripe has its own chain
+ * of column drivers, LEDPANEL_MODULE_DUMMY bytes of the column driver
+ * outputs are not connected to any LED.
+ *
+ * The modules are chained, the rightmost module is the last in the
+ * chain and its bits have to be shifted out first.
+ */
+#define LEDPANEL_MODULE_WIDTH 40
+#define LEDPANEL_MODULE_HEIGHT 20
+#define LEDPANEL_MODULE_DUMMY 1
+#define LEDPANEL_ROWS 8
 
-#define LEDPANEL_PIX_WIDTH 120
-#define LEDPANEL_PIX_HEIGHT 20
-#define LEDPANEL_SPI_BYTES 54 // 27 shifregisters in total
+#if LEDPANEL_MODULE_WIDTH % 8
+#error LEDPANEL_MODULE_WIDTH must be a multiple of 8!
+#endif
 
-#else
-#error You need to define either LEDPANEL_TYPE_SINGLE or LEDPANEL_TYPE_TRIPLE!
+#define LEDPANEL_MODULE_BYTES (LEDPANEL_MODULE_WIDTH / 8)
+#define LEDPANEL_STRIPES                                                       \
+	((LEDPANEL_MODULE_HEIGHT + LEDPANEL_ROWS - 1) / LEDPANEL_ROWS)
+
+#define LEDPANEL_PIX_WIDTH (LEDPANEL_MODULES * LEDPANEL_MODULE_WIDTH)
+#define LEDPANEL_PIX_HEIGHT LEDPANEL_MODULE_HEIGHT
+
+/*
+ * The chain of modules can be split into LEDPANEL_CHAINS (1 or 2) chains
+ * of equal length: the left half is fed by SPI1, the right half by SPI2
+ * (SCK PB13, MOSI PB15). Both are clocked at the same time and latched
+ * together by the shared LE, so a row takes as long as one chain.
+ */
+#ifndef LEDPANEL_CHAINS
+#define LEDPANEL_CHAINS 1
 #endif
+
+#if LEDPANEL_CHAINS < 1 || LEDPANEL_CHAINS > 2
+#error LEDPANEL_CHAINS must be 1 or 2!
+#endif
+#if LEDPANEL_MODULES % LEDPANEL_CHAINS
+#error LEDPANEL_MODULES must be a multiple of LEDPANEL_CHAINS!
 #endif
 
-#define LEDPANEL_U8_PITCH ((LEDPANEL_PIX_WIDTH + 7) / 8)
+#define LEDPANEL_CHAIN_MODULES (LEDPANEL_MODULES / LEDPANEL_CHAINS)
+
+/* 18 bytes (9 shiftregisters) per module, per row and chain */
+#define LEDPANEL_CHAIN_BYTES                                                   \
+	(LEDPANEL_STRIPES * LEDPANEL_CHAIN_MODULES *                           \
+	 (LEDPANEL_MODULE_DUMMY + LEDPANEL_MODULE_BYTES))
+
+/* per row, the bytes of the first chain are followed by the second one */
+#define LEDPANEL_SPI_BYTES (LEDPANEL_CHAINS * LEDPANEL_CHAIN_BYTES)
+
+/* number of bitplanes in grayscale mode */
+#ifndef LEDPANEL_GRAY_BITS
+#define LEDPANEL_GRAY_BITS 4
+#endif
+
+/* bytes with pixels in a row, this is also the row length of frames in
+   the bulk stream (usb_if.h, usb_proto.h) */
+#define LEDPANEL_PIX_BYTES ((LEDPANEL_PIX_WIDTH + 7) / 8)
+
+/* bytes per row in memory, with -DLEDPANEL_WORD_ALIGNED rounded up to
+   whole 32 bit words (see ledpanel_blit.h) */
+#ifdef LEDPANEL_WORD_ALIGNED
+#define LEDPANEL_U8_PITCH ((LEDPANEL_PIX_BYTES + 3) & ~3)
+#else
+#define LEDPANEL_U8_PITCH LEDPANEL_PIX_BYTES
+#endif
+#define LEDPANEL_BUFFER_BYTES (LEDPANEL_U8_PITCH * LEDPANEL_PIX_HEIGHT)
+
+/* one plane in the bulk stream */
+#define LEDPANEL_WIRE_BYTES (LEDPANEL_PIX_BYTES * LEDPANEL_PIX_HEIGHT)
 
 /*
- * ledpanel_buffer is our framebuffer in memory, consisting of 32 bit words.
+ * ledpanel_buffer is our framebuffer in memory, 8 pixels per byte.
  *
- * The first pixel of the first row (upper left) is LSB of word 0.
- * Lines are 32bit aligned, so for a 120 pixel wide framebuffer, we
- * use 4 32-bit words (128 bits), and with 20 lines used, our total
- * framebuffer size is 4 * 20 = 80 words, 320 bytes.
+ * The first pixel of a row is the MSB of its first byte, rows are
+ * LEDPANEL_U8_PITCH bytes apart. For a 120 pixel wide panel that's 15
+ * bytes per row, 300 bytes for 20 rows, or 16 and 320 bytes with
+ * LEDPANEL_WORD_ALIGNED. Padding bytes at the end of a row are never
+ * shown.
  */
 
 #define LEDPANEL_WORD(x, y)                                                    \
@@ -43,6 +112,24 @@
 #define LEDPANEL_BIT(x) (1 << (7-((x) % 8)))
 
 #define LEDPANEL_GET(x, y) (LEDPANEL_WORD((x), (y)) & LEDPANEL_BIT(x))
+
+#if defined(__ARM_ARCH_7M__)
+/* Cortex-M3: set or clear a pixel with a single store to the bit-band
+   alias of SRAM, which can't clash with an interrupt writing the same
+   byte */
+#define LEDPANEL_BITBAND(byte, bit)                                            \
+	(*(volatile uint32_t *)(0x22000000 +                                   \
+				(((uint32_t)&(byte) - 0x20000000) << 5) +      \
+				((bit) << 2)))
+#define LEDPANEL_SET(x, y)                                                     \
+	do {                                                                   \
+		LEDPANEL_BITBAND(LEDPANEL_WORD((x), (y)), 7 - (x) % 8) = 1;    \
+	} while (0)
+#define LEDPANEL_CLR(x, y)                                                     \
+	do {                                                                   \
+		LEDPANEL_BITBAND(LEDPANEL_WORD((x), (y)), 7 - (x) % 8) = 0;    \
+	} while (0)
+#else
 #define LEDPANEL_SET(x, y)                                                     \
 	do {                                                                   \
 		LEDPANEL_WORD((x), (y)) |= LEDPANEL_BIT(x);                    \
@@ -51,17 +138,111 @@
 	do {                                                                   \
 		LEDPANEL_WORD((x), (y)) &= ~LEDPANEL_BIT(x);                   \
 	} while (0)
+#endif
+
+/* offset in a frame in memory of byte 'off' of a frame as sent over the
+   bulk stream, *n is limited to the bytes left in that row */
+static inline unsigned int ledpanel_buffer_wire_offset(unsigned int off,
+							unsigned int *n)
+{
+#if LEDPANEL_U8_PITCH != LEDPANEL_PIX_BYTES
+	unsigned int col = off % LEDPANEL_PIX_BYTES;
+
+	if (*n > LEDPANEL_PIX_BYTES - col)
+		*n = LEDPANEL_PIX_BYTES - col;
+	return off / LEDPANEL_PIX_BYTES * LEDPANEL_U8_PITCH + col;
+#else
+	(void)n;
+	return off;
+#endif
+}
+
+/*
+ * A frame consists of ledpanel_buffer_planes bitplanes, each of them laid
+ * out as described above, most significant plane first. In monochrome
+ * mode there is only one plane, the macros above always access it.
+ */
+extern volatile unsigned int ledpanel_buffer_planes;
+
+#define LEDPANEL_PLANE(buf, n) (&(buf)[(n) * LEDPANEL_BUFFER_BYTES])
+
+/* change number of bitplanes, only to be called while not scanning */
+extern void ledpanel_buffer_set_planes(unsigned int n);
+
+/*
+ * Temporal dithering (frame-rate control): frames have LEDPANEL_FRC_BITS
+ * planes like a grayscale frame, but are shown as LEDPANEL_FRC_SUBFRAMES
+ * monochrome sub-frames of equal weight. A pixel of level n is lit in n
+ * of them, with the phase scattered over neighbouring pixels so a flat
+ * area has the same number of pixels lit in every sub-frame. The
+ * sub-frames are rendered at commit time into the plane slots of
+ * ledpanel_shiftreg_t, the scan shows all of them in every row period,
+ * like bitplanes.
+ */
+#define LEDPANEL_FRC_BITS 2
+#define LEDPANEL_FRC_SUBFRAMES 3 /* (1 << LEDPANEL_FRC_BITS) - 1 */
+
+#if LEDPANEL_GRAY_BITS < LEDPANEL_FRC_SUBFRAMES
+#error LEDPANEL_GRAY_BITS must be at least LEDPANEL_FRC_SUBFRAMES!
+#endif
+
+/* number of sub-frames, 1: no temporal dithering */
+extern volatile unsigned int ledpanel_buffer_subframes;
+
+/* switch to temporal dithering, only to be called while not scanning,
+   ledpanel_buffer_set_planes() switches it off again */
+extern void ledpanel_buffer_set_frc(void);
+
+extern uint8_t ledpanel_buffer[LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES]
+	__attribute__((aligned(4)));
+
+/*
+ * The refresh never looks at ledpanel_buffer itself. Instead, all rows of
+ * all bitplanes are converted to the order in which they are shifted out
+ * by the SPI hardware once, when a frame is committed. There are two sets
+ * of these, ledpanel_buffer_shiftreg points to the one being displayed and
+ * is swapped by the refresh ISR at the start of a frame (row 0), so a frame
+ * is always shown in one piece.
+ */
+typedef uint8_t ledpanel_shiftreg_t[LEDPANEL_GRAY_BITS][LEDPANEL_ROWS]
+				   [LEDPANEL_SPI_BYTES];
+
+extern ledpanel_shiftreg_t *volatile ledpanel_buffer_shiftreg;
+
+/* convert ledpanel_buffer and show it from the start of the next frame,
+ * only to be called if ledpanel_buffer_sync() says so */
+extern void ledpanel_buffer_commit(void);
+
+/* same for a single (monochrome) plane LEDPANEL_BUFFER_BYTES from 'fb',
+ * used for content not coming from ledpanel_buffer */
+extern void ledpanel_buffer_commit_plane(const uint8_t *fb);
+
+/* same for all planes of a frame at 'fb', not shown before frame number
+ * 'frame' (see ledpanel_buffer_frame) has started */
+extern void ledpanel_buffer_commit_at(const uint8_t *fb, uint32_t frame);
+
+/* frames started since power on, counted by ledpanel_buffer_flip() */
+extern volatile uint32_t ledpanel_buffer_frame;
+
+/* commits that have been swapped in by ledpanel_buffer_flip() */
+extern volatile uint32_t ledpanel_buffer_shown;
+
+/* ledpanel_buffer_frame of the frame the last commit was swapped in at */
+extern volatile uint32_t ledpanel_buffer_shown_frame;
 
-extern uint8_t ledpanel_buffer[LEDPANEL_U8_PITCH * LEDPANEL_PIX_HEIGHT];
+/* returns non-zero if no commit is waiting to be shown anymore */
+extern int ledpanel_buffer_sync(void);
 
-/* hw specific buffer of pixels, to be written out by the SPI hardware */
-extern uint8_t ledpanel_buffer_shiftreg[LEDPANEL_SPI_BYTES];
+/* count the frame and swap shiftregister images if a commit is due,
+ * called from the refresh ISR before the first row of a frame is sent
+ * out (or from the main loop, while the panel is not scanning) */
+extern void ledpanel_buffer_flip(void);
 
 /* copy the pixels corresponding to row-driver address 'rowaddr' from
- * the global ledpanel_buffer to the global ledpanel_buffer_shiftreg,
- * this function is highly hw dependent, and will be called from the
- * ISR for the timer running the panel refresh! */
-extern void ledpanel_buffer_prepare_shiftreg(unsigned int rowaddr);
+ * the framebuffer (plane) 'fb' to the LEDPANEL_SPI_BYTES at 'dst', in the
+ * order they are shifted out, this function is highly hw dependent! */
+extern void ledpanel_buffer_prepare_shiftreg(uint8_t *dst, const uint8_t *fb,
+					     unsigned int rowaddr);
 
 /* clean ledpanel_buffer, will initialize the display with a 5x5 grid */
 extern void ledpanel_buffer_init(void);
@@ -0,0 +1,36 @@
+#ifndef LEDPANEL_CANVAS_H
+#define LEDPANEL_CANVAS_H
+
+#include "ledpanel_buffer.h"
+
+/*
+ * Virtual canvas, monochrome, wider than the panel. When enabled, the
+ * panel shows a window ("viewport") of the canvas which can be moved
+ * by a fixed amount every frame, wrapping around at the end of the
+ * canvas. Layout is the same as for ledpanel_buffer, just with a pitch
+ * of LEDPANEL_CANVAS_PITCH.
+ */
+
+/* can be overridden by build_flags in platformio.ini, multiple of 8 */
+#ifndef LEDPANEL_CANVAS_WIDTH
+#define LEDPANEL_CANVAS_WIDTH 2048
+#endif
+
+#define LEDPANEL_CANVAS_PITCH (LEDPANEL_CANVAS_WIDTH / 8)
+
+extern uint8_t ledpanel_canvas[LEDPANEL_CANVAS_PITCH * LEDPANEL_PIX_HEIGHT];
+
+/* show the canvas, wrapping around after 'width' pixels (multiple of 8,
+ * at least the panel width), 0 goes back to showing ledpanel_buffer,
+ * returns -1 for an invalid width or when in grayscale mode */
+extern int ledpanel_canvas_enable(unsigned int width);
+
+/* move the viewport to pixel x, then move it by velocity/256 pixels
+ * per frame (negative: to the left) */
+extern void ledpanel_canvas_viewport(unsigned int x, int velocity);
+
+/* to be called from the main loop, shows the next viewport position
+ * as soon as the previous one has been picked up by the refresh */
+extern void ledpanel_canvas_poll(void);
+
+#endif
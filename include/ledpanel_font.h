@@ -0,0 +1,47 @@
+#ifndef LEDPANEL_FONT_H
+#define LEDPANEL_FONT_H
+
+#include "ledpanel_buffer.h"
+
+/*
+ * Bitmap fonts in flash, for text drawn on the panel itself (see
+ * USB_PROTO_CMD_TEXT). All glyphs of a font sit side by side in one
+ * monochrome bitmap, the atlas, with the same bit order as
+ * ledpanel_buffer. A glyph is a range of atlas columns. Glyph rows are
+ * drawn as 32 bit words, so a glyph cell (glyph plus spacing, after
+ * scaling) is at most LEDPANEL_FONT_MAX_WIDTH pixels wide.
+ */
+#define LEDPANEL_FONT_MAX_WIDTH 24
+
+struct ledpanel_font {
+	const uint8_t *atlas; /* height rows of pitch bytes */
+	const uint16_t *x; /* first atlas column of each glyph, count + 1 */
+	uint16_t pitch;
+	uint8_t height;
+	uint8_t first, count; /* character codes first .. first + count - 1 */
+	uint8_t spacing; /* empty columns after each glyph */
+	uint8_t scale; /* 1, or 2 to draw each pixel as 2x2 */
+};
+
+#define LEDPANEL_FONT_5X8 0
+#define LEDPANEL_FONT_10X16 1 /* 5x8 glyphs, doubled */
+#define LEDPANEL_FONTS 2
+
+extern const struct ledpanel_font ledpanel_fonts[LEDPANEL_FONTS];
+
+/* flags for ledpanel_font_draw() */
+#define LEDPANEL_FONT_OPAQUE 0x01 /* clear the rest of the glyph cells */
+#define LEDPANEL_FONT_INVERT 0x02 /* dark text on lit background */
+
+/* width of n characters in pixels, without the spacing after the last */
+extern int ledpanel_font_width(const struct ledpanel_font *f, const uint8_t *s,
+			       unsigned int n);
+
+/* draw n characters with the top left corner at pixel x, y (parts off
+ * the panel are clipped) into all planes of ledpanel_buffer, characters
+ * missing in the font are drawn as '?', returns x after the last cell */
+extern int ledpanel_font_draw(const struct ledpanel_font *f, int x, int y,
+			      const uint8_t *s, unsigned int n,
+			      unsigned int flags);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef LEDPANEL_QUEUE_H
+#define LEDPANEL_QUEUE_H
+
+#include "ledpanel_buffer.h"
+
+/*
+ * Queue of frames received ahead of time, each to be shown a given
+ * number of refresh frames after the previous one. This way the host
+ * can send frames as fast as it likes, and the refresh ISR does the
+ * pacing (see ledpanel_buffer_commit_at()).
+ *
+ * Frames are ledpanel_buffer_planes * LEDPANEL_BUFFER_BYTES, so the
+ * queue holds fewer frames in grayscale mode.
+ */
+
+/* can be overridden by build_flags in platformio.ini */
+#ifndef LEDPANEL_QUEUE_BYTES
+#define LEDPANEL_QUEUE_BYTES (8 * LEDPANEL_BUFFER_BYTES)
+#endif
+
+/* drop all queued frames, e.g. after switching to grayscale */
+extern void ledpanel_queue_flush(void);
+
+/* space for the next frame, or NULL if the queue is full */
+extern uint8_t *ledpanel_queue_tail(void);
+
+/* frame at ledpanel_queue_tail() is complete, show it 'interval' frames
+ * after the previous one, or right away if the queue ran empty */
+extern void ledpanel_queue_push(unsigned int interval);
+
+/* to be called from the main loop, hands the next frame over to
+ * ledpanel_buffer as soon as the previous one is being shown */
+extern void ledpanel_queue_poll(void);
+
+/* frames dropped because they were already late */
+extern unsigned int ledpanel_queue_dropped;
+
+#endif
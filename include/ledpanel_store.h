@@ -0,0 +1,97 @@
+#ifndef LEDPANEL_STORE_H
+#define LEDPANEL_STORE_H
+
+#include <stdint.h>
+
+/*
+ * Content store: a playlist kept in flash, played from power on, so the
+ * panel shows something without a host. Data from the host stops it,
+ * and it starts over once the host has been quiet for hdr.idle seconds.
+ *
+ * The image is written with USB_IF_REQUEST_STORE (usb_if.h). A header
+ * is followed by the entries, each padded to a multiple of 4 bytes. All
+ * values are little endian.
+ */
+
+#define LEDPANEL_STORE_MAGIC 0x5453454c /* "LEST" */
+
+struct ledpanel_store_hdr {
+	uint32_t magic;
+	uint32_t len; /* bytes of entries following the header */
+	uint32_t sum; /* ledpanel_store_sum() of the entries */
+	uint16_t idle; /* seconds without host data to play again, 0: never */
+	uint16_t reserved;
+} __attribute__((packed));
+
+struct ledpanel_store_entry {
+	uint8_t type;
+	uint8_t flags; /* TEXT: font number | USB_PROTO_TEXT_* (usb_proto.h) */
+	uint16_t frames; /* refresh frames it is shown */
+	uint16_t len; /* payload bytes following */
+	int16_t x, y; /* TEXT: position in pixels, STRIP: x = first column */
+	int16_t v; /* STRIP: velocity in 1/256 pixels per frame */
+} __attribute__((packed));
+
+/* monochrome frame, packed like a frame in the bulk stream */
+#define LEDPANEL_STORE_FRAME 0x01
+
+/* w bytes for each row of the panel, row by row, w = len / height,
+   scrolled through on the canvas (ledpanel_canvas.h) */
+#define LEDPANEL_STORE_STRIP 0x02
+
+/* characters drawn on a dark frame, like USB_PROTO_CMD_TEXT */
+#define LEDPANEL_STORE_TEXT 0x03
+
+#define LEDPANEL_STORE_PAD(n) (((n) + 3) & ~3u)
+
+static inline uint32_t ledpanel_store_sum(const uint8_t *p, uint32_t len)
+{
+	uint32_t sum = 0;
+
+	while (len--)
+		sum = ((sum << 1) | (sum >> 31)) + *p++;
+	return sum;
+}
+
+/* play the image at 'image' (at most size bytes), returns -1 if it is
+   not valid for this panel, NULL: forget the image */
+extern int ledpanel_store_open(const uint8_t *image, uint32_t size);
+
+/* start playing from the first entry, or stop (and don't start again
+   when the host is quiet), returns -1 if there is nothing to play */
+extern int ledpanel_store_play(int on);
+
+/* the host has sent content, stop playing */
+extern void ledpanel_store_host(void);
+
+/* called by systick, 10 Hz */
+extern void ledpanel_store_tick(void);
+
+/* to be called from the main loop, shows the next entry when due */
+extern void ledpanel_store_poll(void);
+
+/* firmware only (ledpanel_store_flash.c): open the image in flash, right
+   below the settings page, returns -1 if there is none */
+extern int ledpanel_store_load(void);
+
+/* queue len bytes (at most 128) to be programmed at offset of the image
+   in flash, the store is erased first for offset 0, returns -1 if they
+   are refused, the previous write is still busy, or (offset > 0) a write
+   failed since the last erase */
+extern int ledpanel_store_write(uint32_t offset, const uint8_t *data,
+				unsigned int len);
+
+/* state of the last ledpanel_store_write() */
+#define LEDPANEL_STORE_DONE 0x00
+#define LEDPANEL_STORE_BUSY 0x01
+#define LEDPANEL_STORE_FAILED 0xff
+extern int ledpanel_store_write_status(void);
+
+/* to be called from the main loop, erases a page or programs the queued
+   bytes. The refresh is off until the host is quiet for a second */
+extern void ledpanel_store_write_poll(void);
+
+/* called by systick, 10 Hz */
+extern void ledpanel_store_write_tick(void);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+/*
+ * Optional cycle count profiling with the DWT cycle counter, enabled by
+ * -DPROFILE in platformio.ini. Without it, all of the macros below
+ * compile to nothing. Cycles spent in interrupts are included in the
+ * regions they interrupt.
+ */
+
+enum profile_region {
+	PROFILE_TIM2_ISR, /* tim2_isr(), whole function */
+	PROFILE_PREPARE_SHIFTREG, /* one ledpanel_buffer_prepare_shiftreg() */
+	PROFILE_BULKOUT, /* usb_if_bulkout_cb() */
+	PROFILE_TIM2_LATENCY, /* TIM2 update event to entry of tim2_isr() */
+	PROFILE_NREGIONS
+};
+
+/* histogram bucket n counts durations of 2^(n-1) to 2^n-1 cycles */
+#define PROFILE_BUCKETS 16
+
+/* as returned by USB_IF_REQUEST_PROFILE, little endian */
+struct profile_stats {
+	uint32_t count;
+	uint32_t min; /* cycles */
+	uint32_t max;
+	uint32_t hist[PROFILE_BUCKETS];
+} __attribute__((packed));
+
+#ifdef PROFILE
+
+#include <libopencm3/cm3/dwt.h>
+
+extern struct profile_stats profile_stats[PROFILE_NREGIONS];
+
+extern void profile_init(void);
+extern void profile_reset(void);
+extern void profile_add(enum profile_region r, uint32_t cycles);
+
+#define PROFILE_START(r) uint32_t profile_t0_##r = DWT_CYCCNT
+#define PROFILE_END(r) profile_add(PROFILE_##r, DWT_CYCCNT - profile_t0_##r)
+#define PROFILE_ADD(r, cycles) profile_add(PROFILE_##r, (cycles))
+
+#else
+
+#define profile_init() do {} while (0)
+#define PROFILE_START(r) do {} while (0)
+#define PROFILE_END(r) do {} while (0)
+#define PROFILE_ADD(r, cycles) do {} while (0)
+
+#endif
+
+#endif
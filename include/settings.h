@@ -0,0 +1,36 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include "hw_matrix.h"
+
+#include <stdint.h>
+
+/*
+ * Calibration kept across power cycles in the last page of flash:
+ * current gain of each column driver and the brightness curve.
+ */
+struct settings {
+	uint32_t magic;
+	uint8_t gain_valid; /* gain[] has been set, otherwise not written */
+	uint8_t gamma_valid; /* gamma[] has been set, otherwise linear */
+	uint16_t brightness; /* hw_matrix_pwm() */
+	uint16_t gain[HW_MATRIX_DRIVERS];
+	uint16_t gamma[HW_MATRIX_GAMMA_POINTS];
+};
+
+/* pages are 1k on the medium density devices (F103x8/xB) */
+#define SETTINGS_PAGE_SIZE 1024
+
+extern struct settings settings;
+
+/* start of the settings page, the last one of flash */
+extern uint32_t settings_addr(void);
+
+/* read settings from flash (defaults if there are none) and apply them,
+   after hw_matrix_init() */
+extern void settings_load(void);
+
+/* write settings to flash, returns -1 on error */
+extern int settings_save(void);
+
+#endif
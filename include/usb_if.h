@@ -1,13 +1,76 @@
 #ifndef USB_IF_H
 #define USB_IF_H
 
+#include <stdint.h>
+
+/*
+ * USB is handled in the USB low priority interrupt, received data is
+ * copied to the framebuffer by usb_if_poll() from the main loop, which
+ * holds usb_if_lock() while touching anything the USB requests change.
+ */
 extern void usb_if_poll(void);
 extern void usb_if_init(void);
+extern void usb_if_tick(void); /* called by systick, 10 Hz */
+extern void usb_if_lock(void); /* keep the USB interrupt out */
+extern void usb_if_unlock(void);
+extern int usb_if_pending(void); /* usb_if_poll() has work to do */
+/* drop partial bulk data, the host's next byte starts a new frame, for
+   the panel changing modes on its own (with usb_if_lock() held) */
+extern void usb_if_reset_bulk(void);
+
+#define USB_IF_VENDOR_ID 0x4e65 /* {0x4e,0x65,0x72,0x64} = "Nerd" */
+#define USB_IF_PRODUCT_ID 0x7264
+#define USB_IF_BULK_EP 0x01 /* framebuffer data, usb_proto.h */
 
+/* RESET_WRITEPTR, GRAY_MODE, BULK_MODE and PLAY take effect in bulk
+   stream order, frames sent before them are still shown */
 #define USB_IF_REQUEST_RESET_WRITEPTR 0x0000
 #define USB_IF_REQUEST_PANEL_ONOFF 0x0001
 #define USB_IF_REQUEST_PANEL_BRIGHTNESS 0x0002
 #define USB_IF_REQUEST_MBI5029_MODE 0x0003
+#define USB_IF_REQUEST_GRAY_MODE 0x0004 /* wValue: HW_MATRIX_MONO/GRAY/FRC */
+#define USB_IF_REQUEST_BULK_MODE 0x0005 /* 0: raw frames, 1: usb_proto.h */
+#define USB_IF_REQUEST_CANVAS 0x0006 /* wValue: canvas width, 0: off */
+#define USB_IF_REQUEST_VIEWPORT 0x0007 /* wValue: x, wIndex: 1/256 pix/frame */
+#define USB_IF_REQUEST_STATS 0x0008 /* device to host, struct usb_if_stats */
+/* only with -DPROFILE: device to host, struct profile_stats for region
+   wIndex (profile.h), host to device: reset all regions */
+#define USB_IF_REQUEST_PROFILE 0x0009
+/* wValue: refresh rate in Hz, wIndex: SPI clock divider 2 << wIndex for
+   the current mode (0xffff: keep), refused if a row doesn't fit */
+#define USB_IF_REQUEST_TIMING 0x000a
+/* data: current gain (MBI5029 configuration word) for drivers wIndex,
+   wIndex+1, ..., see hw_matrix_gain() */
+#define USB_IF_REQUEST_GAIN 0x000b
+/* data: USB_IF_GAMMA_POINTS brightness curve points, hw_matrix_gamma() */
+#define USB_IF_REQUEST_GAMMA 0x000c
+#define USB_IF_GAMMA_POINTS 33 /* HW_MATRIX_GAMMA_POINTS */
+/* store brightness, gain and curve in flash (settings.h) */
+#define USB_IF_REQUEST_SAVE 0x000d
+/* data: part of the content store image (ledpanel_store.h) at byte
+   offset wValue * 4, an even number of bytes, offset 0 erases the store.
+   It is written after the request completes, the next part is refused
+   until then, and after a failure until offset 0 again. Device to host:
+   one byte, LEDPANEL_STORE_DONE, _BUSY or _FAILED. The panel is dark
+   while writing, until PLAY or a second after the last part */
+#define USB_IF_REQUEST_STORE 0x000e
+/* wValue: 1 play the content store from the start, 0 stop (and don't
+   play again when the host is quiet). Playing switches the panel to
+   monochrome, the host sets its mode again afterwards */
+#define USB_IF_REQUEST_PLAY 0x000f
+
+/* performance counters, all counting up since power on, little endian */
+struct usb_if_stats {
+	uint32_t rows; /* rows latched by the refresh */
+	uint32_t frames; /* refresh frames started */
+	uint32_t shown; /* commits swapped in at the start of a frame */
+	uint32_t bulk_packets; /* bulk OUT packets read */
+	uint32_t bulk_bytes;
+	uint32_t raw_frames; /* frames completed in raw bulk mode */
+	uint32_t dma_busy; /* SPI not finished with a row at latch time */
+	uint32_t queue_dropped; /* late frames skipped by ledpanel_queue */
+	uint32_t loops_per_sec; /* main loop wakeups in the last second */
+} __attribute__((packed));
 
 
 #endif
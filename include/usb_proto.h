@@ -0,0 +1,102 @@
+#ifndef USB_PROTO_H
+#define USB_PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Framed protocol on the bulk OUT endpoint, selected by
+ * USB_IF_REQUEST_BULK_MODE (see usb_if.h). Every command starts with
+ * a header, followed by hdr.len bytes of payload. All values are little
+ * endian, x and w are counted in bytes (8 pixel columns), not pixels.
+ * Frames and rectangles are always packed (LEDPANEL_PIX_BYTES per row),
+ * whatever the layout in memory.
+ */
+
+struct usb_proto_hdr {
+	uint8_t cmd;
+	uint8_t flags;
+	uint16_t len; /* payload bytes following the header */
+	uint8_t arg[4]; /* command specific */
+} __attribute__((packed));
+
+/* commit the frame after this command has been executed */
+#define USB_PROTO_FLAG_COMMIT 0x01
+
+/* no operation, payload is discarded */
+#define USB_PROTO_CMD_NOP 0x00
+
+/* overwrite a rectangle of the framebuffer: arg[] = { x, y, w, h },
+   payload is w*h bytes per bitplane, row by row, planes in the same
+   order as in the framebuffer */
+#define USB_PROTO_CMD_PATCH 0x01
+
+/* commit the frame, no arguments, no payload */
+#define USB_PROTO_CMD_COMMIT 0x02
+
+/* whole frame (all planes), PackBits compressed: a control byte n of
+   0..127 is followed by n+1 literal bytes, 129..255 by one byte to be
+   repeated 257-n times, 128 is ignored. arg[0] = flags below */
+#define USB_PROTO_CMD_PACKBITS 0x03
+
+/* decoded bytes are XORed to the framebuffer (delta to previous frame) */
+#define USB_PROTO_PACKBITS_XOR 0x01
+
+/* overwrite columns of the canvas (ledpanel_canvas.h), arg[0..1] = x in
+   bytes, payload is w bytes for each row of the panel, row by row,
+   w = len / LEDPANEL_PIX_HEIGHT */
+#define USB_PROTO_CMD_CANVAS 0x04
+
+/* whole frame (all planes) for the frame queue (ledpanel_queue.h),
+   arg[0..1] = number of refresh frames after the previous queued frame
+   this one is shown, the command waits while the queue is full */
+#define USB_PROTO_CMD_QUEUE 0x05
+
+/* text in one of the fonts in flash (ledpanel_font.h), drawn into the
+   framebuffer, payload is the characters (at most USB_PROTO_TEXT_MAX),
+   arg[0..1] = x in pixels (signed, unlike other commands), arg[2] = y
+   (signed), arg[3] = font number | flags below */
+#define USB_PROTO_CMD_TEXT 0x06
+
+#define USB_PROTO_TEXT_MAX 64
+#define USB_PROTO_TEXT_FONT 0x0f /* mask for the font number */
+#define USB_PROTO_TEXT_OPAQUE 0x10 /* clear the background of the text */
+#define USB_PROTO_TEXT_INVERT 0x20 /* dark on lit, best with OPAQUE */
+#define USB_PROTO_TEXT_CENTER 0x40 /* x is the center of the text */
+#define USB_PROTO_TEXT_RIGHT 0x80 /* x is just right of the text */
+
+/* rectangle in pixels, payload of the commands below */
+struct usb_proto_rect {
+	int16_t x, y;
+	uint16_t w, h;
+} __attribute__((packed));
+
+/* clear, set or invert a rectangle in all planes, arg[0] = operation
+   below, payload is a struct usb_proto_rect */
+#define USB_PROTO_CMD_FILL 0x07
+
+#define USB_PROTO_FILL_CLEAR 0x00
+#define USB_PROTO_FILL_SET 0x01
+#define USB_PROTO_FILL_INVERT 0x02
+
+/* move the contents of a rectangle by arg[0] pixels to the right and
+   arg[1] pixels down (both signed), pixels moved in are cleared,
+   payload is a struct usb_proto_rect */
+#define USB_PROTO_CMD_SCROLL 0x08
+
+/* draw n characters like USB_PROTO_CMD_TEXT, font: font number | flags,
+   also used for the text entries of ledpanel_store.h */
+extern void usb_proto_text(int x, int y, unsigned int font, const uint8_t *s,
+			   unsigned int n);
+
+/* start over, discard a partially received command */
+extern void usb_proto_reset(void);
+
+/* consume up to len bytes of the bulk stream, returns the number of
+   bytes used, this is less than len if we have to wait for a commit */
+extern unsigned int usb_proto_feed(const uint8_t *buf, unsigned int len);
+
+/* a complete command still waits for a commit, usb_proto_feed() has to
+   be called again, even without new data */
+extern int usb_proto_waiting(void);
+
+#endif
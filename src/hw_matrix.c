@@ -20,6 +20,7 @@
 
 #include "hw_matrix.h"
 #include "ledpanel_buffer.h"
+#include "profile.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -45,13 +46,365 @@
 #define COL_PIN_OE GPIO8
 #define COL_PIN_LE GPIO4
 
+/* can be overridden by build_flags in platformio.ini */
+#ifndef HW_MATRIX_REFRESH
+#define HW_MATRIX_REFRESH 250
+#endif
+
 /* for timer configuration */
 static const unsigned int led_cycles = 8; /* 8 row cycles */
-static const unsigned int led_refresh = 250; /* Hz */
+static unsigned int led_refresh = HW_MATRIX_REFRESH; /* Hz */
 static const unsigned int tim2_period = 1000;
 static unsigned int tim2_prescaler;
 
-static uint8_t curr_row = 0; /* current row */
+volatile uint32_t hw_matrix_rows;
+volatile uint32_t hw_matrix_dma_busy;
+
+/* SPI clock divider (SPI_CR1_BR_*), in grayscale mode we have to shift
+   out LEDPANEL_GRAY_BITS planes per row instead of a single one */
+#ifdef HW_MATRIX_DMA_SCAN
+#define SPI_BR_MONO SPI_CR1_BR_FPCLK_DIV_16
+#else
+#define SPI_BR_MONO SPI_CR1_BR_FPCLK_DIV_64
+#endif
+#define SPI_BR_GRAY SPI_CR1_BR_FPCLK_DIV_16
+
+/* MBI5029 is good for 25 MHz, SPI1 runs from 72 MHz APB2 */
+#define SPI_BR_MIN SPI_CR1_BR_FPCLK_DIV_4
+
+/* the second chain (LEDPANEL_CHAINS) is fed by SPI2 and DMA1 ch5, SPI2
+   runs from APB1 at half the clock, so its divider is one step lower */
+#define SPI2_DMA_CH 5
+
+/* current dividers, changed by hw_matrix_timing() */
+static unsigned int spi_br_mono = SPI_BR_MONO;
+static unsigned int spi_br_gray = SPI_BR_GRAY;
+
+static uint8_t curr_row = 8; /* current row, 8: nothing sent yet */
+static uint8_t curr_plane = 0; /* current bitplane */
+static unsigned int scan_planes = 1; /* per row */
+static int scan_frc; /* the planes are sub-frames of temporal dithering */
+static volatile int running; /* refresh ISR enabled */
+
+static unsigned char pwm_brightness;
+
+/* brightness to on-time (1/65536), at brightness 0, 8, 16, ... 256,
+   see hw_matrix_gamma(), linear by default */
+static uint16_t gamma_curve[HW_MATRIX_GAMMA_POINTS];
+
+/*
+ * Binary code modulation: each row is shown once per bitplane, every
+ * bitplane in its own timer period ("slot"). The on-time of a slot
+ * (controlled by OC4 driving ROW_nE1) is proportional to the weight of
+ * the plane, slot_unit being the on-time at full brightness for the least
+ * significant plane. As the data for the next plane has to be shifted out
+ * during a slot, slots are never shorter than the SPI transfer, short
+ * planes only get a shorter on-time.
+ *
+ * The sub-frames of temporal dithering are scanned the same way, as
+ * planes of equal weight, so each row shows all of them in every
+ * refresh frame.
+ *
+ * In monochrome mode there is only one slot of tim2_period.
+ */
+static uint16_t slot_period[LEDPANEL_GRAY_BITS];
+static uint16_t slot_oc[LEDPANEL_GRAY_BITS];
+static unsigned int slot_unit;
+
+/*
+ * New refresh rate and SPI clock from hw_matrix_timing(), taken over by
+ * the refresh ISR at the start of a frame, so no row is shown with a mix
+ * of old and new settings.
+ */
+static struct {
+	unsigned int prescaler;
+	unsigned int br;
+	unsigned int unit;
+	uint16_t period[LEDPANEL_GRAY_BITS];
+	uint16_t oc[LEDPANEL_GRAY_BITS];
+} timing_next;
+static volatile int timing_pending;
+
+/* timer ticks needed to shift out 'bits' bits at SPI clock divider br,
+   TIM2 running with prescaler */
+static unsigned int spi_ticks(unsigned int bits, unsigned int br,
+			      unsigned int prescaler)
+{
+	/* SPI1 runs from APB2, TIM2 from 2x APB1 */
+	unsigned int cycles_per_tick = (prescaler + 1) *
+				       (rcc_apb2_frequency / 1000) /
+				       (rcc_apb1_frequency * 2 / 1000);
+	unsigned int cycles = bits * (2 << br);
+
+	return (cycles + cycles_per_tick - 1) / cycles_per_tick;
+}
+
+static void spi_set_br(unsigned int br)
+{
+	SPI1_CR1 = (SPI1_CR1 & ~(7 << 3)) | (br << 3);
+#if LEDPANEL_CHAINS > 1
+	SPI2_CR1 = (SPI2_CR1 & ~(7 << 3)) | ((br - 1) << 3);
+#endif
+}
+
+/* send n bytes at p on every chain, the next chain's bytes follow
+   LEDPANEL_CHAIN_BYTES later */
+static void spi_dma_start(const uint8_t *p, unsigned int n)
+{
+	DMA1_CCR(3) = 0;
+	DMA1_CMAR(3) = (uint32_t)p;
+	DMA1_CNDTR(3) = n;
+#if LEDPANEL_CHAINS > 1
+	DMA1_CCR(SPI2_DMA_CH) = 0;
+	DMA1_CMAR(SPI2_DMA_CH) = (uint32_t)(p + LEDPANEL_CHAIN_BYTES);
+	DMA1_CNDTR(SPI2_DMA_CH) = n;
+	DMA1_CCR(SPI2_DMA_CH) = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+#endif
+	DMA1_CCR(3) = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+}
+
+/* any chain still shifting */
+static int spi_busy(void)
+{
+#if LEDPANEL_CHAINS > 1
+	if (DMA1_CNDTR(SPI2_DMA_CH) || (SPI2_SR & SPI_SR_BSY))
+		return 1;
+#endif
+	return DMA1_CNDTR(3) || (SPI1_SR & SPI_SR_BSY);
+}
+
+/* switch to timing_next, refresh is stopped or at the start of a frame */
+static void hw_matrix_apply_timing(void)
+{
+	unsigned int p, last = scan_planes - 1;
+
+	for (p = 0; p < LEDPANEL_GRAY_BITS; p++) {
+		slot_period[p] = timing_next.period[p];
+		slot_oc[p] = timing_next.oc[p];
+	}
+	slot_unit = timing_next.unit;
+	tim2_prescaler = timing_next.prescaler;
+	spi_set_br(timing_next.br);
+
+	/* restart the slot that's just being shown (last plane of the last
+	   row) with the new prescaler, without another update interrupt */
+	timer_set_prescaler(TIM2, tim2_prescaler);
+	timer_set_period(TIM2, slot_period[last]);
+	timer_set_oc_value(TIM2, TIM_OC4, slot_oc[last]);
+	timer_generate_event(TIM2, TIM_EGR_UG);
+
+	timing_pending = 0;
+}
+
+/*
+ *  MBI5029 datasheet: switching to special mode
+ *
+ *         1__   2__   3__   4__   5__
+ *  CLK ___/  \__/  \__/  \__/  \__/  \___
+ *      :     :     :     :     :     :
+ *      ______:     :_____________________
+ *  nOE :     \_____/     :     :     :
+ *      :     :     :     :_____:     :
+ *  LE  __________________/_____\_________
+ *      :     :     :     :  ^  :     :
+ *      :     :     :     :  |  :     :
+ *      :     :     :     :     :     :
+ *       [0]   [1]   [2]   [3]   [4]
+ *
+ *  During the 4th clock cycle (index [3]), if LE
+ *  is high, we are in the special mode, if LE is
+ *  low, we are in the normal mode.
+ *
+ *  Data is latched into the chip on the rising edge.
+ *
+ *  Note that there is an inverter between our
+ *  output pins, and the input to the chip (on the
+ *  LED matrix board itself), so we have to set
+ *  "nOE_inv" high.
+ */
+
+/*
+ * MBI5029 datasheet: CLK and LE pulse width 20 ns, SDI setup 5 ns and
+ * hold 10 ns, LE setup and hold 15 ns. The inverters on the module and
+ * the cables slow down the edges, so every half clock is given four
+ * times the longest of them, 80 ns or 6 cycles at 72 MHz (the loop only
+ * adds to that).
+ */
+#define MBI5029_DELAY_NS 80
+#define MBI5029_DELAY_CYCLES ((MBI5029_DELAY_NS * 72 + 999) / 1000)
+
+static void mbi5029_delay(void)
+{
+	unsigned int u;
+
+	for (u = 0; u < MBI5029_DELAY_CYCLES; u++)
+		asm volatile ("nop");
+}
+
+/* SCK of all chains */
+static void mbi5029_sck(int high)
+{
+	if (high) {
+		gpio_set(GPIO_BANK_SPI1_SCK, GPIO_SPI1_SCK);
+#if LEDPANEL_CHAINS > 1
+		gpio_set(GPIO_BANK_SPI2_SCK, GPIO_SPI2_SCK);
+#endif
+	} else {
+		gpio_clear(GPIO_BANK_SPI1_SCK, GPIO_SPI1_SCK);
+#if LEDPANEL_CHAINS > 1
+		gpio_clear(GPIO_BANK_SPI2_SCK, GPIO_SPI2_SCK);
+#endif
+	}
+}
+
+/* SCK and MOSI as GPIOs for bit-banging, or back to SPI */
+static void mbi5029_bitbang(int on)
+{
+	uint8_t cnf = on ? GPIO_CNF_OUTPUT_PUSHPULL :
+			   GPIO_CNF_OUTPUT_ALTFN_PUSHPULL;
+
+	if (on) {
+		mbi5029_sck(0);
+		gpio_clear(GPIO_BANK_SPI1_MOSI, GPIO_SPI1_MOSI);
+#if LEDPANEL_CHAINS > 1
+		gpio_clear(GPIO_BANK_SPI2_MOSI, GPIO_SPI2_MOSI);
+#endif
+	}
+	gpio_set_mode(GPIO_BANK_SPI1_SCK, GPIO_MODE_OUTPUT_10_MHZ, cnf,
+		      GPIO_SPI1_SCK);
+	gpio_set_mode(GPIO_BANK_SPI1_MOSI, GPIO_MODE_OUTPUT_10_MHZ, cnf,
+		      GPIO_SPI1_MOSI);
+#if LEDPANEL_CHAINS > 1
+	gpio_set_mode(GPIO_BANK_SPI2_SCK, GPIO_MODE_OUTPUT_10_MHZ, cnf,
+		      GPIO_SPI2_SCK);
+	gpio_set_mode(GPIO_BANK_SPI2_MOSI, GPIO_MODE_OUTPUT_10_MHZ, cnf,
+		      GPIO_SPI2_MOSI);
+#endif
+}
+
+/* the five clocks of the mode switch, SCK has to be bit-banged */
+static void mbi5029_mode_clocks(int special)
+{
+	unsigned int i;
+	unsigned int nOE_inv_steps[] = { 0, 1, 0, 0, 0 };
+	unsigned int LE_steps[] = { 0, 0, 0, 1, 0 };
+
+	LE_steps[3] = !!special;
+
+	gpio_clear(COL_IO_BANK, COL_PIN_OE);
+	gpio_clear(COL_IO_BANK, COL_PIN_LE);
+
+	for (i=0; i<5; i++) {
+		if (nOE_inv_steps[i])
+			gpio_set(COL_IO_BANK, COL_PIN_OE);
+		else
+			gpio_clear(COL_IO_BANK, COL_PIN_OE);
+
+		if (LE_steps[i])
+			gpio_set(COL_IO_BANK, COL_PIN_LE);
+		else
+			gpio_clear(COL_IO_BANK, COL_PIN_LE);
+
+		mbi5029_sck(0);
+		mbi5029_delay();
+		mbi5029_sck(1);
+		mbi5029_delay();
+	}
+	mbi5029_sck(0);
+}
+
+void hw_matrix_mbi5029_mode(int special)
+{
+	mbi5029_bitbang(1);
+	mbi5029_mode_clocks(special);
+	mbi5029_bitbang(0);
+}
+
+/*
+ * Configuration words for all column drivers, in the order they are
+ * shifted out (first word ends up in the last driver of the chain), each
+ * LSB first, like the SPI does, laid out like a row of the shiftregister
+ * image if there are several chains. In special mode, LE high during the
+ * very last clock writes them to the configuration registers.
+ */
+static uint8_t mbi5029_cfg[LEDPANEL_SPI_BYTES];
+
+/*
+ * While the refresh ISR is running, the configuration is written in
+ * between two rows: in one slot, the drivers are put into special mode
+ * and all but the last byte are sent by DMA like a row, in the next one
+ * the last byte is bit-banged with LE and the drivers go back to normal
+ * mode. The row latched before is dark in the first and shown in the
+ * second slot, so a frame only gets one slot longer.
+ */
+enum { CFG_IDLE, CFG_PENDING, CFG_SHIFTING };
+static volatile int cfg_state;
+
+/* bit-bang n bytes at p on every chain (the next chain's bytes follow
+   LEDPANEL_CHAIN_BYTES later), LE high during the last bit if le */
+static void mbi5029_shift(const uint8_t *p, unsigned int n, int le)
+{
+	unsigned int bitno;
+
+	while (n--) {
+		for (bitno = 0; bitno < 8; bitno++) {
+			if (le && !n && bitno == 7)
+				gpio_set(COL_IO_BANK, COL_PIN_LE);
+			if (*p & (1 << bitno))
+				gpio_set(GPIO_BANK_SPI1_MOSI, GPIO_SPI1_MOSI);
+			else
+				gpio_clear(GPIO_BANK_SPI1_MOSI, GPIO_SPI1_MOSI);
+#if LEDPANEL_CHAINS > 1
+			if (p[LEDPANEL_CHAIN_BYTES] & (1 << bitno))
+				gpio_set(GPIO_BANK_SPI2_MOSI, GPIO_SPI2_MOSI);
+			else
+				gpio_clear(GPIO_BANK_SPI2_MOSI, GPIO_SPI2_MOSI);
+#endif
+			mbi5029_delay();
+			mbi5029_sck(1);
+			mbi5029_delay();
+			mbi5029_sck(0);
+		}
+		p++;
+	}
+	gpio_clear(COL_IO_BANK, COL_PIN_LE);
+}
+
+/* write all of mbi5029_cfg[] at once, drivers are in special mode */
+static void mbi5029_cfg_write(void)
+{
+	/* the last row may still be shifting out */
+	while (spi_busy())
+		;
+
+	mbi5029_bitbang(1);
+	mbi5029_shift(mbi5029_cfg, LEDPANEL_CHAIN_BYTES, 1);
+	mbi5029_bitbang(0);
+	cfg_state = CFG_IDLE;
+}
+
+/* first slot: special mode, start DMA for all but the last byte */
+static void mbi5029_cfg_start(void)
+{
+	mbi5029_bitbang(1);
+	mbi5029_mode_clocks(1);
+	mbi5029_bitbang(0);
+
+	spi_dma_start(mbi5029_cfg, LEDPANEL_CHAIN_BYTES - 1);
+
+	cfg_state = CFG_SHIFTING;
+}
+
+/* second slot: last byte with LE, back to normal mode, DMA is done */
+static void mbi5029_cfg_finish(void)
+{
+	mbi5029_bitbang(1);
+	mbi5029_shift(&mbi5029_cfg[LEDPANEL_CHAIN_BYTES - 1], 1, 1);
+	mbi5029_mode_clocks(0);
+	mbi5029_bitbang(0);
+
+	cfg_state = CFG_IDLE;
+}
 
 /*
  * Timer2 overflow. Note that we generate ROW_nE1 via PWM,
@@ -61,10 +414,32 @@ static uint8_t curr_row = 0; /* current row */
  */
 void tim2_isr()
 {
+	PROFILE_START(TIM2_ISR);
+
+	/* TIM2 runs at the CPU clock (APB1 * 2), count is ticks since update */
+	PROFILE_ADD(TIM2_LATENCY, TIM2_CNT * (tim2_prescaler + 1));
+
 	/* disable row and column output drivers */
 	gpio_clear(COL_IO_BANK, COL_PIN_OE);
 
-	if (curr_row < 8) {
+	if (cfg_state == CFG_SHIFTING) {
+		/* configuration has been sent during the last slot, the
+		   row latched before is shown now, with the same timing */
+		if (spi_busy()) {
+			/* not quite, try again after another dark slot */
+			hw_matrix_dma_busy++;
+			timer_clear_flag(TIM2, TIM_SR_UIF);
+			PROFILE_END(TIM2_ISR);
+			return;
+		}
+		mbi5029_cfg_finish();
+		gpio_set(COL_IO_BANK, COL_PIN_OE);
+	} else if (curr_row < 8) {
+		/* SPI should long be done with this row */
+		if (spi_busy())
+			hw_matrix_dma_busy++;
+		hw_matrix_rows++;
+
 		/* latch data from shiftregs to column driver out */
 		gpio_set(COL_IO_BANK, COL_PIN_LE);
 
@@ -73,51 +448,237 @@ void tim2_isr()
 		gpio_clear(ROW_IO_BANK, 0x0007 & ~curr_row);
 		gpio_set(ROW_IO_BANK, 0x0007 & curr_row);
 
+		/* length and on-time of this slot, we are still at
+		   the very beginning of the timer period */
+		timer_set_period(TIM2, slot_period[curr_plane]);
+		timer_set_oc_value(TIM2, TIM_OC4, slot_oc[curr_plane]);
+
 		/* enable row and column output drivers */
 		gpio_set(COL_IO_BANK, COL_PIN_OE);
 
-		/* next row to be transfered: */
-		curr_row = (curr_row + 1) & 7;
+		/* next plane/row to be transfered: */
+		if (++curr_plane >= scan_planes) {
+			curr_plane = 0;
+			curr_row = (curr_row + 1) & 7;
+		}
 	} else {
 		/* special handling for the first row that's ever
 		transfered, there's not yet valid data in the
 		column drivers, so don't enable the outputs */
 		curr_row = 0;
+		curr_plane = 0;
+
+		/* after a mode switch the period can still be that of
+		   a short plane, too short for the row sent now */
+		timer_set_period(TIM2, slot_period[0]);
 	}
 
-	/* prepare bits to send to the column driver in correct order */
-	ledpanel_buffer_prepare_shiftreg(curr_row);
+	/* send MBI5029 configuration instead of the next row, but not
+	   right at the start of a frame, and not while the SPI is still
+	   busy with the last row */
+	if (cfg_state == CFG_PENDING && curr_row && curr_row < 8 &&
+	    !spi_busy()) {
+		mbi5029_cfg_start();
+		timer_clear_flag(TIM2, TIM_SR_UIF);
+		PROFILE_END(TIM2_ISR);
+		return;
+	}
+
+	/* start of a new frame, show a freshly committed buffer */
+	if (curr_row == 0 && curr_plane == 0) {
+		if (timing_pending)
+			hw_matrix_apply_timing();
+		ledpanel_buffer_flip();
+	}
 
 	/* deassert latch enable pin */
 	gpio_clear(COL_IO_BANK, COL_PIN_LE);
 
-	/* restart DMA to transfer SPI data */
-	DMA1_CCR(3) = 0;
-	DMA1_CNDTR(3) = 0;
+	/* restart DMA to transfer the prepared SPI data */
+	spi_dma_start((*ledpanel_buffer_shiftreg)
+		[curr_plane][curr_row],
+		LEDPANEL_CHAIN_BYTES);
 
-	DMA1_CMAR(3) = (uint32_t)&ledpanel_buffer_shiftreg; /* memory */
-	DMA1_CPAR(3) = (uint32_t)&SPI1_DR; /* peripheral */
+	timer_clear_flag(TIM2, TIM_SR_UIF);
 
-	DMA1_CCR(3) = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
-	DMA1_CNDTR(3) = sizeof(ledpanel_buffer_shiftreg);
+	PROFILE_END(TIM2_ISR);
+}
 
-	timer_clear_flag(TIM2, TIM_SR_UIF);
+/*
+ * ISR-free scanning (monochrome only), everything is done by TIM2
+ * compare/update events triggering DMA transfers:
+ *
+ *   CC1     (DMA1 ch5): GPIOA_BSRR <- LE low
+ *   CC3     (DMA1 ch1): SPI1_CR2 <- TXDMAEN, start shifting out next row
+ *   CC2     (DMA1 ch7): SPI1_CR2 <- 0, right after the last byte of the
+ *                       row has been handed to SPI1 (before it asks for
+ *                       the first byte of the next row)
+ *   update  (DMA1 ch2): GPIOA_BSRR <- LE high, OE high, row address of
+ *                       the row just shifted out
+ *   SPI1 TX (DMA1 ch3): circular over all 8 rows of the shown image
+ *
+ * The only interrupt left is the transfer complete of ch2 at the end of
+ * each frame, which points ch3 at a newly committed shiftregister image.
+ * OC4 (ROW_nE1, brightness PWM) keeps running as in the ISR driven case.
+ */
+
+static int dma_scan; /* use DMA scan for monochrome mode */
+static unsigned int dma_scan_le_off, dma_scan_spi_on, dma_scan_spi_off;
+
+static uint32_t dma_scan_row_bsrr[8];
+static const uint32_t dma_scan_le_bsrr = COL_PIN_LE << 16;
+static const uint16_t dma_scan_cr2_on = SPI_CR2_TXDMAEN;
+static const uint16_t dma_scan_cr2_off = 0;
+
+/* calculate compare values, returns -1 if a row doesn't fit a period */
+static int hw_matrix_dma_scan_calc(void)
+{
+	/* SPI2 TX shares DMA1 ch5 with CC1, a second chain always needs
+	   the refresh ISR */
+	if (LEDPANEL_CHAINS > 1)
+		return -1;
+
+	dma_scan_le_off = tim2_period / 64 + 1;
+	dma_scan_spi_on = tim2_period / 16 + 1;
+
+	/* window between last byte written to SPI1_DR and TXE for the
+	   byte following it is one byte time, aim for the middle of it */
+	dma_scan_spi_off = dma_scan_spi_on +
+			   spi_ticks((LEDPANEL_SPI_BYTES - 2) * 8 + 4, spi_br_mono,
+				     tim2_prescaler);
+
+	/* rounded up to a timer tick, it must still be before that TXE */
+	if (dma_scan_spi_off >= dma_scan_spi_on +
+			spi_ticks((LEDPANEL_SPI_BYTES - 1) * 8, spi_br_mono,
+				  tim2_prescaler))
+		return -1;
+
+	if (dma_scan_spi_on + spi_ticks(LEDPANEL_SPI_BYTES * 8, spi_br_mono,
+					tim2_prescaler) >= tim2_period)
+		return -1;
+	return 0;
+}
+
+static void dma_scan_channel(unsigned int ch, volatile void *periph,
+			     const void *mem, unsigned int n, uint32_t ccr)
+{
+	DMA1_CCR(ch) = 0;
+	DMA1_CPAR(ch) = (uint32_t)periph;
+	DMA1_CMAR(ch) = (uint32_t)mem;
+	DMA1_CNDTR(ch) = n;
+	DMA1_CCR(ch) = ccr | DMA_CCR_DIR | DMA_CCR_CIRC | DMA_CCR_EN;
+}
+
+/* point SPI DMA to the beginning of the shown shiftregister image */
+static void dma_scan_rewind(void)
+{
+	dma_scan_channel(3, &SPI1_DR, (*ledpanel_buffer_shiftreg)[0],
+			 8 * LEDPANEL_SPI_BYTES,
+			 DMA_CCR_PL_VERY_HIGH | DMA_CCR_MINC);
+}
+
+/* end of frame, row 7 has just been latched, ch3 is idle until CC3 */
+void dma1_channel2_isr()
+{
+	DMA1_IFCR = DMA_IFCR_CGIF(2);
+
+	hw_matrix_rows += LEDPANEL_ROWS;
+	ledpanel_buffer_flip();
+	dma_scan_rewind();
+}
+
+static void hw_matrix_dma_scan_start(void)
+{
+	unsigned int row;
+
+	/* update event k latches row k, which was sent during period k */
+	for (row = 0; row < 8; row++)
+		dma_scan_row_bsrr[row] = COL_PIN_LE | COL_PIN_OE | row |
+					 ((~row & 0x0007) << 16);
+
+	timer_disable_counter(TIM2);
+	timer_set_counter(TIM2, 0);
+	timer_set_period(TIM2, slot_period[0]);
+	timer_set_oc_value(TIM2, TIM_OC4, slot_oc[0]);
+	timer_set_oc_value(TIM2, TIM_OC1, dma_scan_le_off);
+	timer_set_oc_value(TIM2, TIM_OC3, dma_scan_spi_on);
+	timer_set_oc_value(TIM2, TIM_OC2, dma_scan_spi_off);
+
+	SPI1_CR2 = 0;
+	/* a commit made while stopped is shown from the first frame on */
+	ledpanel_buffer_flip();
+	dma_scan_rewind();
+	dma_scan_channel(2, &GPIOA_BSRR, dma_scan_row_bsrr, 8,
+			 DMA_CCR_PL_HIGH | DMA_CCR_MINC | DMA_CCR_TCIE |
+			 DMA_CCR_MSIZE_32BIT | DMA_CCR_PSIZE_32BIT);
+	dma_scan_channel(5, &GPIOA_BSRR, &dma_scan_le_bsrr, 1,
+			 DMA_CCR_PL_HIGH |
+			 DMA_CCR_MSIZE_32BIT | DMA_CCR_PSIZE_32BIT);
+	dma_scan_channel(1, &SPI1_CR2, &dma_scan_cr2_on, 1,
+			 DMA_CCR_PL_HIGH |
+			 DMA_CCR_MSIZE_16BIT | DMA_CCR_PSIZE_16BIT);
+	dma_scan_channel(7, &SPI1_CR2, &dma_scan_cr2_off, 1,
+			 DMA_CCR_PL_HIGH |
+			 DMA_CCR_MSIZE_16BIT | DMA_CCR_PSIZE_16BIT);
+
+	nvic_set_priority(NVIC_DMA1_CHANNEL2_IRQ, 0);
+	nvic_enable_irq(NVIC_DMA1_CHANNEL2_IRQ);
+	timer_clear_flag(TIM2, TIM_SR_UIF | TIM_SR_CC1IF | TIM_SR_CC2IF |
+			 TIM_SR_CC3IF);
+	timer_enable_irq(TIM2, TIM_DIER_UDE | TIM_DIER_CC1DE | TIM_DIER_CC2DE |
+			 TIM_DIER_CC3DE);
+	timer_enable_counter(TIM2);
+}
+
+static void hw_matrix_dma_scan_stop(void)
+{
+	timer_disable_irq(TIM2, TIM_DIER_UDE | TIM_DIER_CC1DE | TIM_DIER_CC2DE |
+			  TIM_DIER_CC3DE);
+	nvic_disable_irq(NVIC_DMA1_CHANNEL2_IRQ);
+
+	DMA1_CCR(1) = 0;
+	DMA1_CCR(2) = 0;
+	DMA1_CCR(5) = 0;
+	DMA1_CCR(7) = 0;
+	DMA1_CCR(3) = 0;
+
+	/* the ISR driven scan keeps TX DMA enabled all the time */
+	SPI1_CR2 = SPI_CR2_TXDMAEN;
+	gpio_clear(COL_IO_BANK, COL_PIN_LE);
 }
 
 void hw_matrix_start()
 {
+	if (running)
+		return;
+
 	hw_matrix_mbi5029_mode(0);
 
 	/* GPIO GPIOA3 is Timer/Counter 2, Channel 4 */
 	timer_enable_oc_output(TIM2, TIM_OC4);
 	gpio_set_mode(GPIO_BANK_TIM2_CH4, GPIO_MODE_OUTPUT_10_MHZ,
 		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_TIM2_CH4);
-	timer_enable_irq(TIM2, TIM_DIER_UIE);
+#ifdef HW_MATRIX_DMA_SCAN
+	/* compare values depend on the current timing and SPI clock */
+	dma_scan = (scan_planes == 1 && hw_matrix_dma_scan_calc() == 0);
+#endif
+	if (dma_scan)
+		hw_matrix_dma_scan_start();
+	else
+		timer_enable_irq(TIM2, TIM_DIER_UIE);
+	running = 1;
 }
 
 void hw_matrix_stop()
 {
 	timer_disable_irq(TIM2, TIM_DIER_UIE);
+	if (dma_scan)
+		hw_matrix_dma_scan_stop();
+	running = 0;
+
+	/* not picked up by the ISR anymore */
+	if (timing_pending)
+		hw_matrix_apply_timing();
 
 	/* GPIO GPIOA3 is Timer/Counter 2, Channel 4 */
 	gpio_set_mode(GPIO_BANK_TIM2_CH4, GPIO_MODE_OUTPUT_10_MHZ,
@@ -126,123 +687,276 @@ void hw_matrix_stop()
 	timer_disable_oc_output(TIM2, TIM_OC4);
 
 	hw_matrix_mbi5029_mode(1);
+
+	/* configuration not (completely) written by the ISR */
+	if (cfg_state != CFG_IDLE)
+		mbi5029_cfg_write();
+}
+
+int hw_matrix_running()
+{
+	return running;
+}
+
+/* on-time for brightness in 1/65536, interpolated from gamma_curve[] */
+static unsigned int hw_matrix_gamma_map(unsigned char brightness)
+{
+	unsigned int i = brightness / 8, f = brightness % 8;
+	unsigned int a = gamma_curve[i], b = gamma_curve[i + 1];
+
+	return (a * (8 - f) + b * f) / 8;
+}
+
+void hw_matrix_gamma(const uint16_t *curve)
+{
+	unsigned int i;
+
+	for (i = 0; i < HW_MATRIX_GAMMA_POINTS; i++)
+		gamma_curve[i] = curve ? curve[i] :
+			(i * 8 * 256 > 0xffff ? 0xffff : i * 8 * 256);
+	hw_matrix_pwm(pwm_brightness);
+}
+
+/* weight of plane p in units of slot_unit, the sub-frames of temporal
+   dithering all have the same */
+static unsigned int plane_weight(unsigned int p, unsigned int nplanes,
+				 int frc)
+{
+	return frc ? 1 : 1 << (nplanes - 1 - p);
+}
+
+/* compare values for OC4 (end of off-time) from slot periods and unit */
+static void hw_matrix_calc_oc(uint16_t *oc, const uint16_t *period,
+			      unsigned int unit, unsigned char brightness)
+{
+	unsigned int p, on, frac = hw_matrix_gamma_map(brightness);
+
+	/* on-time at most 65535/65536 of the plane's weight */
+	for (p = 0; p < scan_planes; p++) {
+		on = unit * plane_weight(p, scan_planes, scan_frc) * frac >> 16;
+		oc[p] = period[p] - on;
+	}
 }
 
 void hw_matrix_pwm(unsigned char brightness)
 {
-	/* max 1/257 of tim2_period */
-	/* min 256/256 of tim2_period */
+	pwm_brightness = brightness;
 
-	unsigned int upper_edge = (256 - (unsigned int)brightness) * tim2_period / 257;
-	timer_set_oc_value(TIM2, TIM_OC4, upper_edge);
+	hw_matrix_calc_oc(slot_oc, slot_period, slot_unit, brightness);
+	if (timing_pending)
+		hw_matrix_calc_oc(timing_next.oc, timing_next.period,
+				  timing_next.unit, brightness);
+
+	/* the DMA driven scan never touches OC4 */
+	if (scan_planes == 1)
+		timer_set_oc_value(TIM2, TIM_OC4, slot_oc[0]);
 }
 
 /*
- *  MBI5029 datasheet: switching to special mode
- *
- *         1__   2__   3__   4__   5__
- *  CLK ___/  \__/  \__/  \__/  \__/  \___
- *      :     :     :     :     :     :
- *      ______:     :_____________________
- *  nOE :     \_____/     :     :     :
- *      :     :     :     :_____:     :
- *  LE  __________________/_____\_________
- *      :     :     :     :  ^  :     :
- *      :     :     :     :  |  :     :
- *      :     :     :     :     :     :
- *       [0]   [1]   [2]   [3]   [4]
- *
- *  During the 4th clock cycle (index [3]), if LE
- *  is high, we are in the special mode, if LE is
- *  low, we are in the normal mode.
- *
- *  Data is latched into the chip on the rising edge.
- *
- *  Note that there is an inverter between our
- *  output pins, and the input to the chip (on the
- *  LED matrix board itself), so we have to set
- *  "nOE_inv" high.
+ * Calculate slot periods and unit for nplanes bitplanes (sub-frames if
+ * frc), so that all planes of one row fit in tim2_period (which keeps
+ * the refresh rate at led_refresh) with TIM2 running at prescaler.
+ * Returns -1 (and leaves the tables alone) if this is not possible, i.e.
+ * if the SPI transfer of a row would not finish within a slot.
  */
+static int hw_matrix_calc_slots(uint16_t *period, unsigned int *unit_ret,
+				unsigned int nplanes, int frc, unsigned int br,
+				unsigned int prescaler)
+{
+	unsigned int min_slot, unit, sum, p, w;
 
-void hw_matrix_mbi5029_mode(int special)
+	/* some headroom for ISR latency, the chains are shifted in parallel */
+	min_slot = spi_ticks(LEDPANEL_CHAIN_BYTES * 8, br, prescaler) * 9 / 8 +
+		   8;
+
+	sum = 0;
+	for (p = 0; p < nplanes; p++)
+		sum += plane_weight(p, nplanes, frc);
+	for (unit = tim2_period / sum; unit; unit--) {
+		sum = 0;
+		for (p = 0; p < nplanes; p++) {
+			w = unit * plane_weight(p, nplanes, frc);
+			sum += (w > min_slot) ? w : min_slot;
+		}
+		if (sum <= tim2_period)
+			break;
+	}
+
+	if (!unit)
+		return -1;
+
+	for (p = 0; p < nplanes; p++) {
+		w = unit * plane_weight(p, nplanes, frc);
+		period[p] = (w > min_slot) ? w : min_slot;
+	}
+	*unit_ret = unit;
+	return 0;
+}
+
+/* same, but with the slowest SPI clock from *br up that a row fits in
+   (long chains), *br is updated */
+static int hw_matrix_calc_slots_br(uint16_t *period, unsigned int *unit_ret,
+				   unsigned int nplanes, int frc,
+				   unsigned int *br, unsigned int prescaler)
 {
-	unsigned int i, u;
-	unsigned int nOE_inv_steps[] = { 0, 1, 0, 0, 0 };
-	unsigned int LE_steps[] = { 0, 0, 0, 1, 0 };
+	unsigned int b;
 
-	LE_steps[3] = !!special;
+	for (b = *br; b >= SPI_BR_MIN; b--) {
+		if (hw_matrix_calc_slots(period, unit_ret, nplanes, frc, b,
+					 prescaler) == 0) {
+			*br = b;
+			return 0;
+		}
+	}
+	return -1;
+}
 
-	/* SCK in bit-banging mode */
-	gpio_clear(GPIO_BANK_SPI1_SCK, GPIO_SPI1_SCK);
-	gpio_set_mode(GPIO_BANK_SPI1_SCK, GPIO_MODE_OUTPUT_10_MHZ,
-		      GPIO_CNF_OUTPUT_PUSHPULL, GPIO_SPI1_SCK);
+/* TIM2 prescaler for refresh rate, 0 if out of range */
+static unsigned int hw_matrix_prescaler(unsigned int refresh)
+{
+	unsigned int div;
 
-	gpio_clear(COL_IO_BANK, COL_PIN_OE);
-	gpio_clear(COL_IO_BANK, COL_PIN_LE);
+	if (!refresh)
+		return 0;
+	div = (rcc_apb1_frequency * 2) / (tim2_period * refresh * led_cycles);
+	if (div < 2 || div > 0x10000)
+		return 0;
+	return div - 1;
+}
 
-	for (i=0; i<5; i++) {
-		if (nOE_inv_steps[i])
-			gpio_set(COL_IO_BANK, COL_PIN_OE);
-		else
-			gpio_clear(COL_IO_BANK, COL_PIN_OE);
+int hw_matrix_timing(unsigned int refresh, int br)
+{
+	unsigned int nplanes = scan_planes;
+	unsigned int prescaler = hw_matrix_prescaler(refresh);
+	uint16_t period[LEDPANEL_GRAY_BITS];
+	unsigned int unit;
+	int was_running = running;
 
-		if (LE_steps[i])
-			gpio_set(COL_IO_BANK, COL_PIN_LE);
-		else
-			gpio_clear(COL_IO_BANK, COL_PIN_LE);
+	if (br < 0)
+		br = (nplanes > 1) ? spi_br_gray : spi_br_mono;
+	if (!prescaler || br < SPI_BR_MIN || br > SPI_CR1_BR_FPCLK_DIV_256)
+		return -1;
 
-		gpio_clear(GPIO_BANK_SPI1_SCK, GPIO_SPI1_SCK);
-		for (u=0; u<256; u++)
-			asm volatile ("nop");
-		gpio_set(GPIO_BANK_SPI1_SCK, GPIO_SPI1_SCK);
-		for (u=0; u<256; u++)
-			asm volatile ("nop");
+	/* checks that a row can be shifted out within one slot */
+	if (hw_matrix_calc_slots(period, &unit, nplanes, scan_frc, br,
+				 prescaler) < 0)
+		return -1;
+
+	/* only changed from here, so the ISR doesn't see it half-way */
+	timing_pending = 0;
+	memcpy(timing_next.period, period, nplanes * sizeof(period[0]));
+	timing_next.unit = unit;
+	timing_next.prescaler = prescaler;
+	timing_next.br = br;
+	hw_matrix_calc_oc(timing_next.oc, timing_next.period,
+			  timing_next.unit, pwm_brightness);
+
+	led_refresh = refresh;
+	if (nplanes > 1)
+		spi_br_gray = br;
+	else
+		spi_br_mono = br;
+
+	timing_pending = 1;
+
+#ifdef HW_MATRIX_DMA_SCAN
+	/* the DMA scan has compare values depending on the timing, and
+	   might not be possible at all anymore, so it's restarted */
+	if (was_running && nplanes == 1) {
+		hw_matrix_stop(); /* applies timing_next */
+		hw_matrix_start();
+		return 0;
 	}
+#endif
 
-	/* SPI mode again */
-	gpio_set_mode(GPIO_BANK_SPI1_SCK, GPIO_MODE_OUTPUT_10_MHZ,
-		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_SCK);
+	if (!was_running)
+		hw_matrix_apply_timing();
+	return 0;
 }
 
-void hw_matrix_brightness(unsigned int brightness)
+int hw_matrix_grayscale(int mode)
 {
-	unsigned int bitno, chipno, u;
+	unsigned int nplanes = (mode == HW_MATRIX_GRAY) ? LEDPANEL_GRAY_BITS :
+			       (mode == HW_MATRIX_FRC) ? LEDPANEL_FRC_SUBFRAMES : 1;
+	unsigned int br = (nplanes > 1) ? spi_br_gray : spi_br_mono;
+	int frc = (mode == HW_MATRIX_FRC), was_running = running;
 
-	/* SCK in bit-banging mode */
-	gpio_set_mode(GPIO_BANK_SPI1_SCK, GPIO_MODE_OUTPUT_10_MHZ,
-		      GPIO_CNF_OUTPUT_PUSHPULL, GPIO_SPI1_SCK);
-	gpio_set_mode(GPIO_BANK_SPI1_MOSI, GPIO_MODE_OUTPUT_10_MHZ,
-		      GPIO_CNF_OUTPUT_PUSHPULL, GPIO_SPI1_MOSI);
+	if (mode != HW_MATRIX_MONO && mode != HW_MATRIX_GRAY &&
+	    mode != HW_MATRIX_FRC)
+		return -1;
 
-	gpio_clear(GPIO_BANK_SPI1_SCK, GPIO_SPI1_SCK);
-	gpio_clear(GPIO_BANK_SPI1_MOSI, GPIO_SPI1_MOSI);
+	if (was_running)
+		hw_matrix_stop();
 
-	for (chipno = 0; chipno < LEDPANEL_SPI_BYTES / 2; chipno++) {
-		for (bitno = 0; bitno < 16; bitno++) {
-			if (chipno == LEDPANEL_SPI_BYTES / 2 - 1 &&
-			    bitno == 15) {
-				gpio_set(COL_IO_BANK, COL_PIN_LE);
-			}
-			if (brightness & (1<<bitno)) {
-				gpio_set(GPIO_BANK_SPI1_MOSI, GPIO_SPI1_MOSI);
-			} else {
-				gpio_clear(GPIO_BANK_SPI1_MOSI, GPIO_SPI1_MOSI);
-			}
-			for (u=0; u<32; u++)
-				asm volatile ("nop");
-			gpio_set(GPIO_BANK_SPI1_SCK, GPIO_SPI1_SCK);
-			for (u=0; u<32; u++)
-				asm volatile ("nop");
-			gpio_clear(GPIO_BANK_SPI1_SCK, GPIO_SPI1_SCK);
-		}
+	if (hw_matrix_calc_slots_br(slot_period, &slot_unit, nplanes, frc, &br,
+				    tim2_prescaler) < 0) {
+		if (was_running)
+			hw_matrix_start();
+		return -1;
 	}
-	gpio_clear(COL_IO_BANK, COL_PIN_LE);
 
-	/* SPI mode again */
-	gpio_set_mode(GPIO_BANK_SPI1_SCK, GPIO_MODE_OUTPUT_10_MHZ,
-		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_SCK);
-	gpio_set_mode(GPIO_BANK_SPI1_MOSI, GPIO_MODE_OUTPUT_10_MHZ,
-		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI1_MOSI);
+	if (nplanes > 1)
+		spi_br_gray = br;
+	else
+		spi_br_mono = br;
+	spi_set_br(br);
+	scan_planes = nplanes;
+	scan_frc = frc;
+	if (frc)
+		ledpanel_buffer_set_frc();
+	else
+		ledpanel_buffer_set_planes(nplanes);
+	hw_matrix_pwm(pwm_brightness);
+
+	/* data in the shiftregisters is for the old mode */
+	curr_row = 8;
+
+	if (was_running)
+		hw_matrix_start();
+	return 0;
+}
+
+int hw_matrix_gain(const uint16_t *gain)
+{
+	unsigned int i;
+
+	if (cfg_state != CFG_IDLE)
+		return -1;
+
+	for (i = 0; i < HW_MATRIX_DRIVERS; i++) {
+		mbi5029_cfg[2 * i] = gain[i] & 0xff;
+		mbi5029_cfg[2 * i + 1] = gain[i] >> 8;
+	}
+
+#ifdef HW_MATRIX_DMA_SCAN
+	/* no ISR in between rows, stopping leaves the drivers in special
+	   mode, and the write below is quick */
+	if (running && dma_scan) {
+		hw_matrix_stop();
+		hw_matrix_gain(gain);
+		hw_matrix_start();
+		return 0;
+	}
+#endif
+
+	if (running) {
+		cfg_state = CFG_PENDING;
+		return 0;
+	}
+
+	/* not scanning, the drivers are in special mode */
+	mbi5029_cfg_write();
+	return 0;
+}
+
+int hw_matrix_brightness(unsigned int brightness)
+{
+	uint16_t gain[HW_MATRIX_DRIVERS];
+	unsigned int i;
+
+	for (i = 0; i < HW_MATRIX_DRIVERS; i++)
+		gain[i] = brightness;
+	return hw_matrix_gain(gain);
 }
 
 void hw_matrix_init()
@@ -282,7 +996,7 @@ void hw_matrix_init()
 	/* === SPI1 init === */
 	/* software slave management, internal slave select, spi enable, master mode, baudrate */
 	SPI1_CR1 = SPI_CR1_SSM | SPI_CR1_SSI | SPI_CR1_SPE | SPI_CR1_MSTR |
-		   (SPI_CR1_BR_FPCLK_DIV_64 << 3) | SPI_CR1_CPHA | SPI_CR1_LSBFIRST;
+		   (SPI_BR_MONO << 3) | SPI_CR1_CPHA | SPI_CR1_LSBFIRST;
 	SPI1_CR2 = SPI_CR2_TXDMAEN; /* enable DMA */
 
 	/* CLK and MOSI are outputs in alternate mode, MISO is input with weak pullup */
@@ -296,10 +1010,30 @@ void hw_matrix_init()
 
 	DMA1_CCR(3) = 0;
 	DMA1_CNDTR(3) = 0;
+	DMA1_CPAR(3) = (uint32_t)&SPI1_DR; /* peripheral */
+
+#if LEDPANEL_CHAINS > 1
+	/* === SPI2 init, second chain === */
+	rcc_periph_clock_enable(RCC_SPI2);
+	SPI2_CR1 = SPI_CR1_SSM | SPI_CR1_SSI | SPI_CR1_SPE | SPI_CR1_MSTR |
+		   ((SPI_BR_MONO - 1) << 3) | SPI_CR1_CPHA | SPI_CR1_LSBFIRST;
+	SPI2_CR2 = SPI_CR2_TXDMAEN;
+
+	/* MISO (PB14) stays a debug LED, nothing is ever received */
+	gpio_set_mode(GPIO_BANK_SPI2_SCK, GPIO_MODE_OUTPUT_10_MHZ,
+		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI2_SCK);
+	gpio_set_mode(GPIO_BANK_SPI2_MOSI, GPIO_MODE_OUTPUT_10_MHZ,
+		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_SPI2_MOSI);
+
+	DMA1_CCR(SPI2_DMA_CH) = 0;
+	DMA1_CNDTR(SPI2_DMA_CH) = 0;
+	DMA1_CPAR(SPI2_DMA_CH) = (uint32_t)&SPI2_DR;
+#endif
 
 	/* === Timer2 init === */
 	rcc_periph_clock_enable(RCC_TIM2);
 	rcc_periph_reset_pulse(RST_TIM2);
+	nvic_set_priority(NVIC_TIM2_IRQ, 0); /* above everything else */
 	nvic_enable_irq(NVIC_TIM2_IRQ);
 
 	timer_set_mode(TIM2, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE,
@@ -311,18 +1045,27 @@ void hw_matrix_init()
 	   XL-density reset and clock control (RCC),
 	   page 93/1134 */
 
-	tim2_prescaler = (rcc_apb1_frequency * 2) /
-			 (tim2_period * led_refresh * led_cycles);
+	tim2_prescaler = hw_matrix_prescaler(led_refresh);
 	timer_set_prescaler(TIM2,
-			    tim2_prescaler); /* 36MHz * 2 / 36'000 = 2kHz  */
-	timer_set_period(TIM2, tim2_period); /* 2kHz / 200 = 10 Hz overflow */
+			    tim2_prescaler); /* 36MHz * 2 / 36 = 2MHz  */
+	timer_set_period(TIM2, tim2_period); /* 2MHz / 1000 = 2kHz overflow */
+	/* update event generated by software (hw_matrix_apply_timing())
+	   does not interrupt or trigger DMA */
+	timer_update_on_overflow(TIM2);
+	hw_matrix_calc_slots_br(slot_period, &slot_unit, 1, 0, &spi_br_mono,
+				tim2_prescaler);
+	spi_set_br(spi_br_mono);
 
 	/* TImer2, CH2 on PA4 */
 	timer_set_oc_mode(TIM2, TIM_OC4, TIM_OCM_PWM1);
 	timer_set_oc_polarity_high(TIM2, TIM_OC4);
 
+	hw_matrix_gamma(NULL); /* linear, also sets PWM */
 	hw_matrix_pwm(64); /* about 25% brightness */
 
 	timer_enable_counter(TIM2);
-	hw_matrix_start();
+
+	/* not scanning until hw_matrix_start(), so the first frame can be
+	   committed before, drivers in special mode for the gain */
+	hw_matrix_stop();
 }
@@ -0,0 +1,240 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ledpanel_blit.h"
+
+#include <string.h>
+
+#define ROW_WORDS ((LEDPANEL_U8_PITCH + 3) / 4)
+
+/* the framebuffer has the leftmost pixel in the MSB of the first byte */
+static inline uint32_t be32(uint32_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __builtin_bswap32(v); /* REV on Cortex-M3 */
+#else
+	return v;
+#endif
+}
+
+static void row_load(uint32_t *w, const uint8_t *row)
+{
+	unsigned int i;
+#ifdef LEDPANEL_WORD_ALIGNED
+	const uint32_t *src = (const uint32_t *)row;
+
+	for (i = 0; i < ROW_WORDS; i++)
+		w[i] = be32(src[i]);
+#else
+	uint8_t tmp[ROW_WORDS * 4];
+
+	memcpy(tmp, row, LEDPANEL_U8_PITCH);
+	memset(tmp + LEDPANEL_U8_PITCH, 0, sizeof(tmp) - LEDPANEL_U8_PITCH);
+	for (i = 0; i < ROW_WORDS; i++) {
+		memcpy(&w[i], &tmp[4 * i], 4);
+		w[i] = be32(w[i]);
+	}
+#endif
+}
+
+static void row_store(uint8_t *row, const uint32_t *w)
+{
+	unsigned int i;
+#ifdef LEDPANEL_WORD_ALIGNED
+	uint32_t *dst = (uint32_t *)row;
+
+	for (i = 0; i < ROW_WORDS; i++)
+		dst[i] = be32(w[i]);
+#else
+	uint8_t tmp[ROW_WORDS * 4];
+	uint32_t v;
+
+	for (i = 0; i < ROW_WORDS; i++) {
+		v = be32(w[i]);
+		memcpy(&tmp[4 * i], &v, 4);
+	}
+	memcpy(row, tmp, LEDPANEL_U8_PITCH);
+#endif
+}
+
+/* pixels x0 .. x1 - 1 of a row, in its word i */
+static uint32_t span_mask(unsigned int i, unsigned int x0, unsigned int x1)
+{
+	unsigned int lo = 0, hi = 32;
+
+	if (x1 <= 32 * i || x0 >= 32 * i + 32)
+		return 0;
+	if (x0 > 32 * i)
+		lo = x0 - 32 * i;
+	if (x1 < 32 * i + 32)
+		hi = x1 - 32 * i;
+	return (~0u >> lo) & (hi == 32 ? ~0u : ~(~0u >> hi));
+}
+
+/* move the pixels of a row by n (positive: to the right) */
+static void row_shift(uint32_t *w, int n)
+{
+	unsigned int k = (n < 0 ? -n : n) / 32, b = (n < 0 ? -n : n) % 32;
+	int i, j;
+	uint32_t v;
+
+	if (n > 0) {
+		for (i = ROW_WORDS - 1; i >= 0; i--) {
+			j = i - (int)k;
+			v = (j >= 0) ? w[j] >> b : 0;
+			if (b && j > 0)
+				v |= w[j - 1] << (32 - b);
+			w[i] = v;
+		}
+	} else if (n < 0) {
+		for (i = 0; i < ROW_WORDS; i++) {
+			j = i + (int)k;
+			v = (j < ROW_WORDS) ? w[j] << b : 0;
+			if (b && j + 1 < ROW_WORDS)
+				v |= w[j + 1] >> (32 - b);
+			w[i] = v;
+		}
+	}
+}
+
+/* limit a span x .. x + w - 1 to 0 .. max - 1, returns 0 if empty */
+static int clip(int *x, int *w, int max)
+{
+	if (*x < 0) {
+		*w += *x;
+		*x = 0;
+	}
+	if (*w > max - *x)
+		*w = max - *x;
+	return *w > 0;
+}
+
+#ifdef LEDPANEL_WORD_ALIGNED
+/* one or two words, bits is within mask, x >= 0 */
+static void merge_row(uint8_t *row, unsigned int x, uint32_t bits,
+		      uint32_t mask)
+{
+	uint32_t *w = (uint32_t *)row + x / 32;
+	unsigned int sh = x % 32;
+
+	w[0] = be32((be32(w[0]) & ~(mask >> sh)) | bits >> sh);
+	if (sh && x / 32 + 1 < ROW_WORDS)
+		w[1] = be32((be32(w[1]) & ~(mask << (32 - sh))) |
+			    bits << (32 - sh));
+}
+#else
+/* up to 5 bytes, from the one holding pixel x */
+static void merge_row(uint8_t *row, unsigned int x, uint32_t bits,
+		      uint32_t mask)
+{
+	uint8_t *dst = &row[x / 8];
+	unsigned int i, n = LEDPANEL_PIX_BYTES - x / 8, sh = x % 8;
+	uint8_t m, v;
+
+	for (i = 0; i < 5 && i < n; i++) {
+		if (i < 4) {
+			m = (mask >> sh) >> (24 - 8 * i);
+			v = (bits >> sh) >> (24 - 8 * i);
+		} else {
+			m = mask << (8 - sh);
+			v = bits << (8 - sh);
+		}
+		if (m)
+			dst[i] = (dst[i] & ~m) | v;
+	}
+}
+#endif
+
+void ledpanel_blit_merge(uint8_t *fb, int x, int y, uint32_t bits,
+			 uint32_t mask)
+{
+	if (y < 0 || y >= LEDPANEL_PIX_HEIGHT || x >= LEDPANEL_PIX_WIDTH)
+		return;
+	if (x < 0) {
+		if (x <= -32)
+			return;
+		bits <<= -x;
+		mask <<= -x;
+		x = 0;
+	}
+	merge_row(&fb[LEDPANEL_U8_PITCH * y], x, bits & mask, mask);
+}
+
+void ledpanel_blit_fill(uint8_t *fb, int x, int y, int w, int h,
+			unsigned int op)
+{
+	uint32_t row[ROW_WORDS], m;
+	unsigned int i;
+	int r;
+
+	if (!clip(&x, &w, LEDPANEL_PIX_WIDTH) ||
+	    !clip(&y, &h, LEDPANEL_PIX_HEIGHT))
+		return;
+
+	for (r = y; r < y + h; r++) {
+		row_load(row, &fb[LEDPANEL_U8_PITCH * r]);
+		for (i = x / 32; i <= (unsigned int)(x + w - 1) / 32; i++) {
+			m = span_mask(i, x, x + w);
+			if (op == LEDPANEL_BLIT_SET)
+				row[i] |= m;
+			else if (op == LEDPANEL_BLIT_INVERT)
+				row[i] ^= m;
+			else
+				row[i] &= ~m;
+		}
+		row_store(&fb[LEDPANEL_U8_PITCH * r], row);
+	}
+}
+
+void ledpanel_blit_scroll(uint8_t *fb, int x, int y, int w, int h, int dx,
+			  int dy)
+{
+	uint32_t src[ROW_WORDS], dst[ROW_WORDS], m[ROW_WORDS];
+	unsigned int i;
+	int r, n, sy;
+
+	if (!clip(&x, &w, LEDPANEL_PIX_WIDTH) ||
+	    !clip(&y, &h, LEDPANEL_PIX_HEIGHT))
+		return;
+
+	for (i = 0; i < ROW_WORDS; i++)
+		m[i] = span_mask(i, x, x + w);
+
+	/* rows moving down are done from the bottom, so each source row
+	   is read before it's overwritten */
+	for (n = 0; n < h; n++) {
+		r = (dy > 0) ? y + h - 1 - n : y + n;
+		sy = r - dy;
+
+		if (sy >= y && sy < y + h) {
+			row_load(src, &fb[LEDPANEL_U8_PITCH * sy]);
+			for (i = 0; i < ROW_WORDS; i++)
+				src[i] &= m[i];
+			row_shift(src, dx);
+		} else {
+			memset(src, 0, sizeof(src));
+		}
+
+		row_load(dst, &fb[LEDPANEL_U8_PITCH * r]);
+		for (i = 0; i < ROW_WORDS; i++)
+			dst[i] = (dst[i] & ~m[i]) | (src[i] & m[i]);
+		row_store(&fb[LEDPANEL_U8_PITCH * r], dst);
+	}
+}
@@ -19,19 +19,170 @@
  */
 
 #include "ledpanel_buffer.h"
+#include "profile.h"
 
 #include <string.h>
 
-uint8_t ledpanel_buffer[LEDPANEL_U8_PITCH * LEDPANEL_PIX_HEIGHT];
-uint8_t ledpanel_buffer_shiftreg[LEDPANEL_SPI_BYTES];
+uint8_t ledpanel_buffer[LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES]
+	__attribute__((aligned(4)));
 
-static void memcpy_reverse(uint8_t *restrict dst, uint8_t *restrict src,
-				   size_t len)
+static ledpanel_shiftreg_t ledpanel_shiftreg_mem[2];
+ledpanel_shiftreg_t *volatile ledpanel_buffer_shiftreg = &ledpanel_shiftreg_mem[0];
+static ledpanel_shiftreg_t *ledpanel_shiftreg_back = &ledpanel_shiftreg_mem[1];
+
+volatile unsigned int ledpanel_buffer_planes = 1;
+volatile unsigned int ledpanel_buffer_subframes = 1;
+
+/* set by main loop after converting a frame, cleared by the ISR */
+static volatile uint8_t ledpanel_commit_pending;
+/* frame number at which the pending commit is to be shown */
+static volatile uint32_t ledpanel_commit_due;
+
+volatile uint32_t ledpanel_buffer_frame;
+volatile uint32_t ledpanel_buffer_shown;
+volatile uint32_t ledpanel_buffer_shown_frame;
+
+/*
+ * Pixel x, y of level n (0..3) is lit in sub-frame s if
+ * (x + 2 * y + s) % 3 < n. For 8 pixels at once, with hi/lo the bits of
+ * n: level 3 is always on, level 1 where that phase is 0, level 2 where
+ * it is not 2. frc_phase[k] has the pixels of a byte with (x % 3) == k.
+ */
+static const uint8_t frc_phase[3] = { 0x92, 0x49, 0x24 };
+
+static void ledpanel_buffer_render_frc(ledpanel_shiftreg_t *sr,
+				       const uint8_t *fb)
 {
-	uint8_t *p = dst + (len - 1);
+	static uint8_t sub[LEDPANEL_BUFFER_BYTES];
+	const uint8_t *hi = LEDPANEL_PLANE(fb, 0);
+	const uint8_t *lo = LEDPANEL_PLANE(fb, 1);
+	unsigned int s, x, y, o, i, row;
+	uint8_t one, two;
+
+	for (s = 0; s < LEDPANEL_FRC_SUBFRAMES; s++) {
+		for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++) {
+			for (x = 0; x < LEDPANEL_U8_PITCH; x++) {
+				/* phase of the first pixel of the byte */
+				o = (8 * x + 2 * y + s) % 3;
+				one = frc_phase[(3 - o) % 3];
+				two = frc_phase[(5 - o) % 3];
+				i = LEDPANEL_U8_PITCH * y + x;
+				sub[i] = (hi[i] & lo[i]) |
+					 (lo[i] & ~hi[i] & one) |
+					 (hi[i] & ~lo[i] & ~two);
+			}
+		}
+		for (row = 0; row < LEDPANEL_ROWS; row++)
+			ledpanel_buffer_prepare_shiftreg((*sr)[s][row], sub,
+							 row);
+	}
+}
+
+static void ledpanel_buffer_render(ledpanel_shiftreg_t *sr, const uint8_t *fb,
+				   unsigned int nplanes)
+{
+	unsigned int plane, row;
+
+	if (ledpanel_buffer_subframes > 1 && nplanes == LEDPANEL_FRC_BITS) {
+		ledpanel_buffer_render_frc(sr, fb);
+		return;
+	}
 
-	while (len--)
-		*p-- = *src++;
+	for (plane = 0; plane < nplanes; plane++)
+		for (row = 0; row < LEDPANEL_ROWS; row++)
+			ledpanel_buffer_prepare_shiftreg(
+				(*sr)[plane][row], LEDPANEL_PLANE(fb, plane),
+				row);
+}
+
+void ledpanel_buffer_commit()
+{
+	ledpanel_buffer_render(ledpanel_shiftreg_back, ledpanel_buffer,
+			       ledpanel_buffer_planes);
+	ledpanel_commit_due = ledpanel_buffer_frame;
+	ledpanel_commit_pending = 1;
+}
+
+void ledpanel_buffer_commit_plane(const uint8_t *fb)
+{
+	ledpanel_buffer_render(ledpanel_shiftreg_back, fb, 1);
+	ledpanel_commit_due = ledpanel_buffer_frame;
+	ledpanel_commit_pending = 1;
+}
+
+void ledpanel_buffer_commit_at(const uint8_t *fb, uint32_t frame)
+{
+	ledpanel_buffer_render(ledpanel_shiftreg_back, fb,
+			       ledpanel_buffer_planes);
+	ledpanel_commit_due = frame;
+	ledpanel_commit_pending = 1;
+}
+
+int ledpanel_buffer_sync()
+{
+	return !ledpanel_commit_pending;
+}
+
+void ledpanel_buffer_flip()
+{
+	ledpanel_shiftreg_t *p;
+
+	ledpanel_buffer_frame++;
+
+	if (!ledpanel_commit_pending ||
+	    (int32_t)(ledpanel_buffer_frame - ledpanel_commit_due) < 0)
+		return;
+
+	p = ledpanel_buffer_shiftreg;
+	ledpanel_buffer_shiftreg = ledpanel_shiftreg_back;
+	ledpanel_shiftreg_back = p;
+
+	ledpanel_commit_pending = 0;
+	ledpanel_buffer_shown++;
+	ledpanel_buffer_shown_frame = ledpanel_buffer_frame;
+}
+
+static void ledpanel_buffer_set_mode(unsigned int n, unsigned int subframes)
+{
+	/* do not show leftovers of an earlier grayscale frame */
+	memset(LEDPANEL_PLANE(ledpanel_buffer, 1), '\0',
+	       (LEDPANEL_GRAY_BITS - 1) * LEDPANEL_BUFFER_BYTES);
+
+	ledpanel_buffer_planes = n;
+	ledpanel_buffer_subframes = subframes;
+
+	/* we are not scanning, so it's safe to update both sets */
+	ledpanel_commit_pending = 0;
+	ledpanel_buffer_render(ledpanel_buffer_shiftreg, ledpanel_buffer, n);
+	ledpanel_buffer_render(ledpanel_shiftreg_back, ledpanel_buffer, n);
+}
+
+void ledpanel_buffer_set_planes(unsigned int n)
+{
+	ledpanel_buffer_set_mode(n, 1);
+}
+
+void ledpanel_buffer_set_frc()
+{
+	ledpanel_buffer_set_mode(LEDPANEL_FRC_BITS, LEDPANEL_FRC_SUBFRAMES);
+}
+
+/*
+ * One stripe of one module: unconnected outputs first, then the pixels
+ * in reverse byte order. The loops have constant trip counts and are
+ * meant to be unrolled completely.
+ */
+static inline void module_stripe(uint8_t *restrict dst,
+				 const uint8_t *restrict src)
+{
+	unsigned int i;
+
+#pragma GCC unroll 8
+	for (i = 0; i < LEDPANEL_MODULE_DUMMY; i++)
+		*dst++ = '\0';
+#pragma GCC unroll 8
+	for (i = 0; i < LEDPANEL_MODULE_BYTES; i++)
+		dst[i] = src[LEDPANEL_MODULE_BYTES - 1 - i];
 }
 
 /*
@@ -41,68 +192,52 @@ static void memcpy_reverse(uint8_t *restrict dst, uint8_t *restrict src,
  *  "shiftregister pixel order" ledpanel_buffer_shiftreg[] which gets
  * sent out by the SPI peripheral.
  *
- * I haven't bothered to add constants for the various magic
- * numbers, as they all only should be used here.
+ * All of the geometry is described by the LEDPANEL_MODULE_* and
+ * LEDPANEL_STRIPES/ROWS constants in ledpanel_buffer.h.
  *
  * Rowaddr is the row-address selection A0..A2 for the panel hardware
  * and the function will fill the shiftregister matching this address
- * configuration.
+ * configuration, taking pixels from the single bitplane 'fb'.
  */
 
-void ledpanel_buffer_prepare_shiftreg(unsigned int rowaddr)
+void ledpanel_buffer_prepare_shiftreg(uint8_t *dst, const uint8_t *fb,
+				      unsigned int rowaddr)
 {
-	uint8_t *dst = ledpanel_buffer_shiftreg;
-	unsigned int s;
-#if LEDPANEL_TYPE_TRIPLE
-	unsigned int p;
-#endif
+	static const uint8_t zero[LEDPANEL_MODULE_BYTES];
+	const uint8_t *src;
+	unsigned int c, s, p, y;
+
+	PROFILE_START(PREPARE_SHIFTREG);
 
 	/*
-	 * write output for the three "strips" consisting of
-	 * pixel data for row, row+8 and row+16. As we only
-	 * have 20 rows in total, we fill dummy data for the
-	 * third strip, if rowaddr > 3.
+	 * write output for all stripes consisting of pixel data for
+	 * row, row+8, row+16... Rows beyond the height of the module
+	 * (the third stripe only has 4 rows) get dummy data.
 	 *
 	 * As usual, we first write out bits for the "later"
-	 * strip, so we count s=2, s=1, s=0.
+	 * stripe, and the rightmost module of each chain.
 	 */
 
-	for (s = 2; s != (unsigned int)~0; s--) {
-		uint8_t *src;
-
-		if (s == 2 && rowaddr > 3) /* last stripe only has 4 rows */
-			src = NULL;
-		else
-			/* 3 stripes, with 8 pixel rows offset */
-			src = (uint8_t *)&ledpanel_buffer[LEDPANEL_U8_PITCH *
-							  (rowaddr + s * 8)];
-
-#if LEDPANEL_TYPE_TRIPLE
-		/*
-		 * Full panel has three modules (p=2, p=1, p=0).
-		 * First copy data for the rightmost, then middle, then left.
-		 * Copy in 8 dummy pixels first (8 last outputs or 3rd
-		 * column driver). Horzontal offset in framebuffer is
-		 * 5 bytes (40 pixel) for each module.
-		 */
-		for (p=2; p != (unsigned int)~0; p--) {
-			*dst++ = '\0';
-			if (src)
-				memcpy_reverse(dst, src + p*5, 5);
-			dst += 5;
+	for (c = 0; c < LEDPANEL_CHAINS; c++) {
+		for (s = LEDPANEL_STRIPES; s-- > 0;) {
+			y = rowaddr + s * LEDPANEL_ROWS;
+
+#pragma GCC unroll 8
+			for (p = LEDPANEL_CHAIN_MODULES; p-- > 0;) {
+				if (y < LEDPANEL_MODULE_HEIGHT)
+					src = &fb[LEDPANEL_U8_PITCH * y +
+						  LEDPANEL_MODULE_BYTES *
+							  (c * LEDPANEL_CHAIN_MODULES + p)];
+				else
+					src = zero;
+				module_stripe(dst, src);
+				dst += LEDPANEL_MODULE_DUMMY +
+				       LEDPANEL_MODULE_BYTES;
+			}
 		}
-#else
-		/*
-		 * Single module for testing, copy in the bits for the
-		 * unconnected output first, then 40 bits (5 bytes) in
-		 * reverse order.
-		 */
-		*dst++ = '\0';
-		if (src)
-			memcpy_reverse(dst, src, 5);
-		dst += 5;
-#endif
 	}
+
+	PROFILE_END(PREPARE_SHIFTREG);
 }
 
 void ledpanel_buffer_init()
@@ -118,4 +253,7 @@ void ledpanel_buffer_init()
 				LEDPANEL_SET(x, y);
 		}
 	}
+
+	/* panel is not yet scanning, show the grid right away */
+	ledpanel_buffer_render(ledpanel_buffer_shiftreg, ledpanel_buffer, 1);
 }
@@ -0,0 +1,111 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ledpanel_canvas.h"
+
+#include <string.h>
+
+#if LEDPANEL_CANVAS_WIDTH % 8
+#error LEDPANEL_CANVAS_WIDTH must be a multiple of 8!
+#endif
+
+uint8_t ledpanel_canvas[LEDPANEL_CANVAS_PITCH * LEDPANEL_PIX_HEIGHT];
+
+static unsigned int canvas_bytes; /* used width of canvas, 0: off */
+static int32_t viewport_x; /* in 1/256 pixels */
+static int32_t viewport_v; /* in 1/256 pixels per frame */
+static int viewport_dirty; /* show even if viewport_v is 0 */
+static int restore; /* show ledpanel_buffer again after canvas was on */
+
+/* window of the canvas as shown on the panel */
+static uint8_t viewport_fb[LEDPANEL_BUFFER_BYTES] __attribute__((aligned(4)));
+
+int ledpanel_canvas_enable(unsigned int width)
+{
+	if (width % 8 || width > LEDPANEL_CANVAS_WIDTH ||
+	    (width && width < LEDPANEL_PIX_WIDTH) ||
+	    (width && ledpanel_buffer_planes != 1))
+		return -1;
+
+	if (canvas_bytes && !width)
+		restore = 1;
+	canvas_bytes = width / 8;
+	viewport_dirty = 1;
+	return 0;
+}
+
+void ledpanel_canvas_viewport(unsigned int x, int velocity)
+{
+	viewport_x = (int32_t)x << 8;
+	viewport_v = velocity;
+	viewport_dirty = 1;
+}
+
+/* copy the canvas at pixel x to viewport_fb, wrapping around */
+static void ledpanel_canvas_window(unsigned int x)
+{
+	unsigned int y, i, b, shift = x % 8;
+	const uint8_t *src;
+	uint8_t *dst = viewport_fb;
+
+	for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++) {
+		src = &ledpanel_canvas[LEDPANEL_CANVAS_PITCH * y];
+		b = x / 8;
+		for (i = 0; i < LEDPANEL_U8_PITCH; i++) {
+			*dst = src[b] << shift;
+			if (++b == canvas_bytes)
+				b = 0;
+			if (shift)
+				*dst |= src[b] >> (8 - shift);
+			dst++;
+		}
+	}
+}
+
+void ledpanel_canvas_poll()
+{
+	int32_t len;
+
+	if (!ledpanel_buffer_sync())
+		return;
+
+	if (!canvas_bytes) {
+		if (restore)
+			ledpanel_buffer_commit();
+		restore = 0;
+		return;
+	}
+
+	if (ledpanel_buffer_planes != 1)
+		return;
+	if (!viewport_v && !viewport_dirty)
+		return;
+
+	len = (int32_t)canvas_bytes << (3 + 8);
+	viewport_x %= len;
+	if (viewport_x < 0)
+		viewport_x += len;
+
+	ledpanel_canvas_window(viewport_x >> 8);
+	ledpanel_buffer_commit_plane(viewport_fb);
+
+	viewport_x += viewport_v;
+	viewport_dirty = 0;
+}
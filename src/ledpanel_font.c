@@ -0,0 +1,197 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ledpanel_font.h"
+#include "ledpanel_blit.h"
+
+/*
+ * 5x8 proportional font, printable ASCII. Capitals and digits are 7
+ * rows high, the last row is for descenders. 408 x 8 pixels, plus 3
+ * bytes per row so atlas_bits() never reads past the end.
+ */
+#define ATLAS_5X8_PITCH 54
+
+static const uint8_t atlas_5x8[8 * ATLAS_5X8_PITCH] = {
+	/* row 0 */
+	0x1a, 0xa2, 0x61, 0x93, 0x00, 0x00, 0x00, 0x72, 0x77, 0xc5, 0xf3, 0x7d,
+	0xce, 0x02, 0x10, 0xe7, 0x3b, 0xce, 0xe7, 0xfe, 0xe8, 0xf3, 0xc6, 0x11,
+	0x8b, 0xbc, 0xef, 0x3f, 0xf1, 0x8c, 0x63, 0x1f, 0xf0, 0x72, 0x02, 0x04,
+	0x00, 0x20, 0x30, 0x42, 0x62, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00,
+	0x00, 0x03, 0x80, 0x00, 0x00, 0x00,
+	/* row 1 */
+	0x1a, 0xa7, 0xe6, 0x54, 0x88, 0x40, 0x01, 0x8e, 0x88, 0x8d, 0x04, 0x06,
+	0x31, 0x04, 0x09, 0x18, 0xc6, 0x31, 0x94, 0x21, 0x18, 0xa1, 0x4a, 0x1b,
+	0x8c, 0x63, 0x18, 0xc0, 0x91, 0x8c, 0x63, 0x10, 0xc8, 0x15, 0x01, 0x04,
+	0x00, 0x20, 0x40, 0x40, 0x22, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00,
+	0x00, 0x05, 0x40, 0x00, 0x00, 0x00,
+	/* row 2 */
+	0x11, 0xfa, 0x0a, 0x88, 0x6a, 0x40, 0x02, 0x9a, 0x09, 0x15, 0xe8, 0x0a,
+	0x31, 0xa9, 0xe4, 0x10, 0xc6, 0x30, 0x8c, 0x21, 0x08, 0xa1, 0x52, 0x15,
+	0xcc, 0x63, 0x18, 0xc0, 0x91, 0x8c, 0x55, 0x11, 0x44, 0x18, 0x80, 0x75,
+	0x9d, 0xae, 0xe7, 0xda, 0x66, 0xd5, 0x9d, 0xe7, 0xdb, 0xfa, 0x31, 0x8c,
+	0x63, 0xf5, 0x48, 0x00, 0x00, 0x00,
+	/* row 3 */
+	0x10, 0xa7, 0x11, 0x08, 0x5d, 0xf3, 0xc4, 0xaa, 0x10, 0xa4, 0x1f, 0x11,
+	0xcf, 0x10, 0x02, 0x26, 0xff, 0xd0, 0x8f, 0xbd, 0x7f, 0xa1, 0x62, 0x15,
+	0xac, 0x7d, 0x1f, 0x38, 0x91, 0x8d, 0x48, 0xa2, 0x42, 0x10, 0x00, 0x0e,
+	0x62, 0x71, 0x48, 0xe6, 0x6a, 0xae, 0x63, 0x18, 0xe4, 0x12, 0x31, 0x8a,
+	0xa2, 0x29, 0x35, 0x00, 0x00, 0x00,
+	/* row 4 */
+	0x11, 0xf2, 0xa2, 0xa8, 0x6a, 0x40, 0x08, 0xca, 0x20, 0x7e, 0x18, 0xa2,
+	0x21, 0x09, 0xe4, 0x4a, 0xc6, 0x30, 0x8c, 0x21, 0x18, 0xa1, 0x52, 0x11,
+	0x9c, 0x61, 0x5a, 0x04, 0x91, 0x8d, 0x54, 0x44, 0x41, 0x10, 0x00, 0x7c,
+	0x62, 0x3f, 0x48, 0xc6, 0x72, 0xac, 0x63, 0x18, 0xc3, 0x92, 0x31, 0xa9,
+	0x22, 0x45, 0x42, 0x00, 0x00, 0x00,
+	/* row 5 */
+	0x00, 0xaf, 0x4e, 0x44, 0x88, 0x44, 0x10, 0x8a, 0x44, 0x45, 0x18, 0xa2,
+	0x22, 0xa4, 0x08, 0x0a, 0xc6, 0x31, 0x94, 0x21, 0x18, 0xa9, 0x4a, 0x11,
+	0x8c, 0x61, 0x29, 0x04, 0x91, 0x55, 0x62, 0x48, 0x40, 0x90, 0x00, 0x8c,
+	0x62, 0x30, 0x47, 0xc6, 0x6a, 0xac, 0x63, 0xe7, 0xc0, 0x52, 0x6a, 0xaa,
+	0x9e, 0x85, 0x40, 0x00, 0x00, 0x00,
+	/* row 6 */
+	0x10, 0xa2, 0x0d, 0xa3, 0x00, 0x04, 0x20, 0x77, 0xfb, 0x84, 0xe7, 0x21,
+	0xcc, 0x22, 0x10, 0x47, 0x47, 0xce, 0xe7, 0xe0, 0xf8, 0xf6, 0x47, 0xf1,
+	0x8b, 0xa0, 0xd8, 0xf8, 0x8e, 0x22, 0xa2, 0x4f, 0xf0, 0x70, 0x00, 0x7f,
+	0x9d, 0xee, 0x40, 0xc7, 0x65, 0xac, 0x5d, 0x00, 0xc7, 0x8d, 0xa4, 0x54,
+	0x43, 0xf3, 0x80, 0x00, 0x00, 0x00,
+	/* row 7 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7c, 0x00,
+	0x00, 0x00, 0x07, 0x00, 0x80, 0x00, 0x01, 0x00, 0x80, 0x00, 0x00, 0x00,
+	0x1c, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const uint16_t atlas_5x8_x[0x7f - 0x20 + 1] = {
+	0, 3, 4, 7, 12, 17, 22, 27, 28, 31,
+	34, 39, 44, 46, 50, 51, 56, 61, 64, 69,
+	74, 79, 84, 89, 94, 99, 104, 105, 107, 111,
+	115, 119, 124, 129, 134, 139, 144, 149, 154, 159,
+	164, 169, 172, 177, 182, 187, 192, 197, 202, 207,
+	212, 217, 222, 227, 232, 237, 242, 247, 252, 257,
+	260, 265, 268, 273, 278, 280, 285, 290, 294, 299,
+	304, 308, 313, 318, 319, 322, 326, 328, 333, 338,
+	343, 348, 353, 357, 362, 366, 371, 376, 381, 386,
+	391, 396, 399, 400, 403, 408,
+};
+
+const struct ledpanel_font ledpanel_fonts[LEDPANEL_FONTS] = {
+	[LEDPANEL_FONT_5X8] = {
+		.atlas = atlas_5x8, .x = atlas_5x8_x,
+		.pitch = ATLAS_5X8_PITCH, .height = 8,
+		.first = 0x20, .count = 0x7f - 0x20,
+		.spacing = 1, .scale = 1,
+	},
+	[LEDPANEL_FONT_10X16] = {
+		.atlas = atlas_5x8, .x = atlas_5x8_x,
+		.pitch = ATLAS_5X8_PITCH, .height = 8,
+		.first = 0x20, .count = 0x7f - 0x20,
+		.spacing = 1, .scale = 2,
+	},
+};
+
+/* index of character c in the font */
+static unsigned int font_glyph(const struct ledpanel_font *f, uint8_t c)
+{
+	if (c < f->first || c - f->first >= f->count)
+		c = '?';
+	return c - f->first;
+}
+
+/* 32 atlas pixels of a row, starting at column x, in the MSB first */
+static uint32_t atlas_bits(const uint8_t *row, unsigned int x)
+{
+	const uint8_t *p = &row[x / 8];
+	uint32_t v = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		     (uint32_t)p[2] << 8 | p[3];
+
+	return v << (x % 8);
+}
+
+/* each of the upper 16 bits of v twice */
+static uint32_t spread2(uint32_t v)
+{
+	v >>= 16;
+	v = (v | v << 8) & 0x00ff00ff;
+	v = (v | v << 4) & 0x0f0f0f0f;
+	v = (v | v << 2) & 0x33333333;
+	v = (v | v << 1) & 0x55555555;
+	return v | v << 1;
+}
+
+/* 32 pixels at x of row y in all planes */
+static void font_row(int x, int y, uint32_t bits, uint32_t mask)
+{
+	unsigned int p;
+
+	for (p = 0; p < ledpanel_buffer_planes; p++)
+		ledpanel_blit_merge(LEDPANEL_PLANE(ledpanel_buffer, p), x, y,
+				    bits, mask);
+}
+
+int ledpanel_font_width(const struct ledpanel_font *f, const uint8_t *s,
+			unsigned int n)
+{
+	unsigned int g;
+	int w = 0;
+
+	if (!n)
+		return 0;
+	while (n--) {
+		g = font_glyph(f, *s++);
+		w += f->x[g + 1] - f->x[g] + f->spacing;
+	}
+	return (w - f->spacing) * f->scale;
+}
+
+int ledpanel_font_draw(const struct ledpanel_font *f, int x, int y,
+		       const uint8_t *s, unsigned int n, unsigned int flags)
+{
+	unsigned int g, w, row, k;
+	uint32_t glyph, cell, bits, mask;
+
+	while (n--) {
+		g = font_glyph(f, *s++);
+		w = f->x[g + 1] - f->x[g];
+		glyph = ~0u << (32 - w);
+		cell = ~0u << (32 - w - f->spacing);
+
+		for (row = 0; row < f->height; row++) {
+			bits = atlas_bits(&f->atlas[f->pitch * row], f->x[g]) &
+			       glyph;
+			mask = cell;
+			if (f->scale == 2) {
+				bits = spread2(bits);
+				mask = spread2(mask);
+			}
+			if (flags & LEDPANEL_FONT_INVERT)
+				bits = ~bits & mask;
+			if (!(flags & LEDPANEL_FONT_OPAQUE))
+				mask = bits;
+
+			for (k = 0; k < f->scale; k++) {
+				font_row(x, y + (int)(row * f->scale + k),
+					 bits, mask);
+			}
+		}
+		x += (w + f->spacing) * f->scale;
+	}
+	return x;
+}
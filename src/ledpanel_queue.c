@@ -0,0 +1,108 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ledpanel_queue.h"
+
+#if LEDPANEL_QUEUE_BYTES < LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES
+#error LEDPANEL_QUEUE_BYTES must hold at least one grayscale frame!
+#endif
+
+#define QUEUE_MAX_FRAMES (LEDPANEL_QUEUE_BYTES / LEDPANEL_BUFFER_BYTES)
+
+static uint8_t queue_mem[LEDPANEL_QUEUE_BYTES] __attribute__((aligned(4)));
+static uint32_t queue_due[QUEUE_MAX_FRAMES];
+static unsigned int queue_head, queue_count;
+
+/* frame number of the last frame handed to ledpanel_buffer */
+static uint32_t queue_last_due;
+static int queue_started; /* queue_last_due is valid */
+
+unsigned int ledpanel_queue_dropped;
+
+static unsigned int queue_frame_bytes(void)
+{
+	return ledpanel_buffer_planes * LEDPANEL_BUFFER_BYTES;
+}
+
+static unsigned int queue_slots(void)
+{
+	return LEDPANEL_QUEUE_BYTES / queue_frame_bytes();
+}
+
+static uint8_t *queue_slot(unsigned int i)
+{
+	return &queue_mem[(i % queue_slots()) * queue_frame_bytes()];
+}
+
+void ledpanel_queue_flush()
+{
+	queue_head = 0;
+	queue_count = 0;
+	queue_started = 0;
+}
+
+uint8_t *ledpanel_queue_tail()
+{
+	if (queue_count == queue_slots())
+		return NULL;
+	return queue_slot(queue_head + queue_count);
+}
+
+void ledpanel_queue_push(unsigned int interval)
+{
+	uint32_t now = ledpanel_buffer_frame;
+	uint32_t due;
+
+	if (queue_count)
+		due = queue_due[(queue_head + queue_count - 1) % queue_slots()];
+	else
+		due = queue_last_due;
+	due += interval;
+
+	/* ran empty, restart the timeline with the next frame */
+	if (!queue_started || (int32_t)(due - now) <= 0)
+		due = now + 1;
+
+	queue_due[(queue_head + queue_count) % queue_slots()] = due;
+	queue_count++;
+	queue_started = 1;
+}
+
+void ledpanel_queue_poll()
+{
+	uint32_t now;
+
+	if (!queue_count || !ledpanel_buffer_sync())
+		return;
+
+	/* skip frames which are late already, if there is a newer one */
+	now = ledpanel_buffer_frame;
+	while (queue_count > 1 &&
+	       (int32_t)(queue_due[(queue_head + 1) % queue_slots()] - now) <= 0) {
+		queue_head = (queue_head + 1) % queue_slots();
+		queue_count--;
+		ledpanel_queue_dropped++;
+	}
+
+	queue_last_due = queue_due[queue_head];
+	ledpanel_buffer_commit_at(queue_slot(queue_head), queue_last_due);
+	queue_head = (queue_head + 1) % queue_slots();
+	queue_count--;
+}
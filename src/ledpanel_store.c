@@ -0,0 +1,210 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ledpanel_store.h"
+#include "ledpanel_buffer.h"
+#include "ledpanel_canvas.h"
+#include "ledpanel_queue.h"
+#include "ledpanel_font.h"
+#include "hw_matrix.h"
+#include "usb_proto.h"
+#include "usb_if.h"
+
+#include <limits.h>
+#include <string.h>
+
+static const uint8_t *store_entries; /* NULL: no valid image */
+static uint32_t store_len;
+static unsigned int store_idle; /* in ticks, 0: don't play again */
+
+static int playing;
+static int resume; /* play again when the host is quiet */
+static uint32_t play_pos; /* entry being shown */
+static int play_shown; /* play_pos is on the panel, until play_until */
+static uint32_t play_until;
+
+/* ticks since the host has sent content */
+static volatile unsigned int host_quiet;
+
+static void store_entry(uint32_t pos, struct ledpanel_store_entry *e)
+{
+	memcpy(e, store_entries + pos, sizeof(*e));
+}
+
+static uint32_t store_next(uint32_t pos)
+{
+	struct ledpanel_store_entry e;
+
+	store_entry(pos, &e);
+	pos += sizeof(e) + LEDPANEL_STORE_PAD(e.len);
+	return pos < store_len ? pos : 0;
+}
+
+static int store_entry_valid(const struct ledpanel_store_entry *e)
+{
+	unsigned int w;
+
+	switch (e->type) {
+	case LEDPANEL_STORE_FRAME:
+		return e->len == LEDPANEL_WIRE_BYTES;
+	case LEDPANEL_STORE_STRIP:
+		w = e->len / LEDPANEL_PIX_HEIGHT;
+		return e->len % LEDPANEL_PIX_HEIGHT == 0 &&
+		       w * 8 >= LEDPANEL_PIX_WIDTH &&
+		       w * 8 <= LEDPANEL_CANVAS_WIDTH;
+	case LEDPANEL_STORE_TEXT:
+		return (e->flags & USB_PROTO_TEXT_FONT) < LEDPANEL_FONTS &&
+		       e->len <= USB_PROTO_TEXT_MAX;
+	}
+	return 0;
+}
+
+int ledpanel_store_open(const uint8_t *image, uint32_t size)
+{
+	struct ledpanel_store_hdr hdr;
+	struct ledpanel_store_entry e;
+	uint32_t pos;
+
+	ledpanel_store_play(0);
+	store_entries = NULL;
+	if (!image || size < sizeof(hdr))
+		return -1;
+
+	memcpy(&hdr, image, sizeof(hdr));
+	if (hdr.magic != LEDPANEL_STORE_MAGIC || !hdr.len ||
+	    hdr.len > size - sizeof(hdr) ||
+	    hdr.sum != ledpanel_store_sum(image + sizeof(hdr), hdr.len))
+		return -1;
+
+	/* entries have to fill the image exactly */
+	for (pos = 0; pos < hdr.len; pos += sizeof(e) + LEDPANEL_STORE_PAD(e.len)) {
+		if (hdr.len - pos < sizeof(e))
+			return -1;
+		memcpy(&e, image + sizeof(hdr) + pos, sizeof(e));
+		if (hdr.len - pos - sizeof(e) < e.len || !store_entry_valid(&e))
+			return -1;
+	}
+	if (pos != hdr.len)
+		return -1;
+
+	store_entries = image + sizeof(hdr);
+	store_len = hdr.len;
+	store_idle = hdr.idle * 10;
+	resume = 1;
+	return 0;
+}
+
+int ledpanel_store_play(int on)
+{
+	if (!on) {
+		if (playing)
+			ledpanel_canvas_enable(0);
+		playing = 0;
+		resume = 0;
+		return 0;
+	}
+	if (!store_entries)
+		return -1;
+
+	/* entries are monochrome, nothing queued by the host must show up
+	   in between, and a frame the host left unfinished is dropped, so
+	   its data doesn't run past the end of the smaller mono frame */
+	if (ledpanel_buffer_planes != 1 || ledpanel_buffer_subframes != 1)
+		hw_matrix_grayscale(HW_MATRIX_MONO);
+	ledpanel_queue_flush();
+	usb_if_reset_bulk();
+
+	playing = 1;
+	resume = 1;
+	play_pos = 0;
+	play_shown = 0;
+	return 0;
+}
+
+void ledpanel_store_host()
+{
+	host_quiet = 0;
+	if (playing) {
+		ledpanel_canvas_enable(0);
+		playing = 0;
+	}
+}
+
+void ledpanel_store_tick()
+{
+	if (host_quiet < UINT_MAX)
+		host_quiet++;
+}
+
+/* put an entry on the panel, or on the canvas */
+static void store_show(const struct ledpanel_store_entry *e,
+		       const uint8_t *data)
+{
+	unsigned int y, w;
+
+	switch (e->type) {
+	case LEDPANEL_STORE_FRAME:
+		ledpanel_canvas_enable(0);
+		for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++)
+			memcpy(&ledpanel_buffer[LEDPANEL_U8_PITCH * y],
+			       &data[LEDPANEL_PIX_BYTES * y], LEDPANEL_PIX_BYTES);
+		ledpanel_buffer_commit();
+		break;
+	case LEDPANEL_STORE_STRIP:
+		w = e->len / LEDPANEL_PIX_HEIGHT;
+		for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++)
+			memcpy(&ledpanel_canvas[LEDPANEL_CANVAS_PITCH * y],
+			       &data[w * y], w);
+		ledpanel_canvas_enable(w * 8);
+		ledpanel_canvas_viewport(e->x, e->v);
+		break;
+	case LEDPANEL_STORE_TEXT:
+		ledpanel_canvas_enable(0);
+		memset(ledpanel_buffer, '\0', LEDPANEL_BUFFER_BYTES);
+		usb_proto_text(e->x, e->y, e->flags, data, e->len);
+		ledpanel_buffer_commit();
+		break;
+	}
+}
+
+void ledpanel_store_poll()
+{
+	struct ledpanel_store_entry e;
+
+	if (!playing) {
+		if (!resume || !store_entries || !store_idle ||
+		    host_quiet < store_idle)
+			return;
+		ledpanel_store_play(1);
+	}
+
+	if (play_shown && (int32_t)(ledpanel_buffer_frame - play_until) < 0)
+		return;
+	/* the last entry has to be on the panel before the next one */
+	if (!ledpanel_buffer_sync())
+		return;
+
+	if (play_shown)
+		play_pos = store_next(play_pos);
+	store_entry(play_pos, &e);
+	store_show(&e, store_entries + play_pos + sizeof(e));
+	play_until = ledpanel_buffer_frame + (e.frames ? e.frames : 1);
+	play_shown = 1;
+}
@@ -0,0 +1,174 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ledpanel_store.h"
+#include "hw_matrix.h"
+#include "settings.h"
+
+#include <string.h>
+
+#include <libopencm3/stm32/flash.h>
+
+/* can be overridden by build_flags in platformio.ini, whole pages */
+#ifndef LEDPANEL_STORE_BYTES
+#define LEDPANEL_STORE_BYTES (16 * SETTINGS_PAGE_SIZE)
+#endif
+
+#if LEDPANEL_STORE_BYTES % SETTINGS_PAGE_SIZE
+#error LEDPANEL_STORE_BYTES must be a multiple of the flash page size!
+#endif
+
+/* end of the firmware in flash, from the libopencm3 linker script */
+extern uint8_t _data_loadaddr, _data, _edata;
+
+/* first byte of the store, 0 if it would overlap the firmware */
+static uint32_t store_addr(void)
+{
+	uint32_t addr = settings_addr() - LEDPANEL_STORE_BYTES;
+	uint32_t end = (uint32_t)&_data_loadaddr + (&_edata - &_data);
+
+	return addr >= end ? addr : 0;
+}
+
+/*
+ * Writes are only queued by ledpanel_store_write(), which runs in the
+ * USB interrupt: a page erase stalls the CPU for 20..40 ms, far too long
+ * for a control request. ledpanel_store_write_poll() does one page or
+ * the queued bytes at a time. Like settings_save(), it stops the refresh
+ * while the CPU stalls, better dark than one bright row, and it is only
+ * started again at the end of the upload, so the panel doesn't flicker
+ * with every chunk.
+ */
+#define WRITE_MAX 128 /* usb_if_ctrl_buf */
+static uint8_t write_data[WRITE_MAX];
+static uint32_t write_offset;
+static unsigned int write_len;
+static uint32_t erase_pos; /* next page to erase, or LEDPANEL_STORE_BYTES */
+static int store_erased; /* erased with offset 0, nothing has failed since */
+static int write_status = LEDPANEL_STORE_DONE;
+static int write_stopped; /* the refresh was stopped for writing */
+static volatile unsigned int write_quiet; /* ticks since the last write */
+
+/* the upload is over, start the refresh again */
+static void store_write_end(void)
+{
+	if (write_stopped && write_status != LEDPANEL_STORE_BUSY) {
+		write_stopped = 0;
+		hw_matrix_start();
+	}
+}
+
+int ledpanel_store_load()
+{
+	uint32_t addr = store_addr();
+
+	store_write_end();
+	if (!addr)
+		return -1;
+	return ledpanel_store_open((const uint8_t *)addr, LEDPANEL_STORE_BYTES);
+}
+
+int ledpanel_store_write(uint32_t offset, const uint8_t *data,
+			 unsigned int len)
+{
+	if (!store_addr() || offset % 4 || len % 2 || len > WRITE_MAX ||
+	    offset > LEDPANEL_STORE_BYTES || len > LEDPANEL_STORE_BYTES - offset ||
+	    write_status == LEDPANEL_STORE_BUSY || (offset && !store_erased))
+		return -1;
+
+	/* stop playing the old image before it is overwritten */
+	ledpanel_store_open(NULL, 0);
+
+	memcpy(write_data, data, len);
+	write_offset = offset;
+	write_len = len;
+	erase_pos = offset ? LEDPANEL_STORE_BYTES : 0;
+	if (!offset)
+		store_erased = 0;
+	write_quiet = 0;
+	write_status = LEDPANEL_STORE_BUSY;
+	return 0;
+}
+
+int ledpanel_store_write_status()
+{
+	return write_status;
+}
+
+void ledpanel_store_write_poll()
+{
+	uint32_t addr = store_addr();
+	uint16_t w;
+	unsigned int i;
+
+	if (write_status != LEDPANEL_STORE_BUSY) {
+		if (write_quiet >= 10)
+			store_write_end();
+		return;
+	}
+
+	if (hw_matrix_running()) {
+		hw_matrix_stop();
+		write_stopped = 1;
+	}
+
+	flash_unlock();
+	if (erase_pos < LEDPANEL_STORE_BYTES) {
+		addr += erase_pos;
+		flash_erase_page(addr);
+		erase_pos += SETTINGS_PAGE_SIZE;
+		if (flash_get_status_flags() & (FLASH_SR_PGERR |
+						FLASH_SR_WRPRTERR))
+			write_status = LEDPANEL_STORE_FAILED;
+		flash_lock();
+
+		for (i = 0; i < SETTINGS_PAGE_SIZE; i++)
+			if (((const uint8_t *)addr)[i] != 0xff)
+				write_status = LEDPANEL_STORE_FAILED;
+		/* nothing more is written until the next offset 0 */
+		if (write_status == LEDPANEL_STORE_FAILED)
+			erase_pos = LEDPANEL_STORE_BYTES;
+		else if (erase_pos == LEDPANEL_STORE_BYTES)
+			store_erased = 1;
+		return;
+	}
+
+	addr += write_offset;
+	write_status = LEDPANEL_STORE_DONE;
+	for (i = 0; i < write_len; i += 2) {
+		w = write_data[i] | (write_data[i + 1] << 8);
+		flash_program_half_word(addr + i, w);
+		if (flash_get_status_flags() & (FLASH_SR_PGERR |
+						FLASH_SR_WRPRTERR))
+			write_status = LEDPANEL_STORE_FAILED;
+	}
+	flash_lock();
+
+	if (memcmp((const void *)addr, write_data, write_len))
+		write_status = LEDPANEL_STORE_FAILED;
+	if (write_status == LEDPANEL_STORE_FAILED)
+		store_erased = 0;
+}
+
+void ledpanel_store_write_tick()
+{
+	if (write_quiet < 10)
+		write_quiet++;
+}
@@ -20,6 +20,11 @@
 
 #include "hw_matrix.h"
 #include "ledpanel_buffer.h"
+#include "ledpanel_canvas.h"
+#include "ledpanel_queue.h"
+#include "ledpanel_store.h"
+#include "profile.h"
+#include "settings.h"
 #include "usb_if.h"
 
 #include <stdlib.h>
@@ -40,20 +45,14 @@
 
 static uint32_t systick;
 
-void sys_tick_handler()
-{
-	systick++;
-	if (systick >= 9) {
-		gpio_clear(GPIOC, GPIO13);
-		systick = 0;
-	} else if (systick == 2) {
-		gpio_set(GPIOC, GPIO13);
-	}
-}
+/* debug LEDs, just to entertain the user... PB13 and PB15 are SCK and
+   MOSI of the second chain, if there is one */
+#if LEDPANEL_CHAINS > 1
+#define DEBUG_LEDS 0x5000
+#else
+#define DEBUG_LEDS 0xf000
+#endif
 
-/* debug LEDs, just to entertain the user... */
-
-static uint16_t debug_ctr;
 static uint16_t debug_led_pattern_ctr;
 uint16_t debug_led_pattern[] = {
 	0x8000,
@@ -66,8 +65,31 @@ uint16_t debug_led_pattern[] = {
 	0x8000
 };
 
+void sys_tick_handler()
+{
+	usb_if_tick();
+	ledpanel_store_tick();
+	ledpanel_store_write_tick();
+
+	systick++;
+	if (systick >= 9) {
+		gpio_clear(GPIOC, GPIO13);
+		systick = 0;
+	} else if (systick == 2) {
+		gpio_set(GPIOC, GPIO13);
+	}
+
+	if (++debug_led_pattern_ctr >= ARRAY_SIZE(debug_led_pattern)) {
+		debug_led_pattern_ctr=0;
+	}
+	gpio_set(GPIOB, DEBUG_LEDS & debug_led_pattern[debug_led_pattern_ctr]);
+	gpio_clear(GPIOB, DEBUG_LEDS & ~debug_led_pattern[debug_led_pattern_ctr]);
+}
+
 int main(void)
 {
+	uint32_t frame;
+
 	/* === system clock initialization ===
 	   external 8MHz XTAL, SYSCLK=9(pll)*8MHz=72MHz, AHB 72MHz(max),
 	   ADC 9MHz(14MHz max), APB1=36MHz(max), APB2=72MHz(max),
@@ -85,7 +107,7 @@ int main(void)
 
 	/* debug LEDs PB12, 13, 14, 15 */
 	gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL,
-		      0xf000);
+		      DEBUG_LEDS);
 
 	/* systick handler */
 	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
@@ -101,21 +123,42 @@ int main(void)
 		      0x0800);
 	gpio_set(GPIOB, 0x0800); /* PB11 */
 
+	profile_init();
 	usb_if_init();
 
 	ledpanel_buffer_init();
 	hw_matrix_init();
+	settings_load();
+
+	/* content from flash, the first entry is committed right away and
+	   shown instead of the grid from the very first frame */
+	if (ledpanel_store_load() == 0) {
+		ledpanel_store_play(1);
+		ledpanel_store_poll();
+	}
 	hw_matrix_start();
 
+	/* systick and the USB interrupt must never delay the refresh */
+	nvic_set_priority(NVIC_SYSTICK_IRQ, 0xc0);
+
 	while (1) {
-		if(!debug_ctr++) {
-			if (++debug_led_pattern_ctr >= ARRAY_SIZE(debug_led_pattern)) {
-				debug_led_pattern_ctr=0;
-			}
-			gpio_set(GPIOB, 0xf000 & debug_led_pattern[debug_led_pattern_ctr]);
-			gpio_clear(GPIOB, 0xf000 & ~debug_led_pattern[debug_led_pattern_ctr]);
-		};
+		frame = ledpanel_buffer_frame;
 
+		usb_if_lock();
 		usb_if_poll();
+		ledpanel_store_write_poll();
+		ledpanel_store_poll();
+		ledpanel_canvas_poll();
+		ledpanel_queue_poll();
+		usb_if_unlock();
+
+		/* sleep until the next interrupt, unless USB data is left
+		   or a new frame has started since we looked. Interrupts
+		   are masked, so none can sneak in between check and wfi,
+		   and a pending one still ends the wfi */
+		cm_disable_interrupts();
+		if (!usb_if_pending() && frame == ledpanel_buffer_frame)
+			__asm__ volatile("wfi");
+		cm_enable_interrupts();
 	}
 }
@@ -0,0 +1,60 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "profile.h"
+
+#ifdef PROFILE
+
+#include <string.h>
+
+struct profile_stats profile_stats[PROFILE_NREGIONS];
+
+void profile_reset()
+{
+	unsigned int r;
+
+	memset(profile_stats, '\0', sizeof(profile_stats));
+	for (r = 0; r < PROFILE_NREGIONS; r++)
+		profile_stats[r].min = UINT32_MAX;
+}
+
+void profile_init()
+{
+	dwt_enable_cycle_counter();
+	profile_reset();
+}
+
+void profile_add(enum profile_region r, uint32_t cycles)
+{
+	struct profile_stats *p = &profile_stats[r];
+	unsigned int bucket = cycles ? 32 - __builtin_clz(cycles) : 0;
+
+	if (bucket >= PROFILE_BUCKETS)
+		bucket = PROFILE_BUCKETS - 1;
+
+	p->count++;
+	if (cycles < p->min)
+		p->min = cycles;
+	if (cycles > p->max)
+		p->max = cycles;
+	p->hist[bucket]++;
+}
+
+#endif
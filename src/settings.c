@@ -0,0 +1,85 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "settings.h"
+
+#include <string.h>
+
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/desig.h>
+
+/* change when struct settings changes */
+#define SETTINGS_MAGIC 0x4c454431
+
+struct settings settings;
+
+uint32_t settings_addr(void)
+{
+	return FLASH_BASE + desig_get_flash_size() * 1024 - SETTINGS_PAGE_SIZE;
+}
+
+void settings_load()
+{
+	const struct settings *flash = (const struct settings *)settings_addr();
+
+	if (flash->magic == SETTINGS_MAGIC) {
+		memcpy(&settings, flash, sizeof(settings));
+	} else {
+		memset(&settings, '\0', sizeof(settings));
+		settings.magic = SETTINGS_MAGIC;
+		settings.brightness = 64; /* about 25% */
+	}
+
+	if (settings.gain_valid)
+		hw_matrix_gain(settings.gain);
+	hw_matrix_gamma(settings.gamma_valid ? settings.gamma : NULL);
+	hw_matrix_pwm(settings.brightness);
+}
+
+int settings_save()
+{
+	uint32_t addr = settings_addr();
+	const uint16_t *p = (const uint16_t *)&settings;
+	unsigned int i;
+	int was_running = hw_matrix_running();
+	int ret = 0;
+
+	/* the CPU stalls during the page erase, better dark than one
+	   bright row */
+	if (was_running)
+		hw_matrix_stop();
+
+	flash_unlock();
+	flash_erase_page(addr);
+	for (i = 0; i < sizeof(settings) / 2; i++) {
+		flash_program_half_word(addr + 2 * i, p[i]);
+		if (flash_get_status_flags() & (FLASH_SR_PGERR |
+						FLASH_SR_WRPRTERR))
+			ret = -1;
+	}
+	flash_lock();
+
+	if (was_running)
+		hw_matrix_start();
+
+	if (memcmp((const void *)addr, &settings, sizeof(settings)))
+		ret = -1;
+	return ret;
+}
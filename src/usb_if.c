@@ -19,10 +19,17 @@
  */
 
 #include "usb_if.h"
+#include "usb_proto.h"
 #include "ledpanel_buffer.h"
+#include "ledpanel_canvas.h"
+#include "ledpanel_queue.h"
+#include "ledpanel_store.h"
 #include "hw_matrix.h"
+#include "profile.h"
+#include "settings.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
@@ -33,6 +40,10 @@
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/stm32/st_usbfs.h>
 
+#if USB_IF_GAMMA_POINTS != HW_MATRIX_GAMMA_POINTS
+#error USB_IF_GAMMA_POINTS must match HW_MATRIX_GAMMA_POINTS!
+#endif
+
 static usbd_device *usb_if_usbdev;
 uint8_t usb_if_ctrl_buf[128];
 uint8_t usb_if_rxbuf[64];
@@ -45,8 +56,8 @@ static const struct usb_device_descriptor dev = {
 	.bDeviceSubClass = 0,
 	.bDeviceProtocol = 0,
 	.bMaxPacketSize0 = 64,
-	.idVendor = 0x4e65, /* {0x4e,0x65,0x72,0x64} = "Nerd" */
-	.idProduct = 0x7264,
+	.idVendor = USB_IF_VENDOR_ID,
+	.idProduct = USB_IF_PRODUCT_ID,
 	.bcdDevice = 0x0200,
 	.iManufacturer = 1, /* usb_strings[0] */
 	.iProduct = 2, /* usb_strings[1] */
@@ -57,7 +68,7 @@ static const struct usb_device_descriptor dev = {
 static const struct usb_endpoint_descriptor data_endp[] = { {
 	.bLength = USB_DT_ENDPOINT_SIZE,
 	.bDescriptorType = USB_DT_ENDPOINT,
-	.bEndpointAddress = 0x01,
+	.bEndpointAddress = USB_IF_BULK_EP,
 	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
 	.wMaxPacketSize = 64,
 	.bInterval = 1,
@@ -101,45 +112,333 @@ static const char *usb_strings[] = {
 	"1",
 };
 
-static uint8_t * const fb_start = (uint8_t*)ledpanel_buffer;
-static uint8_t * const fb_end = ((void*)ledpanel_buffer) + sizeof(ledpanel_buffer);
-uint8_t * fb_writep = (uint8_t*)ledpanel_buffer;
+uint8_t * fb_writep = ledpanel_buffer;
+
+/* bytes of the last bulk packet not yet copied to the framebuffer */
+static unsigned int rx_pos, rx_len;
+
+/*
+ * The bulk OUT endpoint is double buffered: While we hold one of the two
+ * packet memory buffers, the USB peripheral can receive into the other
+ * one. Toggling SW_BUF (DTOG_TX for an OUT endpoint) hands back the
+ * buffer we hold and takes the other one, the peripheral NAKs while it
+ * would have to write to the buffer we hold (DTOG_RX == SW_BUF).
+ */
+#define BULK_PMA_BUF0 0x180 /* top of the 512 bytes, libopencm3 */
+#define BULK_PMA_BUF1 0x1c0 /* allocates from the bottom */
+#define BULK_PMA_COUNT (0x8000 | (64 / 32 - 1) << 10) /* 2 * 32 bytes */
+
+/* packets received, but not copied to usb_if_rxbuf yet (0..2), the
+   first one is in the buffer we hold */
+static unsigned int pma_full;
+/* packet read since the last usb_if_poll() */
+static volatile int rx_new;
+
+/* raw framebuffer data or framed commands (usb_proto.h) */
+static int bulk_framed;
+
+/* counters kept here, the rest is collected for USB_IF_REQUEST_STATS */
+static struct usb_if_stats stats;
+static uint32_t loops, ticks;
+
+/*
+ * Requests that change how the bulk stream is read (RESET_WRITEPTR,
+ * GRAY_MODE, BULK_MODE, PLAY) apply in stream order: The bulk data received
+ * before them is drained first, and no later packet is fetched until
+ * they have been applied. They are held here until then.
+ */
+#define USB_IF_DEFERRED 4
+static struct {
+	uint8_t request;
+	uint16_t value;
+	uint32_t after; /* stats.bulk_packets once the data before is fetched */
+} deferred[USB_IF_DEFERRED];
+static unsigned int deferred_n;
+
+void usb_if_reset_bulk(void)
+{
+	fb_writep = ledpanel_buffer;
+	rx_pos = rx_len = 0;
+	usb_proto_reset();
+}
+
+/* the bulk data before 'request' has been used up, and no complete
+   frame waits for a commit. A mode switch restarts the refresh, so for
+   that, the last commit also has to have been shown for a whole frame */
+static int usb_if_ready(uint8_t request)
+{
+	uint8_t *fb_end = ledpanel_buffer +
+			  ledpanel_buffer_planes * LEDPANEL_BUFFER_BYTES;
+
+	if (rx_pos != rx_len)
+		return 0;
+	if (bulk_framed ? usb_proto_waiting() : fb_writep == fb_end)
+		return 0;
+	if ((request != USB_IF_REQUEST_GRAY_MODE &&
+	     request != USB_IF_REQUEST_PLAY) || !hw_matrix_running())
+		return 1;
+	return ledpanel_buffer_sync() &&
+	       ledpanel_buffer_frame != ledpanel_buffer_shown_frame;
+}
+
+/* apply one of the requests above, returns -1 if it failed */
+static int usb_if_stream_request(uint8_t request, uint16_t value)
+{
+	switch (request) {
+	case USB_IF_REQUEST_RESET_WRITEPTR:
+		break;
+	case USB_IF_REQUEST_GRAY_MODE:
+		if (hw_matrix_grayscale(value) < 0)
+			return -1;
+		ledpanel_queue_flush();
+		break;
+	case USB_IF_REQUEST_BULK_MODE:
+		bulk_framed = !!value;
+		break;
+	case USB_IF_REQUEST_PLAY:
+		if (value && ledpanel_store_load() < 0)
+			return -1;
+		ledpanel_store_play(value);
+		break;
+	}
+	/* a new frame starts, also if its size has changed */
+	usb_if_reset_bulk();
+	return 0;
+}
+
+/*
+ * Copy pending bytes from usb_if_rxbuf into the framebuffer. When a
+ * frame is complete, it is committed, but only after the refresh ISR has
+ * picked up the previous commit. Until then, the remaining bytes are left
+ * in usb_if_rxbuf for the next call. Called from the main loop only.
+ */
+static void usb_if_drain(void)
+{
+	uint8_t *fb_end = ledpanel_buffer +
+			  ledpanel_buffer_planes * LEDPANEL_BUFFER_BYTES;
+
+	/* nobody else would flip, only do it if needed, as every flip
+	   counts as a frame and wakes up the main loop once more */
+	if (!hw_matrix_running() && !ledpanel_buffer_sync())
+		ledpanel_buffer_flip();
+
+	if (bulk_framed) {
+		rx_pos += usb_proto_feed(usb_if_rxbuf + rx_pos, rx_len - rx_pos);
+		return;
+	}
+
+	while (1) {
+		if (fb_writep == fb_end) {
+			if (!ledpanel_buffer_sync())
+				return;
+			ledpanel_buffer_commit();
+			fb_writep = ledpanel_buffer;
+			stats.raw_frames++;
+		}
+		if (rx_pos == rx_len)
+			return;
+		*fb_writep++ = usb_if_rxbuf[rx_pos++];
+#if LEDPANEL_U8_PITCH != LEDPANEL_PIX_BYTES
+		/* skip the padding at the end of the row */
+		if ((fb_writep - ledpanel_buffer) % LEDPANEL_U8_PITCH ==
+		    LEDPANEL_PIX_BYTES)
+			fb_writep += LEDPANEL_U8_PITCH - LEDPANEL_PIX_BYTES;
+#endif
+	}
+}
+
+/* endpoint registers have toggle and write-0-to-clear bits, so they are
+   only accessed through these (the simulator in test/sim/ models them),
+   same as in libopencm3's st_usbfs_core.h */
+#ifndef SET_REG
+#define GET_REG(REG) ((uint16_t)*(REG))
+#define SET_REG(REG, VAL) (*(REG) = (uint16_t)(VAL))
+#endif
+
+/* write EP1R, leaving type, kind, address and the CTR flags alone,
+   toggle bits in 'tog', clear CTR flags in 'ctr' */
+static void usb_if_ep1_write(uint16_t tog, uint16_t ctr)
+{
+	uint16_t r = GET_REG(USB_EP_REG(0x01));
+
+	SET_REG(USB_EP_REG(0x01),
+		(r & (USB_EP_TYPE | USB_EP_KIND | USB_EP_ADDR)) |
+		((USB_EP_RX_CTR | USB_EP_TX_CTR) & ~ctr) | tog);
+}
+
+/* switch the bulk endpoint, just set up by usbd_ep_setup(), to double
+   buffering, the peripheral receives into buffer 0 first */
+static void usb_if_bulk_dblbuf(void)
+{
+	uint16_t r;
+
+	*USB_EP_TX_ADDR(0x01) = BULK_PMA_BUF0; /* TX descriptor: buffer 0 */
+	*USB_EP_TX_COUNT(0x01) = BULK_PMA_COUNT;
+	*USB_EP_RX_ADDR(0x01) = BULK_PMA_BUF1; /* RX descriptor: buffer 1 */
+	*USB_EP_RX_COUNT(0x01) = BULK_PMA_COUNT;
+
+	r = GET_REG(USB_EP_REG(0x01));
+	SET_REG(USB_EP_REG(0x01), (r & (USB_EP_TYPE | USB_EP_ADDR)) |
+		USB_EP_KIND | USB_EP_RX_CTR | USB_EP_TX_CTR |
+		(r & USB_EP_RX_DTOG) | /* DTOG_RX = 0 */
+		(~r & USB_EP_TX_DTOG)); /* SW_BUF = 1 */
+	pma_full = 0;
+}
+
+/* copy a packet from the packet memory, 16 bit words at 32 bit
+   addresses on the F1 */
+static unsigned int usb_if_pma_read(uint8_t *dst, uint16_t addr, uint16_t count)
+{
+	const volatile uint16_t *src =
+		(const volatile uint16_t *)(USB_PMA_BASE + addr * 2);
+	unsigned int i, len = count & 0x3ff;
+	uint16_t w;
+
+	for (i = 0; i < len; i += 2) {
+		w = *src;
+		src += 2;
+		dst[i] = w;
+		if (i + 1 < len)
+			dst[i + 1] = w >> 8;
+	}
+	return len;
+}
+
+/* move the oldest received packet to usb_if_rxbuf, if usb_if_rxbuf has
+   been used up, returns non-zero if it did so, called with the USB
+   interrupt off (from the ISR itself, or usb_if_lock()) */
+static int usb_if_fetch(void)
+{
+	if (!pma_full || rx_pos != rx_len)
+		return 0;
+	/* the packet belongs to the stream after a deferred request */
+	if (deferred_n && stats.bulk_packets == deferred[0].after)
+		return 0;
+
+	if (GET_REG(USB_EP_REG(0x01)) & USB_EP_TX_DTOG) /* SW_BUF */
+		rx_len = usb_if_pma_read(usb_if_rxbuf, *USB_EP_RX_ADDR(0x01),
+					 *USB_EP_RX_COUNT(0x01));
+	else
+		rx_len = usb_if_pma_read(usb_if_rxbuf, *USB_EP_TX_ADDR(0x01),
+					 *USB_EP_TX_COUNT(0x01));
+	rx_pos = 0;
+	stats.bulk_packets++;
+	stats.bulk_bytes += rx_len;
+	ledpanel_store_host();
+
+	/* the other buffer has been filled meanwhile, take it and let the
+	   peripheral have the one just read */
+	if (--pma_full)
+		usb_if_ep1_write(USB_EP_TX_DTOG, 0);
+	return 1;
+}
 
 static void
 usb_if_bulkout_cb(usbd_device *usbd_dev, uint8_t ep)
 {
-	unsigned short rx_len;
-	const uint8_t *srcp, *src_end;
-
+	(void)usbd_dev;
 	(void)ep;
 
-	rx_len = usbd_ep_read_packet(usbd_dev, 0x01, usb_if_rxbuf, sizeof(usb_if_rxbuf));
+	PROFILE_START(BULKOUT);
 
-	srcp = usb_if_rxbuf;
-	src_end = srcp + rx_len;
+	/* if we hold a packet already, the peripheral is NAKing now, and
+	   the new packet stays where it is until usb_if_fetch() toggles */
+	if (!pma_full++)
+		usb_if_ep1_write(USB_EP_TX_DTOG, USB_EP_RX_CTR);
+	else
+		usb_if_ep1_write(0, USB_EP_RX_CTR);
 
-	while (srcp != src_end) {
-		*fb_writep++ = *srcp++;
-		if (fb_writep == fb_end)
-			fb_writep = fb_start;
-	}
+	usb_if_fetch();
+	rx_new = 1;
+
+	PROFILE_END(BULKOUT);
+}
+
+/* fill in the counters kept by other modules */
+static uint8_t store_status; /* USB_IF_REQUEST_STORE, device to host */
+
+static void usb_if_get_stats(void)
+{
+	stats.rows = hw_matrix_rows;
+	stats.frames = ledpanel_buffer_frame;
+	stats.shown = ledpanel_buffer_shown;
+	stats.dma_busy = hw_matrix_dma_busy;
+	stats.queue_dropped = ledpanel_queue_dropped;
 }
 
 static enum usbd_request_return_codes
 usb_if_control_cb(usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
 		uint16_t *len, void (**complete)(usbd_device *usbd_dev, struct usb_setup_data *req))
 {
-	(void)buf;
-	(void)len;
+	uint16_t gain[HW_MATRIX_DRIVERS];
+
 	(void)complete;
 	(void)usbd_dev;
 
-	if (req->bmRequestType != USB_REQ_TYPE_VENDOR)
+	if ((req->bmRequestType & ~USB_REQ_TYPE_IN) != USB_REQ_TYPE_VENDOR)
 		return USBD_REQ_NOTSUPP; /* Only accept vendor request. */
 
+	if (req->bmRequestType & USB_REQ_TYPE_IN) {
+		switch (req->bRequest) {
+		case USB_IF_REQUEST_STATS:
+			usb_if_get_stats();
+			*buf = (uint8_t *)&stats;
+			if (*len > sizeof(stats))
+				*len = sizeof(stats);
+			return USBD_REQ_HANDLED;
+		case USB_IF_REQUEST_STORE:
+			store_status = ledpanel_store_write_status();
+			*buf = &store_status;
+			if (*len > sizeof(store_status))
+				*len = sizeof(store_status);
+			return USBD_REQ_HANDLED;
+#ifdef PROFILE
+		case USB_IF_REQUEST_PROFILE:
+			if (req->wIndex >= PROFILE_NREGIONS)
+				return USBD_REQ_NOTSUPP;
+			*buf = (uint8_t *)&profile_stats[req->wIndex];
+			if (*len > sizeof(struct profile_stats))
+				*len = sizeof(struct profile_stats);
+			return USBD_REQ_HANDLED;
+#endif
+		}
+		return USBD_REQ_NOTSUPP;
+	}
+
+	/* the host takes over the panel's content */
+	switch (req->bRequest) {
+	case USB_IF_REQUEST_RESET_WRITEPTR:
+	case USB_IF_REQUEST_GRAY_MODE:
+	case USB_IF_REQUEST_BULK_MODE:
+	case USB_IF_REQUEST_CANVAS:
+	case USB_IF_REQUEST_VIEWPORT:
+		ledpanel_store_host();
+	}
+
 	switch (req->bRequest) {
 	case USB_IF_REQUEST_RESET_WRITEPTR:
-		fb_writep = fb_start;
+	case USB_IF_REQUEST_GRAY_MODE:
+	case USB_IF_REQUEST_BULK_MODE:
+	case USB_IF_REQUEST_PLAY:
+		/* right away if possible, failures can be reported then */
+		if (!deferred_n && !pma_full && usb_if_ready(req->bRequest)) {
+			if (usb_if_stream_request(req->bRequest,
+						  req->wValue) < 0)
+				return USBD_REQ_NOTSUPP;
+			break;
+		}
+		/* later, only a mode switch that doesn't fit the timing
+		   fails unnoticed */
+		if (deferred_n == USB_IF_DEFERRED ||
+		    (req->bRequest == USB_IF_REQUEST_GRAY_MODE &&
+		     req->wValue != HW_MATRIX_MONO &&
+		     req->wValue != HW_MATRIX_GRAY &&
+		     req->wValue != HW_MATRIX_FRC))
+			return USBD_REQ_NOTSUPP;
+		deferred[deferred_n].request = req->bRequest;
+		deferred[deferred_n].value = req->wValue;
+		deferred[deferred_n].after = stats.bulk_packets + pma_full;
+		deferred_n++;
 		break;
 	case USB_IF_REQUEST_PANEL_ONOFF:
 		if (req->wValue)
@@ -148,11 +447,54 @@ usb_if_control_cb(usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **b
 			hw_matrix_stop();
 		break;
 	case USB_IF_REQUEST_PANEL_BRIGHTNESS:
-		hw_matrix_pwm(req->wValue);
+		settings.brightness = req->wValue & 0xff;
+		hw_matrix_pwm(settings.brightness);
 		break;
 	case USB_IF_REQUEST_MBI5029_MODE:
 		hw_matrix_mbi5029_mode(req->wValue);
 		break;
+	case USB_IF_REQUEST_TIMING:
+		if (hw_matrix_timing(req->wValue, req->wIndex == 0xffff ?
+						      -1 : req->wIndex) < 0)
+			return USBD_REQ_NOTSUPP;
+		break;
+	case USB_IF_REQUEST_GAIN:
+		if (*len % 2 || req->wIndex + *len / 2 > HW_MATRIX_DRIVERS)
+			return USBD_REQ_NOTSUPP;
+		memcpy(gain, settings.gain, sizeof(gain));
+		memcpy(&gain[req->wIndex], *buf, *len);
+		if (hw_matrix_gain(gain) < 0)
+			return USBD_REQ_NOTSUPP; /* previous one still busy */
+		memcpy(settings.gain, gain, sizeof(gain));
+		settings.gain_valid = 1;
+		break;
+	case USB_IF_REQUEST_GAMMA:
+		if (*len != sizeof(settings.gamma))
+			return USBD_REQ_NOTSUPP;
+		memcpy(settings.gamma, *buf, *len);
+		settings.gamma_valid = 1;
+		hw_matrix_gamma(settings.gamma);
+		break;
+	case USB_IF_REQUEST_SAVE:
+		if (settings_save() < 0)
+			return USBD_REQ_NOTSUPP;
+		break;
+	case USB_IF_REQUEST_CANVAS:
+		if (ledpanel_canvas_enable(req->wValue) < 0)
+			return USBD_REQ_NOTSUPP;
+		break;
+	case USB_IF_REQUEST_VIEWPORT:
+		ledpanel_canvas_viewport(req->wValue, (int16_t)req->wIndex);
+		break;
+	case USB_IF_REQUEST_STORE:
+		if (ledpanel_store_write(req->wValue * 4, *buf, *len) < 0)
+			return USBD_REQ_NOTSUPP;
+		break;
+#ifdef PROFILE
+	case USB_IF_REQUEST_PROFILE:
+		profile_reset();
+		break;
+#endif
 	default:
 		return USBD_REQ_NOTSUPP;
 	}
@@ -170,24 +512,70 @@ static void usb_if_config_cb(usbd_device *usbd_dev, uint16_t wValue)
 				(void*)usb_if_control_cb);
 
 	usbd_ep_setup(usbd_dev,
-		0x01, /* ep addr */
+		USB_IF_BULK_EP,
 		USB_ENDPOINT_ATTR_BULK,
 		64, /* max size */
 		usb_if_bulkout_cb);
+	usb_if_bulk_dblbuf();
+	deferred_n = 0;
 }
 
-void usb_if_poll()
+/* all of the USB stack runs in this interrupt, below the refresh */
+void usb_lp_can_rx0_isr()
 {
-	/* this is a desperate attempt to fix the problem wher the
-	   endpoint ends up in a NAK state, which I am too dumb to find
-	   out why it's happening. */
-#if 0
-	if ((*USB_EP_REG(0x01) & USB_EP_RX_STAT) == USB_EP_RX_STAT_NAK)
-		 USB_SET_EP_RX_STAT(0x01, USB_EP_RX_STAT_VALID);
-#endif
 	usbd_poll(usb_if_usbdev);
 }
 
+void usb_if_lock()
+{
+	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+}
+
+void usb_if_unlock()
+{
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+}
+
+int usb_if_pending()
+{
+	/* data left over waits for a new frame, unless the panel is off
+	   and usb_if_drain() does the flipping */
+	return rx_new || (rx_pos != rx_len && !hw_matrix_running());
+}
+
+/* apply deferred requests whose data has been drained */
+static void usb_if_deferred_poll(void)
+{
+	unsigned int i;
+
+	while (deferred_n && stats.bulk_packets == deferred[0].after &&
+	       usb_if_ready(deferred[0].request)) {
+		usb_if_stream_request(deferred[0].request, deferred[0].value);
+		deferred_n--;
+		for (i = 0; i < deferred_n; i++)
+			deferred[i] = deferred[i + 1];
+	}
+}
+
+void usb_if_poll()
+{
+	rx_new = 0;
+	do {
+		usb_if_drain();
+		usb_if_deferred_poll();
+	} while (usb_if_fetch());
+	loops++;
+}
+
+void usb_if_tick()
+{
+	if (++ticks < 10)
+		return;
+	stats.loops_per_sec = loops;
+	loops = 0;
+	ticks = 0;
+}
+
 void usb_if_init()
 {
 	/* === USB === */
@@ -195,4 +583,8 @@ void usb_if_init()
 				  usb_strings, 3, usb_if_ctrl_buf,
 				  sizeof(usb_if_ctrl_buf));
 	usbd_register_set_config_callback(usb_if_usbdev, usb_if_config_cb);
+
+	/* never delay the refresh (TIM2, DMA1 ch2 at priority 0), the
+	   interrupt is enabled by the first usb_if_unlock() */
+	nvic_set_priority(NVIC_USB_LP_CAN_RX0_IRQ, 0x40);
 }
@@ -0,0 +1,327 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usb_proto.h"
+#include "ledpanel_buffer.h"
+#include "ledpanel_blit.h"
+#include "ledpanel_canvas.h"
+#include "ledpanel_font.h"
+#include "ledpanel_queue.h"
+
+#include <string.h>
+
+static struct usb_proto_hdr hdr;
+static unsigned int hdr_pos; /* header bytes received */
+static unsigned int data_pos; /* payload bytes received */
+static int hdr_valid; /* arguments have been checked */
+
+/* PackBits decoder state */
+static unsigned int pb_out; /* offset in framebuffer */
+static unsigned int pb_literal; /* literal bytes still to come */
+static int pb_repeat; /* next byte is to be repeated pb_count times */
+static unsigned int pb_count;
+
+/* payload of commands executed when complete (TEXT, FILL, SCROLL) */
+static uint8_t payload[USB_PROTO_TEXT_MAX];
+
+#if USB_PROTO_FILL_CLEAR != LEDPANEL_BLIT_CLEAR ||                             \
+	USB_PROTO_FILL_SET != LEDPANEL_BLIT_SET ||                             \
+	USB_PROTO_FILL_INVERT != LEDPANEL_BLIT_INVERT
+#error USB_PROTO_FILL_* and LEDPANEL_BLIT_* differ!
+#endif
+
+#if USB_PROTO_TEXT_MAX < 8 /* sizeof(struct usb_proto_rect) */
+#error USB_PROTO_TEXT_MAX too small!
+#endif
+
+void usb_proto_reset()
+{
+	hdr_pos = 0;
+	data_pos = 0;
+}
+
+/* header complete, check arguments */
+static int usb_proto_check(void)
+{
+	unsigned int x = hdr.arg[0], y = hdr.arg[1];
+	unsigned int w = hdr.arg[2], h = hdr.arg[3];
+
+	switch (hdr.cmd) {
+	case USB_PROTO_CMD_NOP:
+		return 1;
+	case USB_PROTO_CMD_PATCH:
+		return x + w <= LEDPANEL_PIX_BYTES &&
+		       y + h <= LEDPANEL_PIX_HEIGHT &&
+		       hdr.len == ledpanel_buffer_planes * w * h;
+	case USB_PROTO_CMD_COMMIT:
+		return hdr.len == 0;
+	case USB_PROTO_CMD_CANVAS:
+		w = hdr.len / LEDPANEL_PIX_HEIGHT;
+		x = hdr.arg[0] | (hdr.arg[1] << 8);
+		return hdr.len % LEDPANEL_PIX_HEIGHT == 0 &&
+		       x + w <= LEDPANEL_CANVAS_PITCH;
+	case USB_PROTO_CMD_QUEUE:
+		return hdr.len == ledpanel_buffer_planes * LEDPANEL_WIRE_BYTES;
+	case USB_PROTO_CMD_TEXT:
+		return (hdr.arg[3] & USB_PROTO_TEXT_FONT) < LEDPANEL_FONTS &&
+		       hdr.len <= USB_PROTO_TEXT_MAX;
+	case USB_PROTO_CMD_FILL:
+		return hdr.len == sizeof(struct usb_proto_rect) &&
+		       hdr.arg[0] <= USB_PROTO_FILL_INVERT;
+	case USB_PROTO_CMD_SCROLL:
+		return hdr.len == sizeof(struct usb_proto_rect);
+	case USB_PROTO_CMD_PACKBITS:
+		pb_out = 0;
+		pb_literal = 0;
+		pb_repeat = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* copy payload of a rectangle, at most up to the end of a row, planes
+   are pitch * LEDPANEL_PIX_HEIGHT bytes apart */
+static unsigned int usb_proto_rect(uint8_t *base, unsigned int pitch,
+				   unsigned int w, unsigned int h,
+				   const uint8_t *buf, unsigned int len)
+{
+	unsigned int plane = data_pos / (w * h);
+	unsigned int row = (data_pos / w) % h;
+	unsigned int col = data_pos % w;
+	uint8_t *dst = base + plane * pitch * LEDPANEL_PIX_HEIGHT +
+		       pitch * row + col;
+
+	if (len > w - col)
+		len = w - col;
+	memcpy(dst, buf, len);
+	return len;
+}
+
+/* write n decoded bytes (or n times *src if run) to the framebuffer,
+   up to the end of a row */
+static unsigned int usb_proto_pb_row(const uint8_t *src, unsigned int n,
+				     int run)
+{
+	uint8_t *dst = ledpanel_buffer + ledpanel_buffer_wire_offset(pb_out, &n);
+	unsigned int ret = n;
+	uint8_t v = *src;
+
+	pb_out += n;
+
+	if (!(hdr.arg[0] & USB_PROTO_PACKBITS_XOR)) {
+		if (run)
+			memset(dst, v, n);
+		else
+			memcpy(dst, src, n);
+	} else if (run) {
+		if (v) /* long runs of 0 are the common case */
+			while (n--)
+				*dst++ ^= v;
+	} else {
+		while (n--)
+			*dst++ ^= *src++;
+	}
+	return ret;
+}
+
+/* write n decoded bytes (or n times *src if run) to the framebuffer */
+static void usb_proto_pb_put(const uint8_t *src, unsigned int n, int run)
+{
+	unsigned int frame_bytes = ledpanel_buffer_planes * LEDPANEL_WIRE_BYTES;
+	unsigned int done;
+
+	if (n > frame_bytes - pb_out) /* silently drop excess data */
+		n = frame_bytes - pb_out;
+	while (n) {
+		done = usb_proto_pb_row(src, n, run);
+		if (!run)
+			src += done;
+		n -= done;
+	}
+}
+
+/* decode payload of USB_PROTO_CMD_PACKBITS */
+static unsigned int usb_proto_packbits(const uint8_t *buf, unsigned int len)
+{
+	unsigned int n;
+
+	if (pb_literal) {
+		n = (len < pb_literal) ? len : pb_literal;
+		usb_proto_pb_put(buf, n, 0);
+		pb_literal -= n;
+		return n;
+	}
+
+	if (pb_repeat) {
+		usb_proto_pb_put(buf, pb_count, 1);
+		pb_repeat = 0;
+		return 1;
+	}
+
+	/* control byte */
+	if (*buf < 128) {
+		pb_literal = *buf + 1;
+	} else if (*buf > 128) {
+		pb_repeat = 1;
+		pb_count = 257 - *buf;
+	}
+	return 1;
+}
+
+void usb_proto_text(int x, int y, unsigned int font, const uint8_t *s,
+		    unsigned int n)
+{
+	const struct ledpanel_font *f =
+		&ledpanel_fonts[font & USB_PROTO_TEXT_FONT];
+	unsigned int flags = 0;
+
+	if (font & USB_PROTO_TEXT_CENTER)
+		x -= ledpanel_font_width(f, s, n) / 2;
+	else if (font & USB_PROTO_TEXT_RIGHT)
+		x -= ledpanel_font_width(f, s, n);
+	if (font & USB_PROTO_TEXT_OPAQUE)
+		flags |= LEDPANEL_FONT_OPAQUE;
+	if (font & USB_PROTO_TEXT_INVERT)
+		flags |= LEDPANEL_FONT_INVERT;
+
+	ledpanel_font_draw(f, x, y, s, n, flags);
+}
+
+/* FILL and SCROLL, in all planes */
+static void usb_proto_blit(void)
+{
+	struct usb_proto_rect r;
+	unsigned int p;
+	uint8_t *fb;
+
+	memcpy(&r, payload, sizeof(r));
+	for (p = 0; p < ledpanel_buffer_planes; p++) {
+		fb = LEDPANEL_PLANE(ledpanel_buffer, p);
+		if (hdr.cmd == USB_PROTO_CMD_FILL)
+			ledpanel_blit_fill(fb, r.x, r.y, r.w, r.h, hdr.arg[0]);
+		else
+			ledpanel_blit_scroll(fb, r.x, r.y, r.w, r.h,
+					     (int8_t)hdr.arg[0],
+					     (int8_t)hdr.arg[1]);
+	}
+}
+
+/* consume payload for the current command */
+static unsigned int usb_proto_data(const uint8_t *buf, unsigned int len)
+{
+	unsigned int x = hdr.arg[0], y = hdr.arg[1];
+	unsigned int w = hdr.arg[2], h = hdr.arg[3];
+	uint8_t *dst;
+
+	switch (hdr.cmd) {
+	case USB_PROTO_CMD_PATCH:
+		/* one rectangle per plane, each plane LEDPANEL_BUFFER_BYTES */
+		return usb_proto_rect(&ledpanel_buffer[LEDPANEL_U8_PITCH * y + x],
+				      LEDPANEL_U8_PITCH, w, h, buf, len);
+	case USB_PROTO_CMD_CANVAS:
+		x |= y << 8;
+		return usb_proto_rect(&ledpanel_canvas[x], LEDPANEL_CANVAS_PITCH,
+				      hdr.len / LEDPANEL_PIX_HEIGHT,
+				      LEDPANEL_PIX_HEIGHT, buf, len);
+	case USB_PROTO_CMD_QUEUE:
+		dst = ledpanel_queue_tail();
+		if (!dst) /* wait for a free slot */
+			return 0;
+		dst += ledpanel_buffer_wire_offset(data_pos, &len);
+		memcpy(dst, buf, len);
+		return len;
+	case USB_PROTO_CMD_TEXT:
+	case USB_PROTO_CMD_FILL:
+	case USB_PROTO_CMD_SCROLL:
+		memcpy(payload + data_pos, buf, len);
+		if (data_pos + len < hdr.len)
+			return len;
+		if (hdr.cmd == USB_PROTO_CMD_TEXT)
+			usb_proto_text((int16_t)(hdr.arg[0] | (hdr.arg[1] << 8)),
+				       (int8_t)hdr.arg[2], hdr.arg[3], payload,
+				       hdr.len);
+		else
+			usb_proto_blit();
+		return len;
+	case USB_PROTO_CMD_PACKBITS:
+		return usb_proto_packbits(buf, len);
+	}
+	return len;
+}
+
+/* command complete, returns 0 if we have to wait for a previous commit */
+static int usb_proto_finish(void)
+{
+	if (hdr_valid && hdr.cmd == USB_PROTO_CMD_QUEUE) {
+		ledpanel_queue_push(hdr.arg[0] | (hdr.arg[1] << 8));
+		return 1;
+	}
+	if (hdr_valid && (hdr.cmd == USB_PROTO_CMD_COMMIT ||
+			  (hdr.flags & USB_PROTO_FLAG_COMMIT))) {
+		if (!ledpanel_buffer_sync())
+			return 0;
+		ledpanel_buffer_commit();
+	}
+	return 1;
+}
+
+int usb_proto_waiting()
+{
+	return hdr_pos == sizeof(hdr) && data_pos == hdr.len;
+}
+
+unsigned int usb_proto_feed(const uint8_t *buf, unsigned int len)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	unsigned int n;
+
+	while (1) {
+		if (hdr_pos < sizeof(hdr)) {
+			if (p == end)
+				break;
+			((uint8_t *)&hdr)[hdr_pos++] = *p++;
+			if (hdr_pos == sizeof(hdr))
+				hdr_valid = usb_proto_check();
+			continue;
+		}
+
+		if (data_pos < hdr.len) {
+			if (p == end)
+				break;
+			n = end - p;
+			if (n > hdr.len - data_pos)
+				n = hdr.len - data_pos;
+			/* invalid commands are skipped */
+			if (hdr_valid)
+				n = usb_proto_data(p, n);
+			if (!n)
+				break;
+			p += n;
+			data_pos += n;
+			continue;
+		}
+
+		if (!usb_proto_finish())
+			break;
+		usb_proto_reset();
+	}
+
+	return p - buf;
+}
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# build src/ledpanel_buffer.c for the host and check the mapping from
+# framebuffer to shiftregister order, for both panel types, a longer
+# chain of modules (also split in two) and word aligned rows. Then check the host library
+# (host/) against the firmware's bulk protocol decoder, replay a
+# recording of it to the firmware in the simulator (sim/), and check the
+# conversion from gray images.
+#
+# ./host_check.sh                check only
+# ./host_check.sh -b             check and benchmark
+# ./host_check.sh -b video.raw   same, dithering a raw gray video of
+#                                the panel's size (see badapple.sh)
+
+set -e
+
+cc="${CC:-cc}"
+cflags="${CFLAGS:--O2 -Wall -Wextra}"
+
+topdir="$(cd "$(dirname "$0")/.." && pwd)"
+builddir="$(mktemp -d)"
+trap 'rm -rf "$builddir"' EXIT
+
+for type in TYPE_SINGLE TYPE_TRIPLE MODULES=6 "MODULES=6 -DLEDPANEL_CHAINS=2" \
+	    "TYPE_TRIPLE -DLEDPANEL_WORD_ALIGNED" ; do
+	echo "=== LEDPANEL_$type"
+	$cc $cflags -DLEDPANEL_$type -I"$topdir/include" \
+		-o "$builddir/check" \
+		"$topdir/test/ledpanel_buffer_check.c" \
+		"$topdir/src/ledpanel_buffer.c" "$topdir/src/ledpanel_blit.c"
+	"$builddir/check" "$@"
+
+	$cc $cflags -DLEDPANEL_$type -I"$topdir/include" -I"$topdir/host" \
+		-o "$builddir/host_check" \
+		"$topdir/test/ledpanel_host_check.c" \
+		"$topdir/host/ledpanel_host.c" "$topdir/host/ledpanel_mock.c" \
+		"$topdir/host/ledpanel_record.c" \
+		"$topdir/src/usb_proto.c" "$topdir/src/ledpanel_buffer.c" \
+		"$topdir/src/ledpanel_canvas.c" "$topdir/src/ledpanel_queue.c" \
+		"$topdir/src/ledpanel_font.c" "$topdir/src/ledpanel_blit.c" \
+		"$topdir/src/ledpanel_store.c"
+	"$builddir/host_check"
+
+	# the firmware keeps addresses in 32 bit registers, some of its
+	# static functions are only used with HW_MATRIX_DMA_SCAN
+	$cc $cflags -fno-pie -no-pie -Wno-pointer-to-int-cast \
+		-Wno-int-to-pointer-cast -Wno-unused-function -DLEDPANEL_$type \
+		-I"$topdir/test/sim" -I"$topdir/include" -I"$topdir/host" \
+		-o "$builddir/sim" \
+		"$topdir/test/sim/ledpanel_sim.c" "$topdir/test/sim/sim_hw.c" \
+		"$topdir/src/usb_if.c" "$topdir/src/usb_proto.c" \
+		"$topdir/src/ledpanel_buffer.c" "$topdir/src/ledpanel_blit.c" \
+		"$topdir/src/ledpanel_canvas.c" "$topdir/src/ledpanel_queue.c" \
+		"$topdir/src/ledpanel_font.c" "$topdir/src/ledpanel_store.c" \
+		"$topdir/src/ledpanel_store_flash.c" "$topdir/src/hw_matrix.c" \
+		"$topdir/src/settings.c"
+	"$builddir/host_check" "$builddir/rec" "$builddir/expect"
+	"$builddir/sim" -e "$builddir/expect" "$builddir/rec"
+
+	$cc $cflags -DLEDPANEL_$type -I"$topdir/include" -I"$topdir/host" \
+		-o "$builddir/dither_check" \
+		"$topdir/test/ledpanel_dither_check.c" \
+		"$topdir/host/ledpanel_dither.c"
+	"$builddir/dither_check" "$@"
+done
@@ -0,0 +1,92 @@
+#!/usr/bin/python
+import sys
+import time
+import usb.core
+import argparse
+import struct
+import os
+import ledpanel_tools
+
+# from include/usb_if.h
+USB_IF_REQUEST_RESET_WRITEPTR=0x0000
+USB_IF_REQUEST_PANEL_ONOFF=0x0001
+USB_IF_REQUEST_GRAY_MODE=0x0004
+USB_IF_REQUEST_BULK_MODE=0x0005
+USB_IF_REQUEST_STATS=0x0008
+
+parser = argparse.ArgumentParser(
+    description='stream frames to the panel as fast as it takes them')
+parser.add_argument('-W', '--width', metavar='pixels',
+                    type=int, default=120, help='width [def:%(default)d]')
+parser.add_argument('-H', '--height', metavar='pixels',
+                    type=int, default=20, help='height [def:%(default)d]')
+parser.add_argument('-g', '--gray', metavar='bits', type=int,
+                    help='grayscale with bits bitplanes (must match firmware)')
+parser.add_argument('-m', '--mode', choices=['raw', 'nop', 'packbits', 'queue'],
+                    default='raw', help='raw frames, framed NOPs (no commit), '
+                    'PackBits or queued frames [def:%(default)s]')
+parser.add_argument('-t', '--time', metavar='s', type=float, default=5.0,
+                    help='duration [def:%(default).0f]')
+parser.add_argument('-n', '--batch', metavar='frames', type=int, default=8,
+                    help='frames per bulk transfer [def:%(default)d]')
+parser.add_argument('--off', action='store_true',
+                    help='stop the refresh, commits don\'t wait for a new frame')
+args = parser.parse_args()
+
+dev = usb.core.find(idVendor=0x4e65, idProduct=0x7264)
+if dev is None :
+    print('Could not find usb device!')
+    sys.exit(1)
+dev.set_configuration()
+
+
+def stats():
+    data = dev.ctrl_transfer(0xc0, USB_IF_REQUEST_STATS, 0, 0, 36)
+    return struct.unpack('<9I', data)
+
+
+planes = args.gray if args.gray else 1
+frame_bytes = planes * (args.width + 7) // 8 * args.height
+
+# random frames, worst case for PackBits
+frames = [os.urandom(frame_bytes) for i in range(args.batch)]
+if args.mode == 'raw' :
+    packet = b''.join(frames)
+elif args.mode == 'nop' :
+    packet = b''.join(ledpanel_tools.proto_cmd(ledpanel_tools.USB_PROTO_CMD_NOP,
+                                               payload=f) for f in frames)
+elif args.mode == 'packbits' :
+    packet = b''.join(ledpanel_tools.proto_packbits(f) for f in frames)
+else :
+    packet = b''.join(ledpanel_tools.proto_queue(f, 1) for f in frames)
+
+dev.ctrl_transfer(0x40, USB_IF_REQUEST_PANEL_ONOFF, 0 if args.off else 1)
+dev.ctrl_transfer(0x40, USB_IF_REQUEST_GRAY_MODE, 1 if args.gray else 0)
+dev.ctrl_transfer(0x40, USB_IF_REQUEST_BULK_MODE, 0 if args.mode == 'raw' else 1)
+dev.ctrl_transfer(0x40, USB_IF_REQUEST_RESET_WRITEPTR)
+
+before = stats()
+t0 = time.monotonic()
+sent = 0
+while True :
+    dev.write(0x01, packet, timeout=5000)
+    sent += 1
+    t = time.monotonic() - t0
+    if t >= args.time :
+        break
+after = stats()
+
+if args.off :
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_PANEL_ONOFF, 1)
+
+d = dict(zip(['rows', 'frames', 'shown', 'bulk_packets', 'bulk_bytes',
+              'raw_frames', 'dma_busy', 'queue_dropped', 'loops_per_sec'],
+             (b - a for a, b in zip(before, after))))
+nbytes = sent * len(packet)
+nframes = sent * args.batch
+
+print('%s: %d frames of %d bytes (%d bytes on the wire) in %.2f s' % (
+    args.mode, nframes, frame_bytes, len(packet) // args.batch, t))
+print('host:   %8.1f frames/s %10.0f bytes/s' % (nframes / t, nbytes / t))
+print('device: %8.1f shown/s  %10.0f bytes/s  %d packets, %d refresh frames' % (
+    d['shown'] / t, d['bulk_bytes'] / t, d['bulk_packets'], d['frames']))
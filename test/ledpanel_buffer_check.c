@@ -0,0 +1,313 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Host (Linux) check and benchmark for src/ledpanel_buffer.c, see
+ * host_check.sh on how to build it. The framebuffer to shiftregister
+ * mapping is checked against a pixel by pixel description of the
+ * hardware, then the conversion is timed.
+ */
+
+#include "ledpanel_buffer.h"
+#include "ledpanel_blit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* 40x20 pixel modules, row drivers select 3 stripes of 8 rows each */
+#define MODULE_WIDTH 40
+#define MODULES (LEDPANEL_PIX_WIDTH / MODULE_WIDTH)
+#define STRIPES 3
+
+/*
+ * Where pixel (x, y) ends up in the shiftregister data: per stripe
+ * (last one first) and module (rightmost first), one unconnected byte
+ * is shifted out, followed by 5 bytes of pixels in reverse byte order.
+ * With LEDPANEL_CHAINS chains, each drives its share of the modules from
+ * the left, and its data follows that of the chain before.
+ */
+static void golden_position(unsigned int x, unsigned int y,
+			    unsigned int *row, unsigned int *byte,
+			    uint8_t *mask)
+{
+	unsigned int per_chain = MODULES / LEDPANEL_CHAINS;
+	unsigned int stripe = y / 8;
+	unsigned int chain = x / MODULE_WIDTH / per_chain;
+	unsigned int module = x / MODULE_WIDTH % per_chain;
+	unsigned int xm = x % MODULE_WIDTH;
+	unsigned int block = chain * STRIPES * per_chain +
+			     (STRIPES - 1 - stripe) * per_chain +
+			     (per_chain - 1 - module);
+
+	*row = y % 8;
+	*byte = block * 6 + 1 + (MODULE_WIDTH / 8 - 1 - xm / 8);
+	*mask = 0x80 >> (xm % 8);
+}
+
+static void golden_shiftreg(uint8_t sr[8][LEDPANEL_SPI_BYTES],
+			    const uint8_t *fb)
+{
+	unsigned int x, y, row, byte;
+	uint8_t mask;
+
+	memset(sr, 0, 8 * LEDPANEL_SPI_BYTES);
+	for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++) {
+		for (x = 0; x < LEDPANEL_PIX_WIDTH; x++) {
+			if (!(fb[x / 8 + LEDPANEL_U8_PITCH * y] &
+			      LEDPANEL_BIT(x)))
+				continue;
+			golden_position(x, y, &row, &byte, &mask);
+			sr[row][byte] |= mask;
+		}
+	}
+}
+
+static int compare(const char *what, const uint8_t *fb)
+{
+	uint8_t want[8][LEDPANEL_SPI_BYTES];
+	uint8_t got[LEDPANEL_SPI_BYTES];
+	unsigned int row, i;
+
+	golden_shiftreg(want, fb);
+	for (row = 0; row < 8; row++) {
+		ledpanel_buffer_prepare_shiftreg(got, fb, row);
+		if (!memcmp(got, want[row], sizeof(got)))
+			continue;
+		printf("FAIL %s, row %u:\n  want", what, row);
+		for (i = 0; i < LEDPANEL_SPI_BYTES; i++)
+			printf(" %02x", want[row][i]);
+		printf("\n  got ");
+		for (i = 0; i < LEDPANEL_SPI_BYTES; i++)
+			printf(" %02x", got[i]);
+		printf("\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int check_mapping(void)
+{
+	uint8_t fb[LEDPANEL_BUFFER_BYTES];
+	unsigned int x, y, i;
+	char what[64];
+	int fails = 0;
+
+	/* every single pixel must end up in exactly one place */
+	for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++) {
+		for (x = 0; x < LEDPANEL_PIX_WIDTH; x++) {
+			memset(fb, 0, sizeof(fb));
+			fb[x / 8 + LEDPANEL_U8_PITCH * y] = LEDPANEL_BIT(x);
+			snprintf(what, sizeof(what), "pixel %u,%u", x, y);
+			fails += compare(what, fb);
+		}
+	}
+
+	srand(1);
+	for (i = 0; i < 100; i++) {
+		for (x = 0; x < sizeof(fb); x++)
+			fb[x] = rand();
+		snprintf(what, sizeof(what), "random frame %u", i);
+		fails += compare(what, fb);
+	}
+
+	memset(fb, 0xff, sizeof(fb));
+	fails += compare("all on", fb);
+
+	return fails;
+}
+
+/* commit converts all planes, the ISR picks them up at flip */
+static int check_commit(void)
+{
+	ledpanel_shiftreg_t *shown = ledpanel_buffer_shiftreg;
+	uint8_t want[8][LEDPANEL_SPI_BYTES];
+
+	ledpanel_buffer_init();
+	memset(ledpanel_buffer, 0, sizeof(ledpanel_buffer));
+	LEDPANEL_SET(0, 0);
+	LEDPANEL_SET(LEDPANEL_PIX_WIDTH - 1, LEDPANEL_PIX_HEIGHT - 1);
+
+	ledpanel_buffer_commit();
+	if (ledpanel_buffer_sync() || ledpanel_buffer_shiftreg != shown) {
+		printf("FAIL commit shown before flip\n");
+		return 1;
+	}
+	ledpanel_buffer_flip();
+	if (!ledpanel_buffer_sync() || ledpanel_buffer_shiftreg == shown) {
+		printf("FAIL commit not shown after flip\n");
+		return 1;
+	}
+
+	golden_shiftreg(want, ledpanel_buffer);
+	if (memcmp(want, (*ledpanel_buffer_shiftreg)[0], sizeof(want))) {
+		printf("FAIL committed image\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* level 0..3 of pixel x, y in a frame of LEDPANEL_FRC_BITS planes */
+static void frc_set(uint8_t *fb, unsigned int x, unsigned int y,
+		    unsigned int level)
+{
+	unsigned int i = x / 8 + LEDPANEL_U8_PITCH * y;
+
+	LEDPANEL_PLANE(fb, 0)[i] &= ~LEDPANEL_BIT(x);
+	LEDPANEL_PLANE(fb, 1)[i] &= ~LEDPANEL_BIT(x);
+	if (level & 2)
+		LEDPANEL_PLANE(fb, 0)[i] |= LEDPANEL_BIT(x);
+	if (level & 1)
+		LEDPANEL_PLANE(fb, 1)[i] |= LEDPANEL_BIT(x);
+}
+
+/* temporal dithering: a pixel of level n is lit in n of the sub-frames,
+   a flat area lights (almost) the same number of pixels in each */
+static int check_frc(void)
+{
+	static unsigned char level[LEDPANEL_PIX_HEIGHT][LEDPANEL_PIX_WIDTH];
+	unsigned int lit[LEDPANEL_FRC_SUBFRAMES];
+	unsigned int i, x, y, s, n, row, byte, min, max;
+	uint8_t mask;
+
+	ledpanel_buffer_set_frc();
+	for (i = 0; i < 5; i++) {
+		/* flat levels, then random pixels */
+		for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++) {
+			for (x = 0; x < LEDPANEL_PIX_WIDTH; x++) {
+				level[y][x] = (i < 4) ? i : (unsigned int)rand() % 4;
+				frc_set(ledpanel_buffer, x, y, level[y][x]);
+			}
+		}
+		ledpanel_buffer_commit();
+		ledpanel_buffer_flip();
+
+		memset(lit, 0, sizeof(lit));
+		for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++) {
+			for (x = 0; x < LEDPANEL_PIX_WIDTH; x++) {
+				golden_position(x, y, &row, &byte, &mask);
+				n = 0;
+				for (s = 0; s < LEDPANEL_FRC_SUBFRAMES; s++) {
+					if (!((*ledpanel_buffer_shiftreg)
+						      [s][row][byte] & mask))
+						continue;
+					lit[s]++;
+					n++;
+				}
+				if (n != level[y][x]) {
+					printf("FAIL frc pixel %u,%u level %u, "
+					       "lit %u times\n", x, y,
+					       level[y][x], n);
+					return 1;
+				}
+			}
+		}
+
+		min = max = lit[0];
+		for (s = 1; s < LEDPANEL_FRC_SUBFRAMES; s++) {
+			if (lit[s] < min)
+				min = lit[s];
+			if (lit[s] > max)
+				max = lit[s];
+		}
+		if (i < 4 && max - min > LEDPANEL_PIX_HEIGHT) {
+			printf("FAIL frc level %u, %u..%u pixels lit\n", i,
+			       min, max);
+			return 1;
+		}
+	}
+
+	ledpanel_buffer_set_planes(1);
+	if (ledpanel_buffer_subframes != 1) {
+		printf("FAIL frc still on\n");
+		return 1;
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void benchmark(void)
+{
+	static uint8_t sink[LEDPANEL_SPI_BYTES];
+	unsigned int i, n = 2000000;
+	double t;
+
+	for (i = 0; i < LEDPANEL_BUFFER_BYTES; i++)
+		ledpanel_buffer[i] = rand();
+
+	t = now();
+	for (i = 0; i < n; i++) {
+		ledpanel_buffer_prepare_shiftreg(sink, ledpanel_buffer, i & 7);
+		/* keep the compiler from dropping the loop */
+		__asm__ volatile("" : : "r"(sink) : "memory");
+	}
+	t = now() - t;
+	printf("prepare_shiftreg: %.1f ns/row\n", t / n * 1e9);
+
+	n /= 8;
+	t = now();
+	for (i = 0; i < n; i++) {
+		ledpanel_buffer_commit();
+		ledpanel_buffer_flip();
+	}
+	t = now() - t;
+	printf("commit (%u plane%s): %.1f ns/frame\n", ledpanel_buffer_planes,
+	       ledpanel_buffer_planes == 1 ? "" : "s", t / n * 1e9);
+
+	/* a ticker: the whole panel one pixel to the left, a few pixels
+	   inverted on the right */
+	t = now();
+	for (i = 0; i < n; i++) {
+		ledpanel_blit_scroll(ledpanel_buffer, 0, 0, LEDPANEL_PIX_WIDTH,
+				     LEDPANEL_PIX_HEIGHT, -1, 0);
+		ledpanel_blit_fill(ledpanel_buffer, LEDPANEL_PIX_WIDTH - 1, i % 8,
+				   1, 8, LEDPANEL_BLIT_INVERT);
+	}
+	t = now() - t;
+	printf("scroll + fill: %.1f ns/frame\n", t / n * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	int fails;
+
+	printf("%ux%u pixels, %u shiftregister bytes in %u chain(s)\n",
+	       LEDPANEL_PIX_WIDTH, LEDPANEL_PIX_HEIGHT, LEDPANEL_SPI_BYTES,
+	       LEDPANEL_CHAINS);
+
+	fails = check_mapping() + check_commit() + check_frc();
+	if (fails) {
+		printf("%d checks failed\n", fails);
+		return 1;
+	}
+	printf("mapping ok\n");
+
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		benchmark();
+	return 0;
+}
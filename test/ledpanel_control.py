@@ -2,12 +2,35 @@
 import sys
 import usb.core
 import argparse
+import struct
+import time
+import ledpanel_tools
 
 # from include/usb_if.h
 USB_IF_REQUEST_RESET_WRITEPTR=0x0000
 USB_IF_REQUEST_PANEL_ONOFF=0x0001
 USB_IF_REQUEST_PANEL_BRIGHTNESS=0x0002
 USB_IF_REQUEST_MBI5029_MODE=0x0003
+USB_IF_REQUEST_GRAY_MODE=0x0004
+USB_IF_REQUEST_BULK_MODE=0x0005
+USB_IF_REQUEST_CANVAS=0x0006
+USB_IF_REQUEST_VIEWPORT=0x0007
+USB_IF_REQUEST_STATS=0x0008
+USB_IF_REQUEST_PROFILE=0x0009
+USB_IF_REQUEST_TIMING=0x000a
+USB_IF_REQUEST_GAIN=0x000b
+USB_IF_REQUEST_GAMMA=0x000c
+USB_IF_REQUEST_SAVE=0x000d
+USB_IF_REQUEST_PLAY=0x000f
+
+# struct usb_if_stats
+USB_IF_STATS_FIELDS = ['rows', 'frames', 'shown', 'bulk_packets',
+                       'bulk_bytes', 'raw_frames', 'dma_busy',
+                       'queue_dropped', 'loops_per_sec']
+
+# enum profile_region, struct profile_stats in include/profile.h
+PROFILE_REGIONS = ['tim2_isr', 'prepare_shiftreg', 'bulkout', 'tim2_latency']
+PROFILE_BUCKETS = 16
 
 from pathlib import Path
 
@@ -17,6 +40,36 @@ parser.add_argument('--stop', action='store_true')
 parser.add_argument('--start', action='store_true')
 parser.add_argument('--bright', type=int)
 parser.add_argument('--mbi5029-mode', type=int)
+parser.add_argument('--gray', type=int,
+                    help='1: grayscale, 2: temporal dithering (2 bits), '
+                    '0: monochrome')
+parser.add_argument('--bulk-mode', type=int, help='1: framed, 0: raw frames')
+parser.add_argument('--canvas', type=int, metavar='width',
+                    help='show canvas of given width, 0: off')
+parser.add_argument('--viewport', type=int, nargs=2, metavar=('x', 'v'),
+                    help='viewport at x, moving v/256 pixels per frame')
+parser.add_argument('--refresh', type=int, metavar='Hz',
+                    help='change refresh rate')
+parser.add_argument('--spi-div', type=int, metavar='div',
+                    help='SPI clock divider 4..256 (with --refresh)')
+parser.add_argument('--modules', type=int, default=3,
+                    help='number of modules [def:%(default)d]')
+parser.add_argument('--chains', type=int, default=1, choices=[1, 2],
+                    help='LEDPANEL_CHAINS of the firmware [def:%(default)d]')
+parser.add_argument('--gain', type=lambda x: int(x, 0), nargs='+',
+                    metavar='word', help='MBI5029 configuration word, '
+                    'one for all modules, or one per module (left first)')
+parser.add_argument('--gamma', type=float,
+                    help='brightness curve exponent, e.g. 2.2, 1: linear')
+parser.add_argument('--save', action='store_true',
+                    help='store brightness, gain and gamma in flash')
+parser.add_argument('--play', type=int, choices=[0, 1],
+                    help='1: play the content store in flash, 0: stop it')
+parser.add_argument('--profile', action='store_true',
+                    help='print cycle count profile (firmware built with -DPROFILE)')
+parser.add_argument('--profile-reset', action='store_true')
+parser.add_argument('--stats', type=float, nargs='?', const=0.0,
+                    metavar='interval', help='print counters (every interval s)')
 
 args = parser.parse_args()
 
@@ -37,5 +90,75 @@ elif args.bright is not None :
     dev.ctrl_transfer(0x40, USB_IF_REQUEST_PANEL_BRIGHTNESS, args.bright)
 elif args.mbi5029_mode is not None :
     dev.ctrl_transfer(0x40, USB_IF_REQUEST_MBI5029_MODE, args.mbi5029_mode)
+elif args.gray is not None :
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_GRAY_MODE, args.gray)
+elif args.bulk_mode is not None :
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_BULK_MODE, args.bulk_mode)
+if args.canvas is not None :
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_CANVAS, args.canvas)
+if args.viewport is not None :
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_VIEWPORT, args.viewport[0],
+                      args.viewport[1] & 0xffff)
 
 
+if args.refresh is not None :
+    spi_br = 0xffff
+    if args.spi_div is not None :
+        spi_br = args.spi_div.bit_length() - 2 # 2 << br
+    try :
+        dev.ctrl_transfer(0x40, USB_IF_REQUEST_TIMING, args.refresh, spi_br)
+    except usb.core.USBError :
+        print('Timing refused, rows would not fit in the refresh period!')
+        sys.exit(1)
+if args.gain is not None :
+    if len(args.gain) == 1 :
+        args.gain *= args.modules
+    if len(args.gain) != args.modules :
+        print('Need one gain for all or for each of the modules!')
+        sys.exit(1)
+    words = [0] * (args.modules * ledpanel_tools.STRIPES *
+                   ledpanel_tools.MODULE_BYTES // 2)
+    for module, gain in enumerate(args.gain) :
+        for drv in ledpanel_tools.module_drivers(module, args.modules,
+                                                 args.chains) :
+            words[drv] = gain
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_GAIN, 0, 0,
+                      struct.pack('<%dH' % len(words), *words))
+if args.gamma is not None :
+    curve = ledpanel_tools.gamma_curve(args.gamma)
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_GAMMA, 0, 0,
+                      struct.pack('<%dH' % len(curve), *curve))
+if args.save :
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_SAVE)
+if args.play is not None :
+    try :
+        dev.ctrl_transfer(0x40, USB_IF_REQUEST_PLAY, args.play)
+    except usb.core.USBError :
+        print('Nothing to play, no valid content in flash!')
+        sys.exit(1)
+if args.profile_reset :
+    dev.ctrl_transfer(0x40, USB_IF_REQUEST_PROFILE)
+if args.profile :
+    fmt = '<%dI' % (3 + PROFILE_BUCKETS)
+    for i, name in enumerate(PROFILE_REGIONS) :
+        data = dev.ctrl_transfer(0xc0, USB_IF_REQUEST_PROFILE, 0, i,
+                                 struct.calcsize(fmt))
+        count, cmin, cmax, *hist = struct.unpack(fmt, data)
+        if not count :
+            print('%-18s no samples' % name)
+            continue
+        print('%-18s n=%d min=%d max=%d jitter=%d cycles' % (
+              name, count, cmin, cmax, cmax - cmin))
+        for b, n in enumerate(hist) :
+            if n :
+                print('    <%6d: %d' % (1 << b, n))
+if args.stats is not None :
+    fmt = '<%dI' % len(USB_IF_STATS_FIELDS)
+    while True :
+        data = dev.ctrl_transfer(0xc0, USB_IF_REQUEST_STATS, 0, 0,
+                                 struct.calcsize(fmt))
+        stats = dict(zip(USB_IF_STATS_FIELDS, struct.unpack(fmt, data)))
+        print(' '.join('%s=%d' % kv for kv in stats.items()))
+        if not args.stats :
+            break
+        time.sleep(args.stats)
@@ -0,0 +1,249 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * Host (Linux) check and benchmark for host/ledpanel_dither.c, see
+ * host_check.sh. With -b, conversion speed is measured on random
+ * frames, or on a raw 8 bit gray video (like badapple.raw written by
+ * badapple.sh) of the panel's size given after -b.
+ */
+
+#include "ledpanel_dither.h"
+#include "ledpanel_buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define W LEDPANEL_PIX_WIDTH
+#define H LEDPANEL_PIX_HEIGHT
+
+static const char *mode_name[] = { "none", "ordered", "diffusion" };
+
+/* a single lit pixel has to end up at LEDPANEL_BIT() in all planes */
+static int check_layout(void)
+{
+	static uint8_t src[W * H], dst[4 * LEDPANEL_WIRE_BYTES];
+	struct ledpanel_dither d;
+	unsigned int x, y, plane, i;
+	uint8_t want;
+
+	ledpanel_dither_init(&d, W, H, 4, LEDPANEL_DITHER_NONE);
+	for (y = 0; y < H; y++) {
+		for (x = 0; x < W; x++) {
+			memset(src, 0, sizeof(src));
+			src[y * W + x] = 0x55; /* level 5: planes 1 and 3 */
+			ledpanel_dither_frame(&d, dst, src, W);
+			for (plane = 0; plane < 4; plane++) {
+				for (i = 0; i < LEDPANEL_WIRE_BYTES; i++) {
+					want = (plane & 1 && i == y *
+						LEDPANEL_PIX_BYTES + x / 8) ?
+						LEDPANEL_BIT(x) : 0;
+					if (dst[plane * LEDPANEL_WIRE_BYTES +
+						i] == want)
+						continue;
+					printf("FAIL layout, pixel %u,%u\n", x, y);
+					ledpanel_dither_free(&d);
+					return 1;
+				}
+			}
+		}
+	}
+	ledpanel_dither_free(&d);
+	return 0;
+}
+
+/* SSE2 and plain C have to give the same result, also for a width
+   that's not a multiple of 16 */
+static int check_simd(void)
+{
+	static uint8_t src[(W + 4) * H], a[8 * (W / 8 + 1) * H];
+	static uint8_t b[sizeof(a)];
+	struct ledpanel_dither d;
+	unsigned int bits, mode, w, i;
+	int fails = 0;
+
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = rand();
+	for (w = W; w <= W + 4; w += 4) {
+		for (mode = 0; mode < 3; mode++) {
+			for (bits = 1; bits <= 8; bits++) {
+				ledpanel_dither_init(&d, w, H, bits, mode);
+				ledpanel_dither_simd = 1;
+				ledpanel_dither_frame(&d, a, src, w);
+				ledpanel_dither_simd = 0;
+				ledpanel_dither_frame(&d, b, src, w);
+				ledpanel_dither_simd = 1;
+				ledpanel_dither_free(&d);
+				if (!memcmp(a, b, bits * ((w + 7) / 8) * H))
+					continue;
+				printf("FAIL simd, width %u, %s, %u bits\n", w,
+				       mode_name[mode], bits);
+				fails++;
+			}
+		}
+	}
+	return fails;
+}
+
+/* flat gray has to come out with the right share of pixels lit */
+static int check_gray(void)
+{
+	static uint8_t src[W * H], dst[LEDPANEL_WIRE_BYTES];
+	struct ledpanel_dither d;
+	unsigned int mode, v, i, on;
+	double want, got;
+	int fails = 0;
+
+	for (mode = LEDPANEL_DITHER_ORDERED; mode <= LEDPANEL_DITHER_DIFFUSION;
+	     mode++) {
+		ledpanel_dither_init(&d, W, H, 1, mode);
+		for (v = 0; v < 256; v++) {
+			memset(src, v, sizeof(src));
+			ledpanel_dither_frame(&d, dst, src, W);
+			for (i = on = 0; i < sizeof(dst); i++)
+				on += __builtin_popcount(dst[i]);
+			want = v / 255.0;
+			got = (double)on / (W * H);
+			if (got - want < 0.03 && want - got < 0.03)
+				continue;
+			printf("FAIL %s, gray %u: %.3f lit, want %.3f\n",
+			       mode_name[mode], v, got, want);
+			fails++;
+			break;
+		}
+		ledpanel_dither_free(&d);
+	}
+	return fails;
+}
+
+/* black and white have to stay all off and all on, at any depth */
+static int check_extremes(void)
+{
+	static uint8_t src[W * H], dst[8 * LEDPANEL_WIRE_BYTES];
+	struct ledpanel_dither d;
+	unsigned int mode, bits, v, i;
+	int fails = 0;
+
+	for (mode = 0; mode < 3; mode++) {
+		for (bits = 1; bits <= 8; bits++) {
+			ledpanel_dither_init(&d, W, H, bits, mode);
+			for (v = 0; v <= 255; v += 255) {
+				memset(src, v, sizeof(src));
+				ledpanel_dither_frame(&d, dst, src, W);
+				for (i = 0; i < bits * LEDPANEL_WIRE_BYTES; i++)
+					if (dst[i] != v)
+						break;
+				if (i == bits * LEDPANEL_WIRE_BYTES)
+					continue;
+				printf("FAIL %s, %u bits, gray %u\n",
+				       mode_name[mode], bits, v);
+				fails++;
+			}
+			ledpanel_dither_free(&d);
+		}
+	}
+	return fails;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void benchmark(const char *video)
+{
+	static uint8_t dst[8 * LEDPANEL_WIRE_BYTES];
+	unsigned int nframes = 2000, bits, mode, simd, i;
+	struct ledpanel_dither d;
+	uint8_t *src;
+	double t;
+	FILE *f;
+
+	if (video) {
+		f = fopen(video, "rb");
+		if (!f) {
+			perror(video);
+			return;
+		}
+		fseek(f, 0, SEEK_END);
+		nframes = ftell(f) / (W * H);
+		rewind(f);
+		src = malloc(nframes * W * H + 1);
+		if (!src || fread(src, W * H, nframes, f) != nframes) {
+			printf("could not read %s\n", video);
+			fclose(f);
+			free(src);
+			return;
+		}
+		fclose(f);
+	} else {
+		src = malloc(nframes * W * H);
+		for (i = 0; src && i < nframes * W * H; i++)
+			src[i] = rand();
+	}
+	if (!src || !nframes)
+		return;
+
+	for (bits = 1; bits <= 4; bits += 3) {
+		for (mode = 0; mode < 3; mode++) {
+			for (simd = 0; simd < 2; simd++) {
+				ledpanel_dither_simd = simd;
+				ledpanel_dither_init(&d, W, H, bits, mode);
+				t = now();
+				for (i = 0; i < nframes; i++) {
+					ledpanel_dither_frame(&d, dst,
+							      &src[i * W * H], W);
+					__asm__ volatile("" : : "r"(dst) : "memory");
+				}
+				t = now() - t;
+				ledpanel_dither_free(&d);
+				printf("dither %-9s %u bit%s %-5s: %9.0f frames/s\n",
+				       mode_name[mode], bits, bits == 1 ? " " : "s",
+				       simd ? "simd" : "plain", nframes / t);
+			}
+		}
+	}
+	ledpanel_dither_simd = 1;
+	free(src);
+}
+
+int main(int argc, char **argv)
+{
+	int fails;
+
+	srand(1);
+	fails = check_layout() + check_simd() + check_gray() +
+		check_extremes();
+	if (fails) {
+		printf("%d checks failed\n", fails);
+		return 1;
+	}
+	printf("dither ok\n");
+
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		benchmark(argc > 2 ? argv[2] : NULL);
+	return 0;
+}
@@ -0,0 +1,716 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * Host (Linux) check of the host library in host/, see host_check.sh.
+ * Its mock transport feeds the bulk stream to the firmware's own
+ * decoder (src/usb_proto.c), which has to end up with the frames sent.
+ */
+
+#include "ledpanel_host.h"
+#include "ledpanel_buffer.h"
+#include "ledpanel_canvas.h"
+#include "ledpanel_font.h"
+#include "hw_matrix.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAMES 200
+
+/* the refresh picks up a commit whenever the decoder waits for it */
+static void sink(void *arg, const uint8_t *buf, unsigned int len)
+{
+	unsigned int n;
+
+	(void)arg;
+	while (len) {
+		n = usb_proto_feed(buf, len);
+		buf += n;
+		len -= n;
+		if (len)
+			ledpanel_buffer_flip();
+	}
+}
+
+/* everything has been sent, let the decoder finish a commit still
+   waiting for the refresh */
+static void settle(void)
+{
+	ledpanel_buffer_flip();
+	usb_proto_feed(NULL, 0);
+	ledpanel_buffer_flip();
+}
+
+/*
+ * Frames on the host side are packed (p->pitch == LEDPANEL_PIX_BYTES),
+ * ledpanel_buffer might have padding at the end of each row
+ * (LEDPANEL_WORD_ALIGNED).
+ */
+static void buffer_get(uint8_t *fb, unsigned int planes)
+{
+	unsigned int r;
+
+	for (r = 0; r < planes * LEDPANEL_PIX_HEIGHT; r++)
+		memcpy(&fb[LEDPANEL_PIX_BYTES * r],
+		       &ledpanel_buffer[LEDPANEL_U8_PITCH * r],
+		       LEDPANEL_PIX_BYTES);
+}
+
+static void buffer_put(const uint8_t *fb, unsigned int planes)
+{
+	unsigned int r;
+
+	for (r = 0; r < planes * LEDPANEL_PIX_HEIGHT; r++)
+		memcpy(&ledpanel_buffer[LEDPANEL_U8_PITCH * r],
+		       &fb[LEDPANEL_PIX_BYTES * r], LEDPANEL_PIX_BYTES);
+}
+
+static int buffer_equal(const uint8_t *fb, unsigned int planes)
+{
+	static uint8_t got[LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES];
+
+	buffer_get(got, planes);
+	return !memcmp(got, fb, planes * LEDPANEL_WIRE_BYTES);
+}
+
+/* mostly static content, like text or a video */
+static void next_frame(uint8_t *fb, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len / 16; i++)
+		fb[rand() % len] = rand();
+}
+
+static int check_packbits(struct ledpanel *p, struct ledpanel_mock *m)
+{
+	static uint8_t frame[LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES];
+	static uint8_t prev[sizeof(frame)];
+	uint32_t shown;
+	unsigned int i;
+
+	memset(frame, 0, sizeof(frame));
+	shown = ledpanel_buffer_shown;
+	for (i = 0; i < FRAMES; i++) {
+		memcpy(prev, frame, p->frame_bytes);
+		next_frame(frame, p->frame_bytes);
+		if (ledpanel_packbits(p, frame, i ? prev : NULL) < 0 ||
+		    ledpanel_flush(p) < 0) {
+			printf("FAIL packbits, frame %u\n", i);
+			return 1;
+		}
+	}
+	ledpanel_sync(p);
+	settle();
+
+	if (!buffer_equal(frame, p->planes)) {
+		printf("FAIL packbits, %u planes: wrong frame\n", p->planes);
+		return 1;
+	}
+	if (ledpanel_buffer_shown - shown != FRAMES) {
+		printf("FAIL packbits: %u of %u frames committed\n",
+		       ledpanel_buffer_shown - shown, FRAMES);
+		return 1;
+	}
+	if (m->max_pending != LEDPANEL_HOST_XFERS) {
+		printf("FAIL only %u transfers in flight\n", m->max_pending);
+		return 1;
+	}
+	return 0;
+}
+
+/* random rectangles, packed into as few transfers as possible */
+static int check_patch(struct ledpanel *p)
+{
+	static uint8_t want[LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES];
+	unsigned int i, x, y, w, h, plane, row, col;
+	uint8_t *dst;
+
+	buffer_get(want, p->planes);
+	for (i = 0; i < FRAMES; i++) {
+		w = 1 + rand() % p->pitch;
+		h = 1 + rand() % p->height;
+		x = rand() % (p->pitch - w + 1);
+		y = rand() % (p->height - h + 1);
+		dst = ledpanel_patch(p, x, y, w, h, i == FRAMES - 1);
+		if (!dst) {
+			printf("FAIL patch %u\n", i);
+			return 1;
+		}
+		for (plane = 0; plane < p->planes; plane++)
+			for (row = y; row < y + h; row++)
+				for (col = x; col < x + w; col++)
+					*dst++ = want[LEDPANEL_WIRE_BYTES * plane +
+						      row * p->pitch + col] = rand();
+	}
+	ledpanel_sync(p);
+	settle();
+
+	if (!buffer_equal(want, p->planes) ||
+	    !ledpanel_buffer_sync()) {
+		printf("FAIL patch, %u planes\n", p->planes);
+		return 1;
+	}
+	return 0;
+}
+
+/* pixel in a packed frame */
+static int get_pixel(const uint8_t *fb, unsigned int plane, unsigned int x,
+		     unsigned int y)
+{
+	return !!(fb[LEDPANEL_WIRE_BYTES * plane + LEDPANEL_PIX_BYTES * y +
+		     x / 8] & LEDPANEL_BIT(x));
+}
+
+static void put_pixel(uint8_t *fb, unsigned int plane, unsigned int x,
+		      unsigned int y, int set)
+{
+	uint8_t *b = &fb[LEDPANEL_WIRE_BYTES * plane + LEDPANEL_PIX_BYTES * y +
+			 x / 8];
+
+	if (set)
+		*b |= LEDPANEL_BIT(x);
+	else
+		*b &= ~LEDPANEL_BIT(x);
+}
+
+/* pixel by pixel from the atlas, with the same clipping and alignment */
+static void golden_text(uint8_t *fb, unsigned int planes, int x, int y,
+			unsigned int font, const char *s)
+{
+	const struct ledpanel_font *f =
+		&ledpanel_fonts[font & USB_PROTO_TEXT_FONT];
+	unsigned int g, w, col, row, c, px, py, plane, i;
+	int set;
+
+	w = 0;
+	for (i = 0; s[i]; i++) {
+		g = (uint8_t)s[i] - f->first;
+		w += (f->x[g + 1] - f->x[g] + f->spacing) * f->scale;
+	}
+	w -= f->spacing * f->scale;
+	if (font & USB_PROTO_TEXT_CENTER)
+		x -= (int)w / 2;
+	else if (font & USB_PROTO_TEXT_RIGHT)
+		x -= w;
+
+	for (; *s; s++) {
+		g = (uint8_t)*s - f->first;
+		w = f->x[g + 1] - f->x[g];
+		for (row = 0; row < f->height; row++) {
+			for (col = 0; col < w + f->spacing; col++) {
+				c = f->x[g] + col;
+				set = col < w && (f->atlas[f->pitch * row + c / 8] &
+						  (0x80 >> (c % 8)));
+				if (font & USB_PROTO_TEXT_INVERT)
+					set = !set;
+				if (!set && !(font & USB_PROTO_TEXT_OPAQUE))
+					continue;
+				for (i = 0; i < f->scale * f->scale; i++) {
+					px = x + col * f->scale + i % f->scale;
+					py = y + row * f->scale + i / f->scale;
+					if (px >= LEDPANEL_PIX_WIDTH ||
+					    py >= LEDPANEL_PIX_HEIGHT)
+						continue; /* also < 0 */
+					for (plane = 0; plane < planes; plane++)
+						put_pixel(fb, plane, px, py, set);
+				}
+			}
+		}
+		x += (w + f->spacing) * f->scale;
+	}
+}
+
+/* text drawn by the firmware, on top of random pixels */
+static int check_text(struct ledpanel *p)
+{
+	static const struct {
+		int x, y;
+		unsigned int font;
+		const char *s;
+	} t[] = {
+		{ 0, 0, LEDPANEL_FONT_5X8, "Hello, World!" },
+		{ -3, 11, LEDPANEL_FONT_5X8 | USB_PROTO_TEXT_OPAQUE, "gjpqy{|}~" },
+		{ LEDPANEL_PIX_WIDTH / 2, 2, LEDPANEL_FONT_10X16 |
+		  USB_PROTO_TEXT_CENTER | USB_PROTO_TEXT_OPAQUE, "Ostbhf" },
+		{ LEDPANEL_PIX_WIDTH + 4, -5, LEDPANEL_FONT_10X16 |
+		  USB_PROTO_TEXT_RIGHT | USB_PROTO_TEXT_INVERT, "#42 @ 9:41" },
+		{ -7, 15, LEDPANEL_FONT_5X8 | USB_PROTO_TEXT_OPAQUE |
+		  USB_PROTO_TEXT_INVERT, "_[W]_" },
+	};
+	static uint8_t want[LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES];
+	unsigned int i, j;
+
+	for (i = 0; i < sizeof(t) / sizeof(t[0]); i++) {
+		for (j = 0; j < p->frame_bytes; j++)
+			want[j] = rand();
+		buffer_put(want, p->planes);
+		golden_text(want, p->planes, t[i].x, t[i].y, t[i].font, t[i].s);
+		if (ledpanel_text(p, t[i].x, t[i].y, t[i].font, t[i].s, 1) < 0)
+			return 1;
+		ledpanel_sync(p);
+		settle();
+		if (!buffer_equal(want, p->planes)) {
+			printf("FAIL text \"%s\", %u planes\n", t[i].s,
+			       p->planes);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* FILL and SCROLL against pixel by pixel versions */
+static int check_blit(struct ledpanel *p)
+{
+	static uint8_t want[LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES];
+	static uint8_t orig[sizeof(want)];
+	int x, y, w, h, dx, dy, px, py, sx, sy, in;
+	unsigned int i, j, op, plane;
+
+	for (i = 0; i < FRAMES; i++) {
+		for (j = 0; j < p->frame_bytes; j++)
+			want[j] = orig[j] = rand();
+		buffer_put(want, p->planes);
+
+		/* partly off the panel now and then */
+		x = rand() % (LEDPANEL_PIX_WIDTH + 20) - 10;
+		y = rand() % (LEDPANEL_PIX_HEIGHT + 10) - 5;
+		w = rand() % LEDPANEL_PIX_WIDTH + 1;
+		h = rand() % LEDPANEL_PIX_HEIGHT + 1;
+		dx = rand() % 81 - 40;
+		dy = rand() % 9 - 4;
+		op = rand() % 3;
+
+		for (py = 0; py < LEDPANEL_PIX_HEIGHT; py++) {
+			for (px = 0; px < LEDPANEL_PIX_WIDTH; px++) {
+				if (px < x || px >= x + w || py < y ||
+				    py >= y + h)
+					continue;
+				sx = px - dx;
+				sy = py - dy;
+				in = sx >= x && sx < x + w && sy >= y &&
+				     sy < y + h && sx >= 0 &&
+				     sx < LEDPANEL_PIX_WIDTH && sy >= 0 &&
+				     sy < LEDPANEL_PIX_HEIGHT;
+				for (plane = 0; plane < p->planes; plane++) {
+					if (i % 2)
+						put_pixel(want, plane, px, py,
+							  op == 1 ||
+							  (op == 2 &&
+							   !get_pixel(orig, plane,
+								      px, py)));
+					else
+						put_pixel(want, plane, px, py,
+							  in && get_pixel(orig, plane,
+									  sx, sy));
+				}
+			}
+		}
+
+		if ((i % 2 ? ledpanel_fill(p, x, y, w, h, op, 1) :
+			     ledpanel_scroll(p, x, y, w, h, dx, dy, 1)) < 0)
+			return 1;
+		ledpanel_sync(p);
+		settle();
+		if (!buffer_equal(want, p->planes)) {
+			printf("FAIL %s %d,%d %dx%d (%d,%d op %u), %u planes\n",
+			       i % 2 ? "fill" : "scroll", x, y, w, h, dx, dy,
+			       op, p->planes);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* the part of the firmware behind the content store requests, with the
+   flash in RAM */
+static uint8_t flash[16384];
+
+static void control(void *arg, uint8_t request, uint16_t value,
+		    uint16_t index, const uint8_t *data, uint16_t len)
+{
+	(void)arg;
+	(void)index;
+	if (request == USB_IF_REQUEST_STORE) {
+		ledpanel_store_open(NULL, 0);
+		if (!value)
+			memset(flash, 0xff, sizeof(flash));
+		memcpy(&flash[value * 4], data, len);
+	} else if (request == USB_IF_REQUEST_PLAY) {
+		if (!value || ledpanel_store_open(flash, sizeof(flash)) == 0)
+			ledpanel_store_play(value);
+	} else if (request == USB_IF_REQUEST_GRAY_MODE) {
+		ledpanel_store_host();
+		hw_matrix_grayscale(value);
+		usb_if_reset_bulk();
+	}
+}
+
+int hw_matrix_grayscale(int mode)
+{
+	ledpanel_buffer_set_planes(mode == HW_MATRIX_GRAY ?
+				   LEDPANEL_GRAY_BITS : 1);
+	return 0;
+}
+
+/* the framed part of the firmware's bulk state */
+void usb_if_reset_bulk(void)
+{
+	usb_proto_reset();
+}
+
+/* bulk data kept back instead of sent to the decoder */
+static uint8_t captured[LEDPANEL_GRAY_BITS * LEDPANEL_WIRE_BYTES + 64];
+static unsigned int captured_len;
+
+static void capture(void *arg, const uint8_t *buf, unsigned int len)
+{
+	(void)arg;
+	if (len > sizeof(captured) - captured_len)
+		len = sizeof(captured) - captured_len;
+	memcpy(&captured[captured_len], buf, len);
+	captured_len += len;
+}
+
+/* a full frame PATCH of all planes, set to v */
+static int send_patch(struct ledpanel *p, uint8_t v)
+{
+	uint8_t *dst = ledpanel_patch(p, 0, 0, LEDPANEL_PIX_BYTES,
+				      LEDPANEL_PIX_HEIGHT, 1);
+
+	if (!dst)
+		return -1;
+	memset(dst, v, p->frame_bytes);
+	if (ledpanel_flush(p) < 0)
+		return -1;
+	return ledpanel_sync(p);
+}
+
+/* fb (packed) is what the refresh shows */
+static int shown_equal(const uint8_t *fb)
+{
+	static uint8_t mem[LEDPANEL_BUFFER_BYTES];
+	uint8_t sr[LEDPANEL_SPI_BYTES];
+	unsigned int row;
+
+	for (row = 0; row < LEDPANEL_PIX_HEIGHT; row++)
+		memcpy(&mem[LEDPANEL_U8_PITCH * row], &fb[LEDPANEL_PIX_BYTES * row],
+		       LEDPANEL_PIX_BYTES);
+	for (row = 0; row < LEDPANEL_ROWS; row++) {
+		ledpanel_buffer_prepare_shiftreg(sr, mem, row);
+		if (memcmp(sr, (*ledpanel_buffer_shiftreg)[0][row], sizeof(sr)))
+			return 0;
+	}
+	return 1;
+}
+
+static int get_strip(const uint8_t *strip, unsigned int w, unsigned int x,
+		     unsigned int y)
+{
+	x %= w;
+	return !!(strip[w / 8 * y + x / 8] & LEDPANEL_BIT(x));
+}
+
+/* one refresh frame of the main loop */
+static void store_frame(void)
+{
+	ledpanel_store_poll();
+	ledpanel_canvas_poll();
+	ledpanel_buffer_flip();
+}
+
+/* frames, text and a strip played from a store image, the host taking
+   over and the panel playing again once it is quiet */
+static int check_store(struct ledpanel *p, struct ledpanel_mock *m)
+{
+	enum { FRAME_N = 3, TEXT_N = 2, STRIP_N = 5, STRIP_X = 12 };
+	static uint8_t img[sizeof(flash)], frame[LEDPANEL_WIRE_BYTES];
+	static uint8_t text[LEDPANEL_WIRE_BYTES], window[LEDPANEL_WIRE_BYTES];
+	static uint8_t strip[(LEDPANEL_PIX_BYTES + 2) * LEDPANEL_PIX_HEIGHT];
+	const unsigned int strip_w = (LEDPANEL_PIX_BYTES + 2) * 8;
+	const unsigned int font = LEDPANEL_FONT_5X8 | USB_PROTO_TEXT_CENTER;
+	const struct ledpanel_store_entry e[] = {
+		{ LEDPANEL_STORE_FRAME, 0, FRAME_N, sizeof(frame), 0, 0, 0 },
+		{ LEDPANEL_STORE_TEXT, font, TEXT_N, 5,
+		  LEDPANEL_PIX_WIDTH / 2, 6, 0 },
+		{ LEDPANEL_STORE_STRIP, 0, STRIP_N, sizeof(strip), STRIP_X, 0,
+		  -256 },
+	};
+	const void *payload[] = { frame, "Hello", strip };
+	unsigned int i, j, x, y, px, len = 0;
+	uint32_t shown;
+
+	for (i = 0; i < sizeof(frame); i++)
+		frame[i] = rand();
+	for (i = 0; i < sizeof(strip); i++)
+		strip[i] = rand();
+	memset(text, 0, sizeof(text));
+	golden_text(text, 1, LEDPANEL_PIX_WIDTH / 2, 6, font, "Hello");
+
+	for (i = 0; i < 3; i++)
+		if (ledpanel_image_add(img, sizeof(img), &len, &e[i],
+				       payload[i]) < 0)
+			return 1;
+	ledpanel_image_finish(img, len, 1);
+
+	/* a corrupt image is never played */
+	m->control = control;
+	img[len - 1] ^= 1;
+	if (ledpanel_upload(p, img, len) < 0 || ledpanel_store_play(1) == 0) {
+		printf("FAIL store, corrupt image played\n");
+		return 1;
+	}
+	img[len - 1] ^= 1;
+
+	if (ledpanel_upload(p, img, len) < 0 ||
+	    m->request != USB_IF_REQUEST_PLAY) {
+		printf("FAIL store upload\n");
+		return 1;
+	}
+
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < FRAME_N + TEXT_N + STRIP_N; i++) {
+			store_frame();
+			if (i < FRAME_N) {
+				memcpy(window, frame, sizeof(window));
+			} else if (i < FRAME_N + TEXT_N) {
+				memcpy(window, text, sizeof(window));
+			} else {
+				/* moving left, one pixel per frame */
+				x = STRIP_X + strip_w -
+				    (i - FRAME_N - TEXT_N) % strip_w;
+				for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++)
+					for (px = 0; px < LEDPANEL_PIX_WIDTH; px++)
+						put_pixel(window, 0, px, y,
+							  get_strip(strip, strip_w,
+								    x + px, y));
+			}
+			if (!shown_equal(window)) {
+				printf("FAIL store, frame %u\n", i);
+				return 1;
+			}
+		}
+	}
+
+	/* the host takes over, the store plays again after a second */
+	ledpanel_store_host();
+	for (i = 0; i < 3; i++)
+		store_frame();
+	shown = ledpanel_buffer_shown;
+	for (i = 0; i < 9; i++) {
+		ledpanel_store_tick();
+		store_frame();
+	}
+	if (ledpanel_buffer_shown != shown) {
+		printf("FAIL store, played while the host is active\n");
+		return 1;
+	}
+	ledpanel_store_tick();
+	store_frame();
+	if (!shown_equal(frame)) {
+		printf("FAIL store, not played again\n");
+		return 1;
+	}
+
+	/* the host streams gray, and goes quiet in the middle of the first
+	   plane of a frame. The store plays in mono, the rest of that frame
+	   is dropped */
+	if (ledpanel_gray_mode(p, LEDPANEL_GRAY_BITS) < 0) {
+		printf("FAIL store, gray mode request\n");
+		return 1;
+	}
+	m->sink = capture;
+	captured_len = 0;
+	if (send_patch(p, 0xff) < 0)
+		return 1;
+	m->sink = sink;
+	ledpanel_store_host();
+	sink(NULL, captured, captured_len / LEDPANEL_GRAY_BITS / 2);
+	for (i = 0; i < 10; i++) {
+		ledpanel_store_tick();
+		store_frame();
+	}
+	if (ledpanel_buffer_planes != 1 || !shown_equal(frame)) {
+		printf("FAIL store, not played after a partial gray frame\n");
+		return 1;
+	}
+
+	/* more gray data, refused by the mono panel, until the host sets
+	   its mode again */
+	ledpanel_store_host();
+	if (send_patch(p, 0xff) < 0)
+		return 1;
+	settle();
+	if (!shown_equal(frame)) {
+		printf("FAIL store, gray data shown in mono\n");
+		return 1;
+	}
+	if (ledpanel_gray_mode(p, LEDPANEL_GRAY_BITS) < 0 ||
+	    check_packbits(p, m))
+		return 1;
+
+	ledpanel_store_play(0);
+	m->control = NULL;
+	return 0;
+}
+
+/*
+ * Recording for the simulator (test/sim/), played to the real firmware:
+ * raw and PackBits frames, monochrome and gray, a timing change, and the
+ * frames it has to show in that order, 8 bit gray.
+ */
+#define RECORD_FRAMES 12
+/* changed while running at the end, SPI_CR1_BR_FPCLK_DIV_8 */
+#define RECORD_REFRESH 200
+#define RECORD_SPI_BR 2
+
+static void expect_frame(FILE *f, const uint8_t *fb, unsigned int planes)
+{
+	unsigned int x, y, plane, level;
+
+	for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++) {
+		for (x = 0; x < LEDPANEL_PIX_WIDTH; x++) {
+			level = 0;
+			for (plane = 0; plane < planes; plane++)
+				level = level << 1 | get_pixel(fb, plane, x, y);
+			fputc(level * 255 / ((1 << planes) - 1), f);
+		}
+	}
+}
+
+static int record_frames(struct ledpanel *p, FILE *f, int packbits)
+{
+	static uint8_t frame[LEDPANEL_GRAY_BITS * LEDPANEL_BUFFER_BYTES];
+	static uint8_t prev[sizeof(frame)];
+	unsigned int i;
+	uint8_t *raw;
+
+	for (i = 0; i < RECORD_FRAMES; i++) {
+		memcpy(prev, frame, p->frame_bytes);
+		next_frame(frame, p->frame_bytes);
+		if (packbits) {
+			if (ledpanel_packbits(p, frame, i ? prev : NULL) < 0)
+				return -1;
+		} else {
+			raw = ledpanel_raw_frame(p);
+			if (!raw)
+				return -1;
+			memcpy(raw, frame, p->frame_bytes);
+		}
+		if (ledpanel_flush(p) < 0)
+			return -1;
+		expect_frame(f, frame, p->planes);
+	}
+	return 0;
+}
+
+static int record(const char *path, const char *expect_path)
+{
+	FILE *f = fopen(expect_path, "wb");
+	uint16_t gain[HW_MATRIX_DRIVERS];
+	struct ledpanel p;
+	unsigned int i;
+	int ret = -1;
+
+	for (i = 0; i < HW_MATRIX_DRIVERS; i++)
+		gain[i] = 0xff00 | i;
+	if (f && ledpanel_open_record(&p, LEDPANEL_MODULES, path) == 0) {
+		if (ledpanel_bulk_mode(&p, 0) == 0 &&
+		    ledpanel_reset_writeptr(&p) == 0 &&
+		    record_frames(&p, f, 0) == 0 &&
+		    ledpanel_gain(&p, 0, gain, HW_MATRIX_DRIVERS) == 0 &&
+		    ledpanel_gray_mode(&p, LEDPANEL_GRAY_BITS) == 0 &&
+		    ledpanel_reset_writeptr(&p) == 0 &&
+		    record_frames(&p, f, 0) == 0 &&
+		    ledpanel_bulk_mode(&p, 1) == 0 &&
+		    record_frames(&p, f, 1) == 0 &&
+		    ledpanel_gray_mode(&p, 0) == 0 &&
+		    record_frames(&p, f, 1) == 0 &&
+		    ledpanel_timing(&p, RECORD_REFRESH, RECORD_SPI_BR) == 0 &&
+		    record_frames(&p, f, 1) == 0)
+			ret = 0;
+		ledpanel_close(&p);
+	}
+	if (f)
+		fclose(f);
+	if (ret < 0)
+		printf("FAIL recording %s\n", path);
+	return ret;
+}
+
+/* ./host_check [recording expected]: write a recording only */
+int main(int argc, char **argv)
+{
+	struct ledpanel_mock m = { .sink = sink };
+	struct ledpanel p;
+	int fails = 0;
+
+	if (argc == 3)
+		return record(argv[1], argv[2]) < 0;
+
+	ledpanel_buffer_init();
+	if (ledpanel_open_mock(&p, LEDPANEL_MODULES, &m) < 0 ||
+	    p.frame_bytes != LEDPANEL_WIRE_BYTES) {
+		printf("FAIL open\n");
+		return 1;
+	}
+	srand(1);
+
+	fails += check_packbits(&p, &m);
+	fails += check_patch(&p);
+	fails += check_text(&p);
+	fails += check_blit(&p);
+
+	/* grayscale, the firmware switches on the request */
+	if (ledpanel_gray_mode(&p, LEDPANEL_GRAY_BITS) < 0 ||
+	    m.request != USB_IF_REQUEST_GRAY_MODE || m.value != 1) {
+		printf("FAIL gray mode request\n");
+		fails++;
+	}
+	ledpanel_buffer_set_planes(LEDPANEL_GRAY_BITS);
+	fails += check_packbits(&p, &m);
+	fails += check_patch(&p);
+	fails += check_text(&p);
+	fails += check_blit(&p);
+
+	/* temporal dithering, frames of two planes */
+	if (ledpanel_frc_mode(&p) < 0 || m.value != 2 ||
+	    p.planes != LEDPANEL_FRC_BITS) {
+		printf("FAIL frc mode request\n");
+		fails++;
+	}
+	ledpanel_buffer_set_frc();
+	fails += check_packbits(&p, &m);
+	fails += check_patch(&p);
+
+	/* content store, back to monochrome */
+	fails += check_store(&p, &m);
+
+	ledpanel_close(&p);
+	if (fails) {
+		printf("%d checks failed\n", fails);
+		return 1;
+	}
+	printf("host library ok\n");
+	return 0;
+}
@@ -15,6 +15,14 @@ parser.add_argument('-W', '--width', metavar='pixels',
                     type=int, default=120, help='width [def:%(default)d]')
 parser.add_argument('-H', '--height', metavar='pixels',
                     type=int, default=20, help='height [def:%(default)d]')
+parser.add_argument('-p', '--patch', action='store_true',
+                    help='only send changed part of the image')
+parser.add_argument('-c', '--canvas', action='store_true',
+                    help='upload image to canvas, scroll on the device')
+parser.add_argument('-s', '--speed', metavar='pix/s', type=float,
+                    default=40.0, help='canvas scroll speed [def:%(default).0f]')
+parser.add_argument('-r', '--refresh', metavar='Hz', type=int, default=250,
+                    help='panel refresh rate, HW_MATRIX_REFRESH [def:%(default)d]')
 
 args = parser.parse_args()
 
@@ -41,9 +49,31 @@ if img.size[0] < args.width :
 
 # any control transfer will reset the write pointer ;-)
 dev.ctrl_transfer(0x40, 0)
+# USB_IF_REQUEST_BULK_MODE: raw frames or framed commands
+dev.ctrl_transfer(0x40, 5, 1 if args.patch else 0)
 
+if args.canvas :
+    # canvas width has to be a multiple of 8
+    canvas_width = (img.size[0] + 7) // 8 * 8
+    img_canvas = PIL.Image.new('L', (canvas_width, args.height))
+    img_canvas.paste(img.convert('L'), (0, 0))
+    dev.ctrl_transfer(0x40, 5, 1)
+    dev.write(0x01, ledpanel_tools.proto_canvas(
+        ledpanel_tools.image_to_ledpanel_bytes(img_canvas), args.height))
+    # USB_IF_REQUEST_CANVAS, USB_IF_REQUEST_VIEWPORT
+    dev.ctrl_transfer(0x40, 6, canvas_width)
+    v = round(args.speed * 256 / args.refresh)
+    dev.ctrl_transfer(0x40, 7, 0, v & 0xffff)
+    sys.exit(0)
+
+prev = None
 for dx in range(img.size[0] - args.width +1) :
     img_crop = img.crop((dx, 0, dx+args.width, args.height))
     output = ledpanel_tools.image_to_ledpanel_bytes(img_crop)
-    dev.write(0x01, output)
+    if args.patch :
+        dev.write(0x01, ledpanel_tools.proto_diff_patch(prev, output,
+                  args.width, args.height))
+        prev = output
+    else :
+        dev.write(0x01, output)
     time.sleep(0.025)
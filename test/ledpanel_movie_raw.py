@@ -12,6 +12,16 @@ parser.add_argument('-W', '--width', metavar='pixels',
                     type=int, default=40, help='width [def:%(default)d]')
 parser.add_argument('-H', '--height', metavar='pixels',
                     type=int, default=20, help='height [def:%(default)d]')
+parser.add_argument('-g', '--gray', metavar='bits', type=int,
+                    help='grayscale with bits bitplanes (must match firmware)')
+parser.add_argument('-c', '--compress', action='store_true',
+                    help='send PackBits/XOR delta compressed frames')
+parser.add_argument('-q', '--queue', action='store_true',
+                    help='stream ahead into the frame queue, paced by the panel')
+parser.add_argument('-f', '--fps', metavar='Hz', type=float, default=20.0,
+                    help='frames per second [def:%(default).0f]')
+parser.add_argument('-r', '--refresh', metavar='Hz', type=int, default=250,
+                    help='panel refresh rate, HW_MATRIX_REFRESH [def:%(default)d]')
 parser.add_argument('raw_movie_file', type=Path,
                     help='raw movie file in gray width x height to read')
 args = parser.parse_args()
@@ -20,19 +30,38 @@ args = parser.parse_args()
 dev = usb.core.find(idVendor=0x4e65, idProduct=0x7264)
 dev.set_configuration()
 dev.ctrl_transfer(0x40, 0) # any control transfer will reset the write pointer ;-)
+dev.ctrl_transfer(0x40, 4, 1 if args.gray else 0) # USB_IF_REQUEST_GRAY_MODE
+dev.ctrl_transfer(0x40, 5, 1 if args.compress or args.queue else 0) # USB_IF_REQUEST_BULK_MODE
 
 rawmovie = args.raw_movie_file.open('rb')
 
 frameno=0
+prev=None
 while True:
     rawdata = rawmovie.read(args.width * args.height)
     if len(rawdata) < args.width * args.height :
         break
 
     img = PIL.Image.frombytes('L', (args.width, args.height), rawdata)
-    output = ledpanel_tools.image_to_ledpanel_bytes(img)
-    dev.write(0x01, output)
+    if args.gray :
+        output = ledpanel_tools.image_to_ledpanel_planes(img, args.gray)
+    else :
+        output = ledpanel_tools.image_to_ledpanel_bytes(img)
+    if args.queue :
+        # refresh frames between the previous and this movie frame,
+        # the write blocks while the queue on the device is full
+        interval = (round(frameno * args.refresh / args.fps) -
+                    round((frameno - 1) * args.refresh / args.fps))
+        packet = ledpanel_tools.proto_queue(output, interval)
+    elif args.compress :
+        # previous frame is still in the framebuffer
+        packet = ledpanel_tools.proto_packbits(output, prev)
+        prev = output
+    else :
+        packet = output
+    dev.write(0x01, packet)
 
-    print(frameno)
+    print(frameno, len(packet))
     frameno += 1
-    time.sleep(0.05)
\ No newline at end of file
+    if not args.queue :
+        time.sleep(1.0 / args.fps)
\ No newline at end of file
@@ -9,6 +9,118 @@ def image_to_ledpanel_bytes(img: PIL.Image) -> bytes:
         img = img.convert('1')
     return img.tobytes()
 
+
+# framed bulk protocol, from include/usb_proto.h
+USB_PROTO_FLAG_COMMIT = 0x01
+USB_PROTO_CMD_NOP = 0x00
+USB_PROTO_CMD_PATCH = 0x01
+USB_PROTO_CMD_COMMIT = 0x02
+USB_PROTO_CMD_PACKBITS = 0x03
+USB_PROTO_PACKBITS_XOR = 0x01
+USB_PROTO_CMD_CANVAS = 0x04
+USB_PROTO_CMD_QUEUE = 0x05
+
+
+def proto_cmd(cmd: int, args=(0, 0, 0, 0), payload: bytes = b'',
+              commit: bool = False) -> bytes:
+    flags = USB_PROTO_FLAG_COMMIT if commit else 0
+    return struct.pack('<BBH4B', cmd, flags, len(payload), *args) + payload
+
+
+def proto_diff_patch(old: bytes, new: bytes, width: int, height: int,
+                     planes: int = 1) -> bytes:
+    """ smallest USB_PROTO_CMD_PATCH (plus commit) to get from
+        frame old to frame new, x and w are in bytes """
+
+    pitch = (width + 7) // 8
+    plane_bytes = pitch * height
+
+    if old is None:
+        old = bytes(len(new))
+
+    rows, cols = [], []
+    for i in range(len(new)):
+        if old[i] != new[i]:
+            rows.append((i % plane_bytes) // pitch)
+            cols.append(i % pitch)
+    if not rows:
+        return proto_cmd(USB_PROTO_CMD_COMMIT)
+
+    x, y = min(cols), min(rows)
+    w, h = max(cols) - x + 1, max(rows) - y + 1
+    payload = b''
+    for p in range(planes):
+        for row in range(y, y + h):
+            ofs = p * plane_bytes + row * pitch + x
+            payload += new[ofs:ofs + w]
+    return proto_cmd(USB_PROTO_CMD_PATCH, (x, y, w, h), payload, True)
+
+
+def packbits(data: bytes) -> bytes:
+    """ PackBits compression, as decoded by USB_PROTO_CMD_PACKBITS """
+
+    out = bytearray()
+    i, n = 0, len(data)
+    while i < n:
+        run = 1
+        while i + run < n and run < 128 and data[i + run] == data[i]:
+            run += 1
+        if run >= 2:
+            out += bytes((257 - run, data[i]))
+            i += run
+            continue
+        # literal up to the next run of at least 3 bytes
+        j = i
+        while j < n and j - i < 128:
+            if j + 2 < n and data[j] == data[j + 1] == data[j + 2]:
+                break
+            j += 1
+        out.append(j - i - 1)
+        out += data[i:j]
+        i = j
+    return bytes(out)
+
+
+def proto_packbits(new: bytes, old: bytes = None) -> bytes:
+    """ USB_PROTO_CMD_PACKBITS (plus commit) for frame new, as a XOR
+        delta to frame old if given, whichever is shorter """
+
+    full = packbits(new)
+    if old is not None:
+        delta = packbits(bytes(a ^ b for a, b in zip(old, new)))
+        if len(delta) < len(full):
+            return proto_cmd(USB_PROTO_CMD_PACKBITS,
+                             (USB_PROTO_PACKBITS_XOR, 0, 0, 0), delta, True)
+    return proto_cmd(USB_PROTO_CMD_PACKBITS, (0, 0, 0, 0), full, True)
+
+
+def proto_canvas(data: bytes, height: int, x: int = 0) -> bytes:
+    """ USB_PROTO_CMD_CANVAS writing data (height rows of the same length)
+        to the canvas at byte x """
+    return proto_cmd(USB_PROTO_CMD_CANVAS, (x & 0xff, x >> 8, 0, 0), data)
+
+
+def proto_queue(frame: bytes, interval: int) -> bytes:
+    """ USB_PROTO_CMD_QUEUE, frame is shown interval refresh frames after
+        the previous queued one """
+    return proto_cmd(USB_PROTO_CMD_QUEUE, (interval & 0xff, interval >> 8,
+                                           0, 0), frame)
+
+
+def image_to_ledpanel_planes(img: PIL.Image, bits: int = 4) -> bytes:
+    """ convert to bits bitplanes (for USB_IF_REQUEST_GRAY_MODE),
+        most significant plane first """
+
+    if img.mode != 'L':
+        img = img.convert('L')
+    gray = img.point(lambda v: v >> (8 - bits))
+
+    output = b''
+    for bit in reversed(range(bits)):
+        plane = gray.point(lambda v: 255 if v & (1 << bit) else 0)
+        output += plane.convert('1', dither=PIL.Image.NONE).tobytes()
+    return output
+
 if __name__ == '__main__':
     import argparse
     from pathlib import Path
@@ -20,3 +132,32 @@ if __name__ == '__main__':
     img = PIL.Image.open(args.pngfile)
     data = image_to_ledpanel_bytes(img)
     print(data)
+
+
+# column drivers (include/hw_matrix.h), 40x20 modules, 3 stripes of 8 rows
+MODULE_BYTES = 6 # one unconnected byte + 5 bytes of pixels per stripe
+STRIPES = 3
+GAMMA_POINTS = 33
+
+
+def module_drivers(module: int, modules: int, chains: int = 1) -> list:
+    """ indices of the MBI5029 (hw_matrix_gain()) of a module, counted
+        from the left, as shifted out: last stripe, rightmost module
+        first, 16 bit per driver, chain after chain (LEDPANEL_CHAINS) """
+    per_chain = modules // chains
+    chain, module = divmod(module, per_chain)
+    drivers = []
+    for stripe in range(STRIPES):
+        block = (chain * STRIPES * per_chain +
+                 (STRIPES - 1 - stripe) * per_chain + (per_chain - 1 - module))
+        first = block * MODULE_BYTES // 2
+        drivers += range(first, first + MODULE_BYTES // 2)
+    return sorted(drivers)
+
+
+def gamma_curve(gamma: float) -> list:
+    """ points for hw_matrix_gamma(): on-time (1/65536) at brightness
+        0, 8, ... 256 """
+    return [min(0xffff, round(65536 * (i / 32) ** gamma))
+            for i in range(GAMMA_POINTS)]
+
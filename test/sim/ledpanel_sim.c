@@ -0,0 +1,652 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Firmware in the loop: replays a recording of the host library
+ * (ledpanel_cli -r, ledpanel_open_record()) to the firmware, running
+ * against the simulated peripherals of sim_hw.c, and decodes what the
+ * column drivers latch and the row drivers light back into frames.
+ *
+ * Bulk transfers go out as 64 byte packets, at most one per USB frame
+ * slot, control requests take a millisecond. The main loop runs after
+ * every event, like it would after waking up.
+ */
+
+#include "sim.h"
+
+#include "hw_matrix.h"
+#include "ledpanel_buffer.h"
+#include "ledpanel_canvas.h"
+#include "ledpanel_host.h"
+#include "ledpanel_queue.h"
+#include "ledpanel_store.h"
+#include "settings.h"
+#include "usb_if.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* 19 bulk packets of 64 bytes per 1 ms full speed frame */
+#define USB_PACKET_CYCLES (SIM_HZ / 19000)
+#define USB_CONTROL_CYCLES (SIM_HZ / 1000)
+/* the host starts after enumeration */
+#define RECORD_START (SIM_HZ / 10)
+#define TICK_CYCLES (SIM_HZ / 10) /* systick */
+
+#define PIXELS (LEDPANEL_PIX_WIDTH * LEDPANEL_PIX_HEIGHT)
+
+/* frames of the expected output searched ahead for a match */
+#define EXPECT_WINDOW 64
+
+static uint64_t ms(double ms)
+{
+	return ms * (SIM_HZ / 1000);
+}
+
+static double to_ms(uint64_t cycles)
+{
+	return cycles / (SIM_HZ / 1000.0);
+}
+
+/* === latency statistics === */
+
+struct latency {
+	const char *name;
+	unsigned long n;
+	uint64_t min, max, sum;
+};
+
+static struct latency lat_transfer = { .name = "transfer" };
+static struct latency lat_commit = { .name = "commit to light" };
+static struct latency lat_host = { .name = "host to light" };
+
+static void latency_add(struct latency *l, uint64_t cycles)
+{
+	if (!l->n || cycles < l->min)
+		l->min = cycles;
+	if (cycles > l->max)
+		l->max = cycles;
+	l->sum += cycles;
+	l->n++;
+}
+
+static void latency_print(const struct latency *l)
+{
+	if (!l->n) {
+		printf("  %-16s %8lu\n", l->name, l->n);
+		return;
+	}
+	printf("  %-16s %8lu %9.3f %9.3f %9.3f\n", l->name, l->n,
+	       to_ms(l->min), to_ms(l->sum) / l->n, to_ms(l->max));
+}
+
+/* === recording === */
+
+struct rec {
+	uint64_t t;
+	const struct ledpanel_record *r;
+	const uint8_t *data;
+};
+
+static struct rec *recs;
+static unsigned int nrecs;
+
+static int load_recording(const char *path)
+{
+	const struct ledpanel_record_hdr *hdr;
+	const struct ledpanel_record *r;
+	unsigned long size = 0, alloc = 0, pos;
+	uint8_t *buf = NULL;
+	size_t n;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	do {
+		if (size == alloc) {
+			alloc = alloc ? 2 * alloc : 65536;
+			buf = realloc(buf, alloc);
+			if (!buf)
+				return -1;
+		}
+		n = fread(buf + size, 1, alloc - size, f);
+		size += n;
+	} while (n);
+	fclose(f);
+
+	hdr = (const struct ledpanel_record_hdr *)buf;
+	if (size < sizeof(*hdr) || hdr->magic != LEDPANEL_RECORD_MAGIC) {
+		fprintf(stderr, "%s: not a recording\n", path);
+		return -1;
+	}
+	if (hdr->modules != LEDPANEL_MODULES) {
+		fprintf(stderr, "%s: %u modules, simulator built for %u\n",
+			path, hdr->modules, LEDPANEL_MODULES);
+		return -1;
+	}
+
+	for (pos = sizeof(*hdr); pos + sizeof(*r) <= size; ) {
+		r = (const struct ledpanel_record *)(buf + pos);
+		pos += sizeof(*r);
+		if (!(r->type & 0x80))
+			pos += r->len;
+		if (pos > size)
+			break;
+		recs = realloc(recs, (nrecs + 1) * sizeof(*recs));
+		if (!recs)
+			return -1;
+		recs[nrecs].t = RECORD_START + (uint64_t)r->usec *
+				(SIM_HZ / 1000000);
+		recs[nrecs].r = r;
+		recs[nrecs].data = (const uint8_t *)(r + 1);
+		nrecs++;
+	}
+	if (pos != size)
+		fprintf(stderr, "%s: truncated\n", path);
+	return 0;
+}
+
+/* === decoding the rows === */
+
+/* pixel (y * width + x) of each bit of a row, -1 for the dummy bytes */
+static int pixel_of[LEDPANEL_ROWS][LEDPANEL_SPI_BYTES * 8];
+
+static void pixel_map_init(void)
+{
+	unsigned int per_chain = LEDPANEL_CHAIN_MODULES;
+	unsigned int x, y, stripe, chain, module, xm, block, byte;
+
+	memset(pixel_of, 0xff, sizeof(pixel_of));
+	for (y = 0; y < LEDPANEL_PIX_HEIGHT; y++) {
+		for (x = 0; x < LEDPANEL_PIX_WIDTH; x++) {
+			stripe = y / LEDPANEL_ROWS;
+			chain = x / LEDPANEL_MODULE_WIDTH / per_chain;
+			module = x / LEDPANEL_MODULE_WIDTH % per_chain;
+			xm = x % LEDPANEL_MODULE_WIDTH;
+			block = chain * LEDPANEL_STRIPES * per_chain +
+				(LEDPANEL_STRIPES - 1 - stripe) * per_chain +
+				(per_chain - 1 - module);
+			byte = block * (LEDPANEL_MODULE_DUMMY +
+					LEDPANEL_MODULE_BYTES) +
+			       LEDPANEL_MODULE_DUMMY +
+			       (LEDPANEL_MODULE_BYTES - 1 - xm / 8);
+			pixel_of[y % LEDPANEL_ROWS][byte * 8 + 7 - xm % 8] =
+				y * LEDPANEL_PIX_WIDTH + x;
+		}
+	}
+}
+
+/* refresh frame being put together, rows in the order they are latched */
+static struct {
+	uint8_t bits[LEDPANEL_GRAY_BITS][LEDPANEL_ROWS][LEDPANEL_SPI_BYTES];
+	unsigned int planes[LEDPANEL_ROWS];
+	unsigned int last_addr;
+	int tag, torn, overflow;
+	uint64_t start;
+	uint64_t light[PIXELS];
+} cur = { .last_addr = LEDPANEL_ROWS };
+
+static struct {
+	unsigned long frames, partial, torn, mismatch, missing;
+	unsigned long bulk_bytes, packets, naks, controls, stalls;
+	uint64_t nak_cycles;
+	uint64_t frame_cycles; /* the last frame start to the one before */
+} st;
+
+/* the last USB_IF_REQUEST_TIMING accepted, checked against the rate
+   the frames come at and the SPI clock in the end */
+static struct {
+	int valid;
+	unsigned int refresh, br; /* br 0xffff: kept */
+} timing;
+
+static FILE *out_frames, *out_light;
+
+/* expected frames, 8 bit gray */
+static uint8_t *expect;
+static unsigned int nexpect, expect_pos;
+static int expect_synced, expect_resync;
+static unsigned int last_planes;
+
+/* frame matches expected frame i, quantized to 'planes' bits */
+static int expect_match(const uint8_t *level, unsigned int planes,
+			unsigned int i)
+{
+	const uint8_t *e = &expect[i * PIXELS];
+	unsigned int max = (1 << planes) - 1, p;
+
+	for (p = 0; p < PIXELS; p++)
+		if ((e[p] * max + 127) / 255 != level[p])
+			return 0;
+	return 1;
+}
+
+/* repeats of the current frame are fine, frames skipped on the way to
+   the next match count as missing, anything before the first match is
+   ignored (the grid from power on), as is what is left in the buffer
+   after switching between monochrome and gray */
+static void expect_check(const uint8_t *level, unsigned int planes)
+{
+	unsigned int i, end;
+
+	if (planes != last_planes)
+		expect_resync = 1;
+	last_planes = planes;
+	if (expect_synced && expect_match(level, planes, expect_pos))
+		return;
+	end = expect_synced ? expect_pos + 1 + EXPECT_WINDOW : nexpect;
+	for (i = expect_synced ? expect_pos + 1 : 0;
+	     i < end && i < nexpect; i++) {
+		if (!expect_match(level, planes, i))
+			continue;
+		if (expect_synced)
+			st.missing += i - expect_pos - 1;
+		expect_pos = i;
+		expect_synced = 1;
+		expect_resync = 0;
+		return;
+	}
+	if (expect_synced && !expect_resync)
+		st.mismatch++;
+}
+
+static void frame_finish(void)
+{
+	uint8_t level[PIXELS], gray[PIXELS];
+	unsigned int planes = cur.planes[0], row, p, i, max;
+	uint64_t cycles = sim_now - cur.start;
+	const uint8_t *b;
+	int pix;
+
+	for (row = 0; row < LEDPANEL_ROWS; row++)
+		if (cur.planes[row] != planes)
+			break;
+	if (row < LEDPANEL_ROWS || !planes || cur.overflow) {
+		st.partial++;
+		return;
+	}
+	st.frames++;
+	if (cur.torn)
+		st.torn++;
+
+	memset(level, 0, sizeof(level));
+	for (row = 0; row < LEDPANEL_ROWS; row++) {
+		for (p = 0; p < planes; p++) {
+			b = cur.bits[p][row];
+			for (i = 0; i < LEDPANEL_SPI_BYTES * 8; i++) {
+				pix = pixel_of[row][i];
+				if (pix >= 0 && (b[i / 8] & (1 << (i % 8))))
+					level[pix] |= 1 << (planes - 1 - p);
+			}
+		}
+	}
+
+	max = (1 << planes) - 1;
+	if (out_frames) {
+		for (i = 0; i < PIXELS; i++)
+			gray[i] = level[i] * 255 / max;
+		fwrite(gray, PIXELS, 1, out_frames);
+	}
+	if (out_light && cycles) {
+		/* 255: lit all the time its row is selected */
+		for (i = 0; i < PIXELS; i++) {
+			p = cur.light[i] * LEDPANEL_ROWS * 255 / cycles;
+			gray[i] = p > 255 ? 255 : p;
+		}
+		fwrite(gray, PIXELS, 1, out_light);
+	}
+	if (expect && !cur.torn)
+		expect_check(level, planes);
+}
+
+/* commit waiting to be shown, and when it was made */
+static struct {
+	int pending, host_valid;
+	uint32_t tag;
+	uint64_t t, host_t;
+} commit;
+
+/* time of the last record delivered completely, valid if delivered
+   since the last commit */
+static uint64_t delivered_t;
+static int delivered;
+
+void sim_panel_row(unsigned int addr, const struct sim_row *row)
+{
+	unsigned int p;
+
+	if (addr < cur.last_addr || cur.last_addr == LEDPANEL_ROWS) {
+		if (cur.last_addr != LEDPANEL_ROWS) {
+			st.frame_cycles = sim_now - cur.start;
+			frame_finish();
+		}
+		memset(cur.planes, 0, sizeof(cur.planes));
+		memset(cur.light, 0, sizeof(cur.light));
+		cur.tag = row->tag;
+		cur.torn = 0;
+		cur.overflow = 0;
+		cur.start = sim_now;
+	}
+	cur.last_addr = addr;
+
+	if (row->torn || row->tag < 0 || row->tag != cur.tag)
+		cur.torn = 1;
+	p = cur.planes[addr]++;
+	if (p < LEDPANEL_GRAY_BITS)
+		memcpy(cur.bits[p][addr], row->data, LEDPANEL_SPI_BYTES);
+	else
+		cur.overflow = 1;
+
+	if (commit.pending && row->tag >= 0 &&
+	    (uint32_t)row->tag - commit.tag < 0x80000000) {
+		latency_add(&lat_commit, sim_now - commit.t);
+		if (commit.host_valid)
+			latency_add(&lat_host, sim_now - commit.host_t);
+		commit.pending = 0;
+	}
+}
+
+void sim_panel_light(unsigned int addr, const struct sim_row *row,
+		     uint64_t cycles)
+{
+	unsigned int i;
+	int pix;
+
+	if (!out_light)
+		return;
+	for (i = 0; i < LEDPANEL_SPI_BYTES * 8; i++) {
+		pix = pixel_of[addr][i];
+		if (pix >= 0 && (row->data[i / 8] & (1 << (i % 8))))
+			cur.light[pix] += cycles;
+	}
+}
+
+/* === firmware === */
+
+/* main() of src/main.c, without the wfi */
+static void main_loop(void)
+{
+	unsigned int guard = 0;
+	uint32_t frame;
+
+	do {
+		frame = ledpanel_buffer_frame;
+
+		usb_if_lock();
+		usb_if_poll();
+		ledpanel_store_write_poll();
+		ledpanel_store_poll();
+		ledpanel_canvas_poll();
+		ledpanel_queue_poll();
+		usb_if_unlock();
+	} while ((usb_if_pending() || frame != ledpanel_buffer_frame) &&
+		 ++guard < 1000);
+	sim_spi_sync();
+
+	if (!commit.pending && !ledpanel_buffer_sync()) {
+		commit.pending = 1;
+		commit.tag = ledpanel_buffer_shown + 1;
+		commit.t = sim_now;
+		commit.host_valid = delivered;
+		commit.host_t = delivered_t;
+		delivered = 0;
+	}
+}
+
+static void firmware_init(void)
+{
+	usb_if_init();
+	ledpanel_buffer_init();
+	hw_matrix_init();
+	settings_load();
+	if (ledpanel_store_load() == 0) {
+		ledpanel_store_play(1);
+		ledpanel_store_poll();
+	}
+	hw_matrix_start();
+	sim_usb_configure();
+}
+
+/* === replay === */
+
+static unsigned int rec_pos; /* bytes of recs[i] sent */
+
+/* next packet or request of record i at sim_now, returns 1 if the
+   record is done */
+static int replay(unsigned int i)
+{
+	const struct rec *rc = &recs[i];
+	const struct ledpanel_record *r = rc->r;
+	unsigned int n;
+
+	if (r->type) {
+		st.controls++;
+		if (!sim_usb_control(r->type, r->request, r->value, r->index,
+				     rc->data, r->len)) {
+			st.stalls++;
+		} else if (r->request == USB_IF_REQUEST_TIMING &&
+			   !(r->type & 0x80)) {
+			timing.valid = 1;
+			timing.refresh = r->value;
+			timing.br = r->index;
+		}
+		return 1;
+	}
+
+	n = r->len - rec_pos < 64 ? r->len - rec_pos : 64;
+	if (n && !sim_usb_bulk(rc->data + rec_pos, n)) {
+		st.naks++;
+		st.nak_cycles += USB_PACKET_CYCLES;
+		return 0;
+	}
+	st.packets++;
+	st.bulk_bytes += n;
+	rec_pos += n;
+	if (rec_pos < r->len)
+		return 0;
+	latency_add(&lat_transfer, sim_now - rc->t);
+	return 1;
+}
+
+static void run(uint64_t tail)
+{
+	uint64_t usb_free = 0, tick = TICK_CYCLES, end, t_tim, t_usb, t;
+	unsigned int i = 0;
+
+	/* until the last record has been delivered, and tail after that */
+	end = RECORD_START + tail;
+	while (1) {
+		t_tim = sim_tim2_next();
+		t_usb = UINT64_MAX;
+		if (i < nrecs)
+			t_usb = recs[i].t > usb_free ? recs[i].t : usb_free;
+
+		t = t_tim < tick ? t_tim : tick;
+		if (t_usb < t)
+			t = t_usb;
+		if (i == nrecs && t >= end)
+			break;
+		if (t > sim_now)
+			sim_now = t;
+
+		/* the refresh comes first */
+		if (t == t_tim) {
+			sim_tim2_event();
+		} else if (t == tick) {
+			usb_if_tick();
+			ledpanel_store_tick();
+			ledpanel_store_write_tick();
+			tick += TICK_CYCLES;
+		} else {
+			usb_free = sim_now + (recs[i].r->type ?
+					      USB_CONTROL_CYCLES :
+					      USB_PACKET_CYCLES);
+			if (replay(i)) {
+				delivered = 1;
+				delivered_t = recs[i].t;
+				rec_pos = 0;
+				if (++i == nrecs)
+					end = sim_now + tail;
+			}
+		}
+		main_loop();
+	}
+	if (cur.last_addr != LEDPANEL_ROWS)
+		frame_finish();
+}
+
+static void report(void)
+{
+	printf("%u records: %lu bytes in %lu packets, %lu control requests "
+	       "(%lu stalled)\n", nrecs, st.bulk_bytes, st.packets,
+	       st.controls, st.stalls);
+	printf("NAKs: %lu (%.3f ms)\n", st.naks, to_ms(st.nak_cycles));
+	printf("refresh frames: %lu (%lu torn), %lu partial, %.3f ms "
+	       "simulated\n", st.frames, st.torn, st.partial, to_ms(sim_now));
+	printf("rows: %u latched, %u DMA busy, %u configuration writes\n",
+	       hw_matrix_rows, hw_matrix_dma_busy, sim_cfg_writes);
+	printf("latency [ms]            n       min       avg       max\n");
+	latency_print(&lat_transfer);
+	latency_print(&lat_commit);
+	latency_print(&lat_host);
+	if (expect)
+		printf("expected frames: %u, %s, %lu mismatched, %lu missing\n",
+		       nexpect, expect_synced ? "found" : "not found",
+		       st.mismatch, st.missing);
+	if (timing.valid)
+		printf("timing: %u Hz, SPI BR %u requested, %.1f Hz, "
+		       "SPI BR %u, TIM2 PSC %u applied\n", timing.refresh,
+		       timing.br, st.frame_cycles ? (double)SIM_HZ /
+		       st.frame_cycles : 0.0, sim_spi1_br(),
+		       sim_tim2_prescaler());
+}
+
+/* the refresh runs at the rate and SPI clock last asked for, within the
+   rounding of the prescaler */
+static int timing_ok(void)
+{
+	uint64_t want;
+
+	if (!timing.valid)
+		return 1;
+	want = SIM_HZ / timing.refresh;
+	return (timing.br == 0xffff || sim_spi1_br() == timing.br) &&
+	       st.frame_cycles &&
+	       st.frame_cycles < want + want / 50 &&
+	       st.frame_cycles > want - want / 50;
+}
+
+static int load_expect(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	size_t n;
+
+	if (!f)
+		return -1;
+	while (1) {
+		expect = realloc(expect, (nexpect + 1) * PIXELS);
+		if (!expect)
+			return -1;
+		n = fread(&expect[nexpect * PIXELS], 1, PIXELS, f);
+		if (n != PIXELS)
+			break;
+		nexpect++;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-o file] [-l file] [-e file] [-t ms] recording\n"
+		"  -o file   frames as latched, 8 bit gray, one per refresh\n"
+		"            frame\n"
+		"  -l file   light emitted during each refresh frame, 8 bit\n"
+		"            gray, 255: lit all the time\n"
+		"  -e file   8 bit gray frames expected to be shown, in order,\n"
+		"            exit code 1 if any is missing or wrong\n"
+		"  -t ms     keep running after the last record [def: 100]\n",
+		argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	double tail = 100;
+	int i;
+
+	while ((i = getopt(argc, argv, "o:l:e:t:")) != -1) {
+		switch (i) {
+		case 'o':
+			out_frames = fopen(optarg, "wb");
+			if (!out_frames) {
+				fprintf(stderr, "Could not create %s!\n", optarg);
+				return 2;
+			}
+			break;
+		case 'l':
+			out_light = fopen(optarg, "wb");
+			if (!out_light) {
+				fprintf(stderr, "Could not create %s!\n", optarg);
+				return 2;
+			}
+			break;
+		case 'e':
+			if (load_expect(optarg) < 0) {
+				fprintf(stderr, "Could not read %s!\n", optarg);
+				return 2;
+			}
+			break;
+		case 't':
+			tail = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	if (load_recording(argv[optind]) < 0) {
+		fprintf(stderr, "Could not read %s!\n", argv[optind]);
+		return 2;
+	}
+
+	pixel_map_init();
+	firmware_init();
+	run(ms(tail));
+	/* expected frames never shown at the end */
+	if (expect_synced)
+		st.missing += nexpect - 1 - expect_pos;
+	report();
+
+	if (out_frames)
+		fclose(out_frames);
+	if (out_light)
+		fclose(out_light);
+
+	if (st.torn || !timing_ok() ||
+	    (expect && (!expect_synced || st.mismatch || st.missing)))
+		return 1;
+	return 0;
+}
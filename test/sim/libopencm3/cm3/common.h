@@ -0,0 +1,18 @@
+#ifndef SIM_LIBOPENCM3_CM3_COMMON_H
+#define SIM_LIBOPENCM3_CM3_COMMON_H
+
+/*
+ * Just enough of libopencm3 for the firmware to run in the simulator
+ * (test/sim/): registers are looked up in sim_hw.c, which models the
+ * peripherals behind them.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+extern volatile uint32_t *sim_reg(uint32_t addr);
+
+#define MMIO32(addr) (*sim_reg(addr))
+#define MMIO16(addr) (*(volatile uint16_t *)sim_reg(addr))
+
+#endif
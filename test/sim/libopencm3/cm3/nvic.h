@@ -0,0 +1,20 @@
+#ifndef SIM_LIBOPENCM3_CM3_NVIC_H
+#define SIM_LIBOPENCM3_CM3_NVIC_H
+
+#include <libopencm3/cm3/common.h>
+
+#define NVIC_SYSTICK_IRQ -1
+#define NVIC_DMA1_CHANNEL2_IRQ 12
+#define NVIC_USB_LP_CAN_RX0_IRQ 20
+#define NVIC_TIM2_IRQ 28
+
+extern void nvic_enable_irq(uint8_t irqn);
+extern void nvic_disable_irq(uint8_t irqn);
+extern void nvic_set_priority(uint8_t irqn, uint8_t priority);
+
+/* interrupt handlers, in the firmware */
+extern void dma1_channel2_isr(void);
+extern void usb_lp_can_rx0_isr(void);
+extern void tim2_isr(void);
+
+#endif
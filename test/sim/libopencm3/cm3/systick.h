@@ -0,0 +1,9 @@
+#ifndef SIM_LIBOPENCM3_CM3_SYSTICK_H
+#define SIM_LIBOPENCM3_CM3_SYSTICK_H
+
+#include <libopencm3/cm3/common.h>
+
+/* the simulator ticks at 10 Hz, like main.c sets it up */
+#define STK_CSR_CLKSOURCE_AHB 4
+
+#endif
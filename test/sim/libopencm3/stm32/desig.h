@@ -0,0 +1,8 @@
+#ifndef SIM_LIBOPENCM3_STM32_DESIG_H
+#define SIM_LIBOPENCM3_STM32_DESIG_H
+
+#include <libopencm3/cm3/common.h>
+
+extern uint16_t desig_get_flash_size(void);
+
+#endif
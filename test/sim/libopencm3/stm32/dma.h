@@ -0,0 +1,26 @@
+#ifndef SIM_LIBOPENCM3_STM32_DMA_H
+#define SIM_LIBOPENCM3_STM32_DMA_H
+
+#include <libopencm3/cm3/common.h>
+
+#define DMA1 0x40020000U
+#define DMA1_IFCR MMIO32(DMA1 + 0x04)
+#define DMA1_CCR(ch) MMIO32(DMA1 + 0x08 + 0x14 * ((ch) - 1))
+#define DMA1_CNDTR(ch) MMIO32(DMA1 + 0x0c + 0x14 * ((ch) - 1))
+#define DMA1_CPAR(ch) MMIO32(DMA1 + 0x10 + 0x14 * ((ch) - 1))
+#define DMA1_CMAR(ch) MMIO32(DMA1 + 0x14 + 0x14 * ((ch) - 1))
+
+#define DMA_CCR_EN (1 << 0)
+#define DMA_CCR_TCIE (1 << 1)
+#define DMA_CCR_DIR (1 << 4)
+#define DMA_CCR_CIRC (1 << 5)
+#define DMA_CCR_MINC (1 << 7)
+#define DMA_CCR_PSIZE_16BIT (1 << 8)
+#define DMA_CCR_PSIZE_32BIT (2 << 8)
+#define DMA_CCR_MSIZE_16BIT (1 << 10)
+#define DMA_CCR_MSIZE_32BIT (2 << 10)
+#define DMA_CCR_PL_HIGH (2 << 12)
+#define DMA_CCR_PL_VERY_HIGH (3 << 12)
+#define DMA_IFCR_CGIF(ch) (1 << (4 * ((ch) - 1)))
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SIM_LIBOPENCM3_STM32_FLASH_H
+#define SIM_LIBOPENCM3_STM32_FLASH_H
+
+#include <libopencm3/cm3/common.h>
+
+/* 64k of flash in the simulator's memory (linked without PIE, so that
+   it is addressed with 32 bits) */
+extern uint8_t sim_flash[];
+#define FLASH_BASE ((uint32_t)(uintptr_t)sim_flash)
+
+#define FLASH_SR_PGERR (1 << 2)
+#define FLASH_SR_WRPRTERR (1 << 4)
+
+extern void flash_unlock(void);
+extern void flash_lock(void);
+extern void flash_erase_page(uint32_t page_address);
+extern void flash_program_half_word(uint32_t address, uint16_t data);
+extern uint32_t flash_get_status_flags(void);
+
+#endif
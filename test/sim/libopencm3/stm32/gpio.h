@@ -0,0 +1,53 @@
+#ifndef SIM_LIBOPENCM3_STM32_GPIO_H
+#define SIM_LIBOPENCM3_STM32_GPIO_H
+
+#include <libopencm3/cm3/common.h>
+
+#define GPIOA 0x40010800U
+#define GPIOB 0x40010c00U
+#define GPIOC 0x40011000U
+
+#define GPIO0 (1 << 0)
+#define GPIO1 (1 << 1)
+#define GPIO2 (1 << 2)
+#define GPIO3 (1 << 3)
+#define GPIO4 (1 << 4)
+#define GPIO5 (1 << 5)
+#define GPIO6 (1 << 6)
+#define GPIO7 (1 << 7)
+#define GPIO8 (1 << 8)
+#define GPIO13 (1 << 13)
+#define GPIO14 (1 << 14)
+#define GPIO15 (1 << 15)
+
+#define GPIO_BSRR(port) MMIO32((port) + 0x10)
+#define GPIOA_BSRR GPIO_BSRR(GPIOA)
+
+#define GPIO_BANK_TIM2_CH4 GPIOA
+#define GPIO_TIM2_CH4 GPIO3
+#define GPIO_BANK_SPI1_SCK GPIOA
+#define GPIO_SPI1_SCK GPIO5
+#define GPIO_BANK_SPI1_MISO GPIOA
+#define GPIO_SPI1_MISO GPIO6
+#define GPIO_BANK_SPI1_MOSI GPIOA
+#define GPIO_SPI1_MOSI GPIO7
+#define GPIO_BANK_SPI2_SCK GPIOB
+#define GPIO_SPI2_SCK GPIO13
+#define GPIO_BANK_SPI2_MOSI GPIOB
+#define GPIO_SPI2_MOSI GPIO15
+
+#define GPIO_MODE_INPUT 0
+#define GPIO_MODE_OUTPUT_10_MHZ 1
+#define GPIO_CNF_INPUT_PULL_UPDOWN 2
+#define GPIO_CNF_OUTPUT_PUSHPULL 0
+#define GPIO_CNF_OUTPUT_ALTFN_PUSHPULL 2
+
+#define AFIO_MAPR MMIO32(0x40010004)
+#define AFIO_MAPR_SWJ_CFG_JTAG_OFF_SW_ON (2 << 24)
+
+extern void gpio_set(uint32_t gpioport, uint16_t gpios);
+extern void gpio_clear(uint32_t gpioport, uint16_t gpios);
+extern void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf,
+			  uint16_t gpios);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef SIM_LIBOPENCM3_STM32_RCC_H
+#define SIM_LIBOPENCM3_STM32_RCC_H
+
+#include <libopencm3/cm3/common.h>
+
+extern uint32_t rcc_ahb_frequency, rcc_apb1_frequency, rcc_apb2_frequency;
+
+enum rcc_periph_clken {
+	RCC_AFIO, RCC_GPIOA, RCC_GPIOB, RCC_GPIOC, RCC_DMA1, RCC_SPI1,
+	RCC_SPI2, RCC_TIM2, RCC_USB,
+};
+enum rcc_periph_rst { RST_TIM2 };
+
+extern void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+extern void rcc_periph_reset_pulse(enum rcc_periph_rst rst);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SIM_LIBOPENCM3_STM32_SPI_H
+#define SIM_LIBOPENCM3_STM32_SPI_H
+
+#include <libopencm3/cm3/common.h>
+
+#define SPI1 0x40013000U
+#define SPI2 0x40003800U
+
+#define SPI_CR1(spi) MMIO32((spi) + 0x00)
+#define SPI_CR2(spi) MMIO32((spi) + 0x04)
+#define SPI_SR(spi) MMIO32((spi) + 0x08)
+#define SPI_DR(spi) MMIO32((spi) + 0x0c)
+#define SPI1_CR1 SPI_CR1(SPI1)
+#define SPI1_CR2 SPI_CR2(SPI1)
+#define SPI1_SR SPI_SR(SPI1)
+#define SPI1_DR SPI_DR(SPI1)
+#define SPI2_CR1 SPI_CR1(SPI2)
+#define SPI2_CR2 SPI_CR2(SPI2)
+#define SPI2_SR SPI_SR(SPI2)
+#define SPI2_DR SPI_DR(SPI2)
+
+#define SPI_CR1_CPHA (1 << 0)
+#define SPI_CR1_MSTR (1 << 2)
+#define SPI_CR1_SPE (1 << 6)
+#define SPI_CR1_LSBFIRST (1 << 7)
+#define SPI_CR1_SSI (1 << 8)
+#define SPI_CR1_SSM (1 << 9)
+#define SPI_CR1_BR_FPCLK_DIV_4 1
+#define SPI_CR1_BR_FPCLK_DIV_16 3
+#define SPI_CR1_BR_FPCLK_DIV_64 5
+#define SPI_CR1_BR_FPCLK_DIV_256 7
+#define SPI_CR2_TXDMAEN (1 << 1)
+#define SPI_SR_TXE (1 << 1)
+#define SPI_SR_BSY (1 << 7)
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SIM_LIBOPENCM3_STM32_ST_USBFS_H
+#define SIM_LIBOPENCM3_STM32_ST_USBFS_H
+
+#include <libopencm3/cm3/common.h>
+
+/* endpoint registers with their toggle and write-0-to-clear bits, and
+   the packet memory (16 bit words at 32 bit addresses, like the F1) */
+extern volatile uint32_t sim_usb_epr[8];
+extern uint8_t sim_usb_pma[];
+extern uint16_t sim_usb_get_reg(volatile uint32_t *reg);
+extern void sim_usb_set_reg(volatile uint32_t *reg, uint16_t val);
+
+#define GET_REG(REG) sim_usb_get_reg(REG)
+#define SET_REG(REG, VAL) sim_usb_set_reg((REG), (VAL))
+
+#define USB_EP_REG(EP) (&sim_usb_epr[EP])
+#define USB_PMA_BASE ((uintptr_t)sim_usb_pma)
+
+#define USB_EP_RX_CTR 0x8000
+#define USB_EP_RX_DTOG 0x4000
+#define USB_EP_RX_STAT 0x3000
+#define USB_EP_RX_STAT_VALID 0x3000
+#define USB_EP_SETUP 0x0800
+#define USB_EP_TYPE 0x0600
+#define USB_EP_KIND 0x0100
+#define USB_EP_TX_CTR 0x0080
+#define USB_EP_TX_DTOG 0x0040
+#define USB_EP_TX_STAT 0x0030
+#define USB_EP_ADDR 0x000f
+
+#define USB_EP_TX_ADDR(EP) ((uint32_t *)(USB_PMA_BASE + ((EP) * 8 + 0) * 2))
+#define USB_EP_TX_COUNT(EP) ((uint32_t *)(USB_PMA_BASE + ((EP) * 8 + 2) * 2))
+#define USB_EP_RX_ADDR(EP) ((uint32_t *)(USB_PMA_BASE + ((EP) * 8 + 4) * 2))
+#define USB_EP_RX_COUNT(EP) ((uint32_t *)(USB_PMA_BASE + ((EP) * 8 + 6) * 2))
+
+#endif
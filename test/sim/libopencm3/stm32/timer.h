@@ -0,0 +1,46 @@
+#ifndef SIM_LIBOPENCM3_STM32_TIMER_H
+#define SIM_LIBOPENCM3_STM32_TIMER_H
+
+#include <libopencm3/cm3/common.h>
+
+/* only TIM2 is simulated, and only through these functions */
+#define TIM2 0x40000000U
+
+#define TIM_SR_UIF (1 << 0)
+#define TIM_SR_CC1IF (1 << 1)
+#define TIM_SR_CC2IF (1 << 2)
+#define TIM_SR_CC3IF (1 << 3)
+#define TIM_EGR_UG (1 << 0)
+#define TIM_DIER_UIE (1 << 0)
+#define TIM_DIER_UDE (1 << 8)
+#define TIM_DIER_CC1DE (1 << 9)
+#define TIM_DIER_CC2DE (1 << 10)
+#define TIM_DIER_CC3DE (1 << 11)
+#define TIM_CR1_CKD_CK_INT 0
+#define TIM_CR1_CMS_EDGE 0
+#define TIM_CR1_DIR_UP 0
+
+enum tim_oc_id { TIM_OC1, TIM_OC2, TIM_OC3, TIM_OC4 };
+enum tim_oc_mode { TIM_OCM_FROZEN, TIM_OCM_ACTIVE, TIM_OCM_PWM1 };
+
+extern void timer_set_mode(uint32_t timer, uint32_t clock_div,
+			   uint32_t alignment, uint32_t direction);
+extern void timer_set_prescaler(uint32_t timer, uint32_t value);
+extern void timer_set_period(uint32_t timer, uint32_t period);
+extern void timer_set_counter(uint32_t timer, uint32_t count);
+extern void timer_set_oc_mode(uint32_t timer, enum tim_oc_id oc_id,
+			      enum tim_oc_mode oc_mode);
+extern void timer_set_oc_polarity_high(uint32_t timer, enum tim_oc_id oc_id);
+extern void timer_set_oc_value(uint32_t timer, enum tim_oc_id oc_id,
+			       uint32_t value);
+extern void timer_enable_oc_output(uint32_t timer, enum tim_oc_id oc_id);
+extern void timer_disable_oc_output(uint32_t timer, enum tim_oc_id oc_id);
+extern void timer_enable_irq(uint32_t timer, uint32_t irq);
+extern void timer_disable_irq(uint32_t timer, uint32_t irq);
+extern void timer_enable_counter(uint32_t timer);
+extern void timer_disable_counter(uint32_t timer);
+extern void timer_clear_flag(uint32_t timer, uint32_t flag);
+extern void timer_generate_event(uint32_t timer, uint32_t event);
+extern void timer_update_on_overflow(uint32_t timer);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include "ledpanel_buffer.h"
+
+#include <stdint.h>
+
+/*
+ * Simulated peripherals (sim_hw.c), driven by the event loop of
+ * ledpanel_sim.c. Time is counted in CPU cycles, firmware code takes
+ * none, except for busy waiting on the SPI and for flash writes.
+ */
+
+#define SIM_HZ 72000000 /* CPU, TIM2 and SPI1 clock */
+
+extern uint64_t sim_now;
+
+/* next update event of TIM2, UINT64_MAX if it isn't counting */
+extern uint64_t sim_tim2_next(void);
+/* update event at sim_now, runs tim2_isr() if enabled */
+extern void sim_tim2_event(void);
+
+/* catch up with the SPI transfers in flight */
+extern void sim_spi_sync(void);
+
+/* TIM2 prescaler (as taken over at the last update) and SPI1 clock
+   divider the hardware runs with */
+extern unsigned int sim_tim2_prescaler(void);
+extern unsigned int sim_spi1_br(void);
+
+/* host sets the configuration, as after enumeration */
+extern void sim_usb_configure(void);
+/* bulk OUT packet, returns 0 if it is NAKed */
+extern int sim_usb_bulk(const uint8_t *data, unsigned int len);
+/* control request with its data stage, returns 0 if it is stalled */
+extern int sim_usb_control(uint8_t type, uint8_t request, uint16_t value,
+			   uint16_t index, const uint8_t *data, uint16_t len);
+
+/* bytes shifted into the column drivers, like a row of
+   ledpanel_shiftreg_t: chain 0 first */
+struct sim_row {
+	uint8_t data[LEDPANEL_SPI_BYTES];
+	/* commit (ledpanel_buffer_shown) it came from, -1 if not from the
+	   shown image */
+	int tag;
+	int torn; /* not a single complete transfer */
+};
+
+/* called back by sim_hw.c: a row latched by tim2_isr(), shown with
+   row address addr from now on */
+extern void sim_panel_row(unsigned int addr, const struct sim_row *row);
+/* row (the last latched) lit for cycles */
+extern void sim_panel_light(unsigned int addr, const struct sim_row *row,
+			    uint64_t cycles);
+
+/* MBI5029 configuration writes (gain) */
+extern unsigned int sim_cfg_writes;
+
+#endif
@@ -0,0 +1,879 @@
+/*
+ * This file is part of subway_led_panel_stm32f103, originally
+ * distributed at https://github.com/vogelchr/subway_led_panel_stm32f103.
+ *
+ *     Copyright (c) 2021 Christian Vogel <vogelchr@vogel.cx>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Peripherals of the STM32F103 as far as the firmware uses them, and the
+ * column drivers (MBI5029) on the panel: registers are plain memory,
+ * looked at whenever the firmware accesses one of the SPI or DMA, the
+ * GPIOs and TIM2 are only used through libopencm3 functions, which are
+ * implemented here.
+ */
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/usb/usbd.h>
+
+uint64_t sim_now;
+unsigned int sim_cfg_writes;
+
+uint32_t rcc_ahb_frequency = SIM_HZ;
+uint32_t rcc_apb1_frequency = SIM_HZ / 2;
+uint32_t rcc_apb2_frequency = SIM_HZ;
+
+static void fatal(const char *msg)
+{
+	fprintf(stderr, "sim: %s\n", msg);
+	exit(2);
+}
+
+/* === registers === */
+
+#define SIM_REGS 64
+
+static struct {
+	uint32_t addr;
+	volatile uint32_t val;
+} regs[SIM_REGS];
+static unsigned int nregs;
+
+static volatile uint32_t *reg(uint32_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nregs; i++)
+		if (regs[i].addr == addr)
+			return &regs[i].val;
+	if (nregs == SIM_REGS)
+		fatal("too many registers");
+	regs[nregs].addr = addr;
+	return &regs[nregs++].val;
+}
+
+#define CCR(ch) (DMA1 + 0x08 + 0x14 * ((ch) - 1))
+#define CNDTR(ch) (DMA1 + 0x0c + 0x14 * ((ch) - 1))
+#define CMAR(ch) (DMA1 + 0x14 + 0x14 * ((ch) - 1))
+#define CR1(spi) ((spi) + 0x00)
+#define SR(spi) ((spi) + 0x08)
+
+/* busy waiting for the SPI takes a few cycles per look, and must end */
+#define SIM_POLL_CYCLES 4
+#define SIM_POLL_MAX SIM_HZ /* cycles in one go */
+
+static uint64_t poll_start, poll_last;
+
+volatile uint32_t *sim_reg(uint32_t addr)
+{
+	if (addr - DMA1 < 0x100 || addr - SPI1 < 0x10 || addr - SPI2 < 0x10) {
+		if (addr == SR(SPI1) || addr == SR(SPI2) ||
+		    addr == CNDTR(3) || addr == CNDTR(5)) {
+			if (sim_now != poll_last)
+				poll_start = sim_now;
+			sim_now += SIM_POLL_CYCLES;
+			poll_last = sim_now;
+			if (sim_now - poll_start > SIM_POLL_MAX)
+				fatal("firmware waits for the SPI forever");
+		}
+		sim_spi_sync();
+	}
+	return reg(addr);
+}
+
+/* === GPIO === */
+
+#define PIN_ROW 0x0007 /* PA0..2, row address */
+#define PIN_NE1 GPIO3 /* PA3, row drivers off, TIM2 OC4 */
+#define PIN_LE GPIO4
+#define PIN_OE GPIO8 /* column drivers on (inverted on the panel) */
+
+static uint16_t odr[3], altfn[3];
+
+static unsigned int port_idx(uint32_t port)
+{
+	switch (port) {
+	case GPIOA:
+		return 0;
+	case GPIOB:
+		return 1;
+	case GPIOC:
+		return 2;
+	}
+	fatal("unknown GPIO port");
+	return 0;
+}
+
+/* === TIM2, counting at SIM_HZ / (PSC + 1) === */
+
+static struct {
+	int cen, uie, oc4;
+	uint64_t start; /* cycle of count 0, while counting */
+	uint32_t cnt; /* while stopped */
+	uint32_t psc, psc_next; /* the prescaler is taken over at update */
+	uint32_t arr, ccr4;
+	int wrap; /* ARR set below the count, runs up to 0xffff first */
+} tim;
+
+static uint64_t tim_tick(void)
+{
+	return tim.psc + 1;
+}
+
+static uint32_t tim_cnt(void)
+{
+	return tim.cen ? (sim_now - tim.start) / tim_tick() : tim.cnt;
+}
+
+unsigned int sim_tim2_prescaler(void)
+{
+	return tim.psc;
+}
+
+uint64_t sim_tim2_next(void)
+{
+	if (!tim.cen)
+		return UINT64_MAX;
+	return tim.start + (tim.wrap ? 0x10000 : tim.arr + 1) * tim_tick();
+}
+
+/* === column drivers, fed by SPI1 and DMA1 ch3 (SPI2 and ch5) === */
+
+#define CHAIN_BITS (LEDPANEL_CHAIN_BYTES * 8)
+#define TAG_BITBANG -2
+
+struct chain {
+	unsigned int dma_ch;
+	uint32_t spi, port; /* port of SCK and MOSI */
+	uint16_t sck, mosi;
+
+	/* DMA transfer */
+	int en;
+	uint64_t t0;
+	unsigned int n, done, byte_cycles;
+	uint32_t cmar;
+	int tag;
+
+	/* shift registers, oldest bit at head, and where they came from */
+	uint8_t bits[CHAIN_BITS];
+	unsigned int head, tag_bits;
+	int bits_tag;
+
+	/* output latches */
+	uint8_t latch[LEDPANEL_CHAIN_BYTES];
+	int latch_tag, latch_torn;
+
+	int special; /* configuration mode */
+	unsigned int hist; /* OE, LE at the last five clocks, 2 bits each */
+};
+
+static struct chain chains[LEDPANEL_CHAINS] = {
+	{ .dma_ch = 3, .spi = SPI1, .port = GPIOA,
+	  .sck = GPIO_SPI1_SCK, .mosi = GPIO_SPI1_MOSI },
+#if LEDPANEL_CHAINS > 1
+	{ .dma_ch = 5, .spi = SPI2, .port = GPIOB,
+	  .sck = GPIO_SPI2_SCK, .mosi = GPIO_SPI2_MOSI },
+#endif
+};
+
+static void shift_bit(struct chain *c, int bit, int tag)
+{
+	if (tag != c->bits_tag) {
+		c->bits_tag = tag;
+		c->tag_bits = 0;
+	}
+	if (c->tag_bits < CHAIN_BITS)
+		c->tag_bits++;
+	c->bits[c->head] = bit;
+	c->head = (c->head + 1) % CHAIN_BITS;
+}
+
+/* the last CHAIN_BITS bits shifted in, laid out like they were in
+   memory (LSB first) */
+static void chain_latch(struct chain *c)
+{
+	unsigned int i;
+
+	memset(c->latch, 0, sizeof(c->latch));
+	for (i = 0; i < CHAIN_BITS; i++)
+		if (c->bits[(c->head + i) % CHAIN_BITS])
+			c->latch[i / 8] |= 1 << (i % 8);
+	c->latch_tag = c->bits_tag;
+	c->latch_torn = c->tag_bits < CHAIN_BITS;
+}
+
+static int pin_altfn(uint32_t port, uint16_t pin)
+{
+	return !!(altfn[port_idx(port)] & pin);
+}
+
+/* commit the DMA reads from, -1 if not the image being shown */
+static int dma_tag(uint32_t cmar)
+{
+	uintptr_t img = (uintptr_t)ledpanel_buffer_shiftreg;
+
+	if (cmar >= img && cmar < img + sizeof(ledpanel_shiftreg_t))
+		return ledpanel_buffer_shown;
+	return -1;
+}
+
+/* bytes shifted out until now, memory is read as it goes */
+static void chain_advance(struct chain *c)
+{
+	const uint8_t *p = (const uint8_t *)(uintptr_t)c->cmar;
+	uint64_t t = (sim_now - c->t0) / c->byte_cycles;
+	unsigned int target = t < c->n ? t : c->n;
+	unsigned int i;
+	uint8_t b;
+
+	while (c->done < target) {
+		b = p[c->done++];
+		if (!pin_altfn(c->port, c->sck))
+			continue; /* SPI not connected to the pins */
+		for (i = 0; i < 8; i++)
+			shift_bit(c, (b >> i) & 1, c->tag);
+	}
+
+	/* DMA is a byte ahead of the shift register */
+	*reg(CNDTR(c->dma_ch)) = c->n - (c->done + 1 < c->n ? c->done + 1 : c->n);
+	*reg(SR(c->spi)) = SPI_SR_TXE | (c->done < c->n ? SPI_SR_BSY : 0);
+}
+
+static void chain_sync(struct chain *c)
+{
+	uint32_t ccr = *reg(CCR(c->dma_ch));
+	unsigned int br;
+
+	if (c->en) {
+		chain_advance(c);
+		if (!(ccr & DMA_CCR_EN))
+			c->en = 0;
+		return;
+	}
+	if (!(ccr & DMA_CCR_EN))
+		return;
+	if (ccr & DMA_CCR_CIRC)
+		fatal("circular DMA (HW_MATRIX_DMA_SCAN) is not simulated");
+
+	/* SPI2 runs from APB1, at half the clock */
+	br = (*reg(CR1(c->spi)) >> 3) & 7;
+	c->en = 1;
+	c->t0 = sim_now;
+	c->n = *reg(CNDTR(c->dma_ch));
+	c->done = 0;
+	c->cmar = *reg(CMAR(c->dma_ch));
+	c->tag = dma_tag(c->cmar);
+	c->byte_cycles = 8 * (2 << br) * (c->spi == SPI2 ? 2 : 1);
+	chain_advance(c);
+}
+
+unsigned int sim_spi1_br(void)
+{
+	return (*reg(CR1(SPI1)) >> 3) & 7;
+}
+
+void sim_spi_sync(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < LEDPANEL_CHAINS; i++)
+		chain_sync(&chains[i]);
+}
+
+/* bit-banged SCK rising */
+static void chain_clock(struct chain *c)
+{
+	int oe = !!(odr[0] & PIN_OE), le = !!(odr[0] & PIN_LE);
+
+	shift_bit(c, !!(odr[port_idx(c->port)] & c->mosi), TAG_BITBANG);
+
+	/* LE during the last bit writes the configuration */
+	if (c->special && le && c == &chains[LEDPANEL_CHAINS - 1])
+		sim_cfg_writes++;
+
+	/* mode switch: OE high during the second of five clocks, LE high
+	   during the fourth for special mode (see hw_matrix.c) */
+	c->hist = ((c->hist << 2) | oe | le << 1) & 0x3ff;
+	if ((c->hist & ~(2 << 2)) == 1 << 6)
+		c->special = !!(c->hist & (2 << 2));
+}
+
+static void row_get(struct sim_row *row)
+{
+	unsigned int i;
+
+	row->tag = chains[0].latch_tag;
+	row->torn = 0;
+	for (i = 0; i < LEDPANEL_CHAINS; i++) {
+		memcpy(&row->data[i * LEDPANEL_CHAIN_BYTES], chains[i].latch,
+		       LEDPANEL_CHAIN_BYTES);
+		if (chains[i].latch_torn || chains[i].latch_tag != row->tag)
+			row->torn = 1;
+	}
+}
+
+/* === light === */
+
+static uint64_t light_t;
+
+/* the row has been lit since light_t as the pins say, called before any
+   of them changes */
+static void light_flush(void)
+{
+	uint64_t a = light_t, b = sim_now, lit, on, off;
+	struct sim_row row;
+
+	light_t = sim_now;
+	if (b <= a || !(odr[0] & PIN_OE))
+		return;
+
+	if (!pin_altfn(GPIOA, PIN_NE1)) {
+		lit = (odr[0] & PIN_NE1) ? 0 : b - a;
+	} else if (!tim.oc4) {
+		lit = 0;
+	} else if (!tim.cen) {
+		lit = tim.cnt >= tim.ccr4 ? b - a : 0;
+	} else {
+		/* PWM1: nE1 high (off) while the count is below CCR4 */
+		on = tim.start + tim.ccr4 * tim_tick();
+		off = tim.start + (tim.arr + 1) * tim_tick();
+		if (on < a)
+			on = a;
+		if (off > b)
+			off = b;
+		lit = off > on ? off - on : 0;
+	}
+	if (!lit)
+		return;
+	row_get(&row);
+	sim_panel_light(odr[0] & PIN_ROW, &row, lit);
+}
+
+/* === GPIO functions === */
+
+static int in_isr, row_latched;
+
+static void gpio_write(uint32_t port, uint16_t val)
+{
+	unsigned int p = port_idx(port), i;
+	uint16_t rise = val & ~odr[p];
+	struct chain *c;
+
+	if (val == odr[p])
+		return;
+	sim_spi_sync();
+	if (port == GPIOA)
+		light_flush();
+	odr[p] = val;
+
+	/* LE while bit-banging belongs to a mode switch or configuration
+	   write, only the one with the SPI connected latches a row */
+	if (port == GPIOA && (rise & PIN_LE) &&
+	    pin_altfn(GPIOA, GPIO_SPI1_SCK)) {
+		for (i = 0; i < LEDPANEL_CHAINS; i++)
+			if (!chains[i].special)
+				chain_latch(&chains[i]);
+		row_latched |= in_isr;
+	}
+
+	for (i = 0; i < LEDPANEL_CHAINS; i++) {
+		c = &chains[i];
+		if (port == c->port && (rise & c->sck) &&
+		    !pin_altfn(c->port, c->sck))
+			chain_clock(c);
+	}
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios)
+{
+	gpio_write(gpioport, odr[port_idx(gpioport)] | gpios);
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios)
+{
+	gpio_write(gpioport, odr[port_idx(gpioport)] & ~gpios);
+}
+
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf,
+		   uint16_t gpios)
+{
+	unsigned int p = port_idx(gpioport);
+
+	sim_spi_sync();
+	if (gpioport == GPIOA)
+		light_flush();
+	if (mode != GPIO_MODE_INPUT && cnf == GPIO_CNF_OUTPUT_ALTFN_PUSHPULL)
+		altfn[p] |= gpios;
+	else
+		altfn[p] &= ~gpios;
+}
+
+/* === RCC, NVIC === */
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken)
+{
+	(void)clken;
+}
+
+void rcc_periph_reset_pulse(enum rcc_periph_rst rst)
+{
+	(void)rst;
+	light_flush();
+	memset(&tim, 0, sizeof(tim));
+}
+
+static uint32_t irq_enabled;
+static int usb_irq_pending;
+
+static void usb_irq(void)
+{
+	if (!(irq_enabled & (1 << NVIC_USB_LP_CAN_RX0_IRQ))) {
+		usb_irq_pending = 1;
+		return;
+	}
+	usb_irq_pending = 0;
+	usb_lp_can_rx0_isr();
+}
+
+void nvic_enable_irq(uint8_t irqn)
+{
+	irq_enabled |= 1 << irqn;
+	if (irqn == NVIC_USB_LP_CAN_RX0_IRQ && usb_irq_pending)
+		usb_irq();
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+	irq_enabled &= ~(1 << irqn);
+}
+
+void nvic_set_priority(uint8_t irqn, uint8_t priority)
+{
+	(void)irqn;
+	(void)priority;
+}
+
+/* === timer functions, TIM2 only === */
+
+void timer_set_mode(uint32_t timer, uint32_t clock_div, uint32_t alignment,
+		    uint32_t direction)
+{
+	(void)timer;
+	(void)clock_div;
+	(void)alignment;
+	(void)direction;
+}
+
+void timer_set_prescaler(uint32_t timer, uint32_t value)
+{
+	(void)timer;
+	tim.psc_next = value;
+}
+
+void timer_set_period(uint32_t timer, uint32_t period)
+{
+	(void)timer;
+	light_flush();
+	tim.arr = period;
+	tim.wrap = tim.cen && tim_cnt() > tim.arr;
+}
+
+void timer_set_counter(uint32_t timer, uint32_t count)
+{
+	(void)timer;
+	light_flush();
+	if (tim.cen)
+		tim.start = sim_now - count * tim_tick();
+	else
+		tim.cnt = count;
+}
+
+void timer_set_oc_mode(uint32_t timer, enum tim_oc_id oc_id,
+		       enum tim_oc_mode oc_mode)
+{
+	(void)timer;
+	if (oc_id == TIM_OC4 && oc_mode != TIM_OCM_PWM1)
+		fatal("OC4 must be PWM1");
+}
+
+void timer_set_oc_polarity_high(uint32_t timer, enum tim_oc_id oc_id)
+{
+	(void)timer;
+	(void)oc_id;
+}
+
+void timer_set_oc_value(uint32_t timer, enum tim_oc_id oc_id, uint32_t value)
+{
+	(void)timer;
+	if (oc_id != TIM_OC4)
+		return;
+	light_flush();
+	tim.ccr4 = value;
+}
+
+void timer_enable_oc_output(uint32_t timer, enum tim_oc_id oc_id)
+{
+	(void)timer;
+	light_flush();
+	if (oc_id == TIM_OC4)
+		tim.oc4 = 1;
+}
+
+void timer_disable_oc_output(uint32_t timer, enum tim_oc_id oc_id)
+{
+	(void)timer;
+	light_flush();
+	if (oc_id == TIM_OC4)
+		tim.oc4 = 0;
+}
+
+void timer_enable_irq(uint32_t timer, uint32_t irq)
+{
+	(void)timer;
+	if (irq & ~TIM_DIER_UIE)
+		fatal("TIM2 DMA requests (HW_MATRIX_DMA_SCAN) are not simulated");
+	tim.uie = 1;
+}
+
+void timer_disable_irq(uint32_t timer, uint32_t irq)
+{
+	(void)timer;
+	if (irq & TIM_DIER_UIE)
+		tim.uie = 0;
+}
+
+void timer_enable_counter(uint32_t timer)
+{
+	(void)timer;
+	if (tim.cen)
+		return;
+	light_flush();
+	tim.start = sim_now - tim.cnt * tim_tick();
+	tim.cen = 1;
+}
+
+void timer_disable_counter(uint32_t timer)
+{
+	(void)timer;
+	light_flush();
+	tim.cnt = tim_cnt();
+	tim.cen = 0;
+}
+
+void timer_clear_flag(uint32_t timer, uint32_t flag)
+{
+	(void)timer;
+	(void)flag;
+}
+
+/* with timer_update_on_overflow(), UG doesn't interrupt */
+void timer_generate_event(uint32_t timer, uint32_t event)
+{
+	(void)timer;
+	if (!(event & TIM_EGR_UG))
+		return;
+	light_flush();
+	tim.psc = tim.psc_next;
+	tim.start = sim_now;
+	tim.cnt = 0;
+	tim.wrap = 0;
+}
+
+void timer_update_on_overflow(uint32_t timer)
+{
+	(void)timer;
+}
+
+void sim_tim2_event(void)
+{
+	struct sim_row row;
+	uint64_t t = sim_tim2_next();
+
+	light_flush();
+	tim.start = t;
+	if (tim.wrap) { /* overflow at 0xffff, no update event */
+		tim.wrap = 0;
+		return;
+	}
+	tim.psc = tim.psc_next;
+	/* the CPU was stalled (flash), updates missed meanwhile are one */
+	while (sim_tim2_next() <= sim_now)
+		tim.start = sim_tim2_next();
+	if (!tim.uie || !(irq_enabled & (1 << NVIC_TIM2_IRQ)))
+		return;
+
+	in_isr = 1;
+	row_latched = 0;
+	tim2_isr();
+	sim_spi_sync(); /* the next row starts shifting */
+	in_isr = 0;
+
+	if (row_latched) {
+		row_get(&row);
+		sim_panel_row(odr[0] & PIN_ROW, &row);
+	}
+}
+
+/* === flash, 64k, the CPU stalls while it's busy === */
+
+#define SIM_FLASH_BYTES (64 * 1024)
+#define SIM_FLASH_PAGE 1024
+#define SIM_FLASH_ERASE_CYCLES (SIM_HZ / 50) /* 20 ms */
+#define SIM_FLASH_PROGRAM_CYCLES (SIM_HZ / 20000) /* 50 us */
+
+uint8_t sim_flash[SIM_FLASH_BYTES]
+	__attribute__((aligned(SIM_FLASH_PAGE))) = {
+	[0 ... SIM_FLASH_BYTES - 1] = 0xff
+};
+
+/* end of the firmware, as in the libopencm3 linker script: 16k */
+__asm__(".globl _data_loadaddr, _data, _edata\n"
+	".set _data_loadaddr, sim_flash + 16384\n"
+	".set _data, sim_flash\n"
+	".set _edata, sim_flash\n");
+
+static uint32_t flash_sr;
+
+static uint8_t *flash_ptr(uint32_t addr, unsigned int len)
+{
+	if (addr < FLASH_BASE || addr - FLASH_BASE + len > SIM_FLASH_BYTES)
+		return NULL;
+	return &sim_flash[addr - FLASH_BASE];
+}
+
+void flash_unlock(void)
+{
+}
+
+void flash_lock(void)
+{
+}
+
+void flash_erase_page(uint32_t page_address)
+{
+	uint8_t *p = flash_ptr(page_address & ~(SIM_FLASH_PAGE - 1),
+			       SIM_FLASH_PAGE);
+
+	flash_sr = 0;
+	if (!p) {
+		flash_sr = FLASH_SR_WRPRTERR;
+		return;
+	}
+	memset(p, 0xff, SIM_FLASH_PAGE);
+	sim_now += SIM_FLASH_ERASE_CYCLES;
+}
+
+void flash_program_half_word(uint32_t address, uint16_t data)
+{
+	uint8_t *p = flash_ptr(address, 2);
+
+	flash_sr = 0;
+	if (!p || address % 2) {
+		flash_sr = FLASH_SR_WRPRTERR;
+		return;
+	}
+	if (p[0] != 0xff || p[1] != 0xff) { /* not erased */
+		flash_sr = FLASH_SR_PGERR;
+		return;
+	}
+	p[0] = data;
+	p[1] = data >> 8;
+	sim_now += SIM_FLASH_PROGRAM_CYCLES;
+}
+
+uint32_t flash_get_status_flags(void)
+{
+	return flash_sr;
+}
+
+uint16_t desig_get_flash_size(void)
+{
+	return SIM_FLASH_BYTES / 1024;
+}
+
+/* === USB === */
+
+struct _usbd_device {
+	int unused;
+};
+struct _usbd_driver {
+	int unused;
+};
+
+const usbd_driver st_usbfs_v1_usb_driver;
+static usbd_device usbd_dev;
+
+volatile uint32_t sim_usb_epr[8];
+uint8_t sim_usb_pma[1024] __attribute__((aligned(4)));
+
+static usbd_set_config_callback config_cb;
+static usbd_control_callback control_cb;
+static uint8_t control_type, control_mask;
+static usbd_endpoint_callback bulk_cb;
+static uint8_t *control_buf;
+static uint16_t control_size;
+
+uint16_t sim_usb_get_reg(volatile uint32_t *reg)
+{
+	return *reg;
+}
+
+/* toggle bits flip when written 1, CTR flags are cleared by 0 */
+void sim_usb_set_reg(volatile uint32_t *reg, uint16_t val)
+{
+	const uint16_t tog = USB_EP_RX_DTOG | USB_EP_RX_STAT |
+			     USB_EP_TX_DTOG | USB_EP_TX_STAT;
+	const uint16_t rw = USB_EP_TYPE | USB_EP_KIND | USB_EP_ADDR;
+	const uint16_t ctr = USB_EP_RX_CTR | USB_EP_TX_CTR;
+	uint16_t old = *reg;
+
+	*reg = ((old ^ val) & tog) | (val & rw) | (old & val & ctr) |
+	       (old & USB_EP_SETUP);
+}
+
+usbd_device *usbd_init(const usbd_driver *driver,
+		       const struct usb_device_descriptor *dev,
+		       const struct usb_config_descriptor *conf,
+		       const char * const *strings, int num_strings,
+		       uint8_t *control_buffer, uint16_t control_buffer_size)
+{
+	(void)driver;
+	(void)dev;
+	(void)conf;
+	(void)strings;
+	(void)num_strings;
+	control_buf = control_buffer;
+	control_size = control_buffer_size;
+	return &usbd_dev;
+}
+
+int usbd_register_set_config_callback(usbd_device *dev,
+				      usbd_set_config_callback callback)
+{
+	(void)dev;
+	config_cb = callback;
+	return 0;
+}
+
+int usbd_register_control_callback(usbd_device *dev, uint8_t type,
+				   uint8_t type_mask,
+				   usbd_control_callback callback)
+{
+	(void)dev;
+	control_type = type;
+	control_mask = type_mask;
+	control_cb = callback;
+	return 0;
+}
+
+void usbd_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
+		   uint16_t max_size, usbd_endpoint_callback callback)
+{
+	(void)dev;
+	(void)max_size;
+	if (addr != 0x01 || type != USB_ENDPOINT_ATTR_BULK)
+		fatal("only bulk OUT endpoint 1 is simulated");
+	bulk_cb = callback;
+	sim_usb_epr[1] = USB_EP_RX_STAT_VALID | 0x01; /* bulk, address 1 */
+}
+
+void usbd_poll(usbd_device *dev)
+{
+	if ((sim_usb_epr[1] & USB_EP_RX_CTR) && bulk_cb)
+		bulk_cb(dev, 0x01);
+}
+
+void sim_usb_configure(void)
+{
+	if (config_cb)
+		config_cb(&usbd_dev, 1);
+}
+
+int sim_usb_bulk(const uint8_t *data, unsigned int len)
+{
+	uint16_t r = sim_usb_epr[1];
+	uint32_t *addr, *count;
+	uint16_t w;
+	unsigned int i;
+
+	if (!bulk_cb || (r & USB_EP_RX_STAT) != USB_EP_RX_STAT_VALID)
+		return 0;
+	if (!(r & USB_EP_KIND))
+		fatal("bulk endpoint not double buffered");
+
+	/* NAK while the buffer to be written is the one the firmware
+	   holds (DTOG_RX == SW_BUF), buffer 1 is the RX descriptor's */
+	if (!(r & USB_EP_RX_DTOG) == !(r & USB_EP_TX_DTOG))
+		return 0;
+	if (r & USB_EP_RX_DTOG) {
+		addr = USB_EP_RX_ADDR(0x01);
+		count = USB_EP_RX_COUNT(0x01);
+	} else {
+		addr = USB_EP_TX_ADDR(0x01);
+		count = USB_EP_TX_COUNT(0x01);
+	}
+
+	for (i = 0; i < len; i += 2) {
+		w = data[i] | (i + 1 < len ? data[i + 1] << 8 : 0);
+		memcpy(&sim_usb_pma[(*addr & 0x3ff) * 2 + i * 2], &w, 2);
+	}
+	*count = (*count & ~0x3ff) | len;
+	sim_usb_epr[1] = (r ^ USB_EP_RX_DTOG) | USB_EP_RX_CTR;
+
+	usb_irq();
+	return 1;
+}
+
+int sim_usb_control(uint8_t type, uint8_t request, uint16_t value,
+		    uint16_t index, const uint8_t *data, uint16_t len)
+{
+	struct usb_setup_data req = {
+		.bmRequestType = type,
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = index,
+		.wLength = len,
+	};
+	usbd_control_complete_callback complete = NULL;
+	uint8_t *buf = control_buf;
+	uint16_t n = len;
+
+	if (!control_cb || (type & control_mask) != control_type ||
+	    len > control_size)
+		return 0;
+	if (!(type & USB_REQ_TYPE_IN))
+		memcpy(control_buf, data, len);
+	if (control_cb(&usbd_dev, &req, &buf, &n, &complete) !=
+	    USBD_REQ_HANDLED)
+		return 0;
+	if (complete)
+		complete(&usbd_dev, &req);
+	return 1;
+}